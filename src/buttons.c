@@ -24,6 +24,10 @@
 
 #define MS_TO_COUNTDOWN(ms) (ms / SCAN_PERIOD_MS)
 
+// DALI bindings carry the bus number above the 7 bit short, group or broadcast address.
+#define DALI_BINDING_BUS(address) ((address) >> 7)
+#define DALI_BINDING_ADDR(address) ((address) & 0x7F)
+
 // We are assuming 2MB of flash, and we use the last sector (4Kb).  The very
 // last value will be set to a magic value.
 #define FLASH_CONFIG_OFFSET ((2 * 1024 * 1024) - FLASH_SECTOR_SIZE)
@@ -52,25 +56,20 @@ static void fetch_binding(unsigned int addr, binding_t *binding) {
 #define MAGIC_VALUE (('M' << 24) | ('E' << 16) | ('C' << 8) | 'Z')
 static inline bool flash_bindings_invalid() { return bindings[NUM_BINDINGS - 1] != MAGIC_VALUE; }
 
+static inline uint16_t binding_from_flash(uint addr) {
+    return flash_bindings_invalid() ? 0xC000 : bindings[addr];
+}
+
 void init_binding_reg_from_flash(uint addr, binding_t *binding) {
-    uint16_t val;
-    if (flash_bindings_invalid()) {
-        val = 0xC000;
-    } else {
-        val = bindings[addr];
-    }
-    set_holding_reg(BINDINGS_HR_BASE + addr, val);
+    set_holding_reg(BINDINGS_HR_BASE + addr, binding_from_flash(addr));
 }
 
 /**
+ * Writes every binding from the holding registers to flash.
+ *
  * NOTE this function must only be called from the second core.
  */
-void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding) {
-    assert(addr < NUM_FIXTURES * NUM_BUTTONS_PER_FIXTURE);
-    // First, set the holding register
-    set_holding_reg(addr, encoded_binding);
-
-    // Then write the bindings to flash
+void persist_bindings() {
     // We need to re-write the entire config sector
     uint32_t sector[NUM_BINDINGS];
     for (int i = 0; i < NUM_BINDINGS - 1; i++) {
@@ -89,6 +88,17 @@ void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding) {
     multicore_lockout_end_blocking();
 }
 
+/**
+ * NOTE this function must only be called from the second core.
+ */
+void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding) {
+    assert(addr < NUM_FIXTURES * NUM_BUTTONS_PER_FIXTURE);
+    // First, set the holding register
+    set_holding_reg(addr, encoded_binding);
+    // Then write the bindings to flash
+    persist_bindings();
+}
+
 /**
  * Processes the (potentially repeated) pressing of a button
  *
@@ -98,6 +108,7 @@ void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding) {
  */
 static void button_pressed(button_ctx_t *ctx) {
     binding_t binding;
+    int bus, dali_addr;
     set_discrete_input(ctx->addr);
     fetch_binding(ctx->addr, &binding);
 
@@ -107,19 +118,27 @@ static void button_pressed(button_ctx_t *ctx) {
     // Side effects of pressing button.
     switch (binding.type) {
         case BINDING_TYPE_DALI:
+            bus = DALI_BINDING_BUS(binding.address);
+            dali_addr = DALI_BINDING_ADDR(binding.address);
             // Dali non-fadeable toggles on press.
-            if (binding.address >= 0 && binding.address < 64) {
-                if (!dali_is_fadeable(binding.address)) {
-                    dali_toggle(binding.address, NULL);
+            if (dali_addr < 64) {
+                if (!dali_is_fadeable(bus, dali_addr)) {
+                    dali_toggle(bus, dali_addr, NULL);
                 }
+            } else if (dali_addr >= DALI_GROUP_ADDR(0) && dali_addr <= DALI_GROUP_ADDR(15)) {
+                // A whole group (e.g. a room) toggles together, which will be sent as one group frame.
+                dali_toggle_many(bus, dali_group_members(bus, dali_addr - DALI_GROUP_ADDR(0)), NULL);
+            } else if (dali_addr == DALI_BROADCAST_ADDR) {
+                dali_toggle_many(bus, DALI_ALL_LIGHTS, NULL);
             }
             break;
         case BINDING_TYPE_MODBUS:
             // Modbus always toggles upon first press.
             // defer_log(tag, "Button %d/%d Pressed. binding to MODBUS address %d",
             // fixture, button_id, binding.address);
-            if (binding.address < NUM_BUTTONS_PER_FIXTURE * NUM_FIXTURES) {
-                modbus_downstream_set_coil(1, binding.address, is_coil_set(binding.address) ? 0x0000 : 0xFF00, NULL);
+            // The binding's address is the relay's coil number, which also picks the device.
+            if (binding.address < MAX_COILS) {
+                modbus_downstream_toggle_coil(binding.address, NULL);
             }
             break;
         default:
@@ -157,11 +176,11 @@ static void button_timeout_check(button_ctx_t *ctx) {
             // enqueue_device_update(EVT_BTN_HELD, ctx);
 
             // Only DALI devices are dimmable
-            if (binding.type == BINDING_TYPE_DALI && binding.address < 64) {
-                if (dali_is_fadeable(binding.address)) {
+            if (binding.type == BINDING_TYPE_DALI && DALI_BINDING_ADDR(binding.address) < 64) {
+                if (dali_is_fadeable(DALI_BINDING_BUS(binding.address), DALI_BINDING_ADDR(binding.address))) {
                     // defer_log(tag, "Fading DALI device %d direction %d",
                     // binding.address, ctx->velocity);
-                    dali_fade(binding.address, ctx->velocity, NULL);
+                    dali_fade(DALI_BINDING_BUS(binding.address), DALI_BINDING_ADDR(binding.address), ctx->velocity, NULL);
                 } else {
                     if (ctx->num_repeats == 1) {
                         // defer_log(tag, "Ignoring long hold for non-fadeable DALI device
@@ -188,9 +207,9 @@ static void button_released(button_ctx_t *ctx) {
         // We released before the countdown timer went off.
         ctx->countdown = 0;
 
-        if (binding.type == BINDING_TYPE_DALI && binding.address < 64) {
-            if (dali_is_fadeable(binding.address)) {
-                dali_toggle(binding.address, NULL);
+        if (binding.type == BINDING_TYPE_DALI && DALI_BINDING_ADDR(binding.address) < 64) {
+            if (dali_is_fadeable(DALI_BINDING_BUS(binding.address), DALI_BINDING_ADDR(binding.address))) {
+                dali_toggle(DALI_BINDING_BUS(binding.address), DALI_BINDING_ADDR(binding.address), NULL);
             }
         }
     } else {
@@ -200,14 +219,17 @@ static void button_released(button_ctx_t *ctx) {
 }
 
 void buttons_init() {
-    binding_t binding;
+    uint16_t values[MAX_DISCRETE_INPUTS];
 
     // Start with empty discrete inputs.
+    for (int i = 0; i < MAX_DISCRETE_INPUTS; i += 32) {
+        update_discrete_inputs(i, 0xFFFFFFFF, 0);
+    }
     // Copy bindings from flash into holding registers
     for (int i = 0; i < MAX_DISCRETE_INPUTS; i++) {
-        clear_discrete_input(i);
-        init_binding_reg_from_flash(i, &binding);
+        values[i] = binding_from_flash(i);
     }
+    set_holding_regs(BINDINGS_HR_BASE, values, MAX_DISCRETE_INPUTS);
     // test_flash_config();
 
     for (int i = 0; i < NUM_BUTTONS_PER_FIXTURE; i++) {
@@ -247,6 +269,10 @@ void buttons_init() {
     next_fixture_scan_time = get_absolute_time();
 }
 
+absolute_time_t buttons_next_scan_time() {
+    return next_fixture_scan_time;
+}
+
 void buttons_poll() {
     uint32_t val;
 
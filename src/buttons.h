@@ -34,7 +34,11 @@ extern button_ctx_t button_ctx[NUM_FIXTURES * NUM_BUTTONS_PER_FIXTURE];
 void buttons_init();
 void buttons_enumerate();
 void buttons_poll();
+// buttons_poll() has nothing to do before this time.
+absolute_time_t buttons_next_scan_time();
 void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding);
+// For setting many bindings at once: set their holding registers, then write them all to flash with one call of this.
+void persist_bindings();
 void init_binding_reg_from_flash(uint index, binding_t *binding);
 bool is_button_pressed(int fixture, int button);
 
@@ -1,28 +1,58 @@
 #include "dali.h"
 
-#include <hardware/clocks.h>
-#include <hardware/structs/clocks.h>
-#include <pico/stdlib.h>
-#include <pico/util/queue.h>
+#include <pico/sync.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "dali.pio.h"
+#include "dali_hal.h"
 #include "modbus.h"
 #include "regs.h"
 #include "stdbool.h"
 #include "stdint.h"
 
+// Commands queued on behalf of a user (buttons, modbus) always go out before background scans and level polls.
+typedef enum {
+    DALI_PRIORITY_INTERACTIVE = 0,
+    DALI_PRIORITY_BACKGROUND,
+    DALI_NUM_PRIORITIES,
+} dali_priority_t;
+
+// A queued command in one of these classes makes any earlier, unsent command of the same class to the same address
+// pointless, so the newer one replaces it in the queue.
+typedef enum {
+    DALI_COALESCE_NONE = 0,
+    DALI_COALESCE_LEVEL,  // Sets an absolute arc level (DAPC, OFF, RECALL LAST ACTIVE)
+    DALI_COALESCE_FADE,   // UP/DOWN
+    DALI_COALESCE_POLL,   // Level/status read back
+} dali_coalesce_t;
+
+// Number of callers whose commands can be folded into a single queued command.
+#define MAX_SUPERSEDED 3
+
 struct dali_cmd_t;
 typedef void (*cmd_chain_cb_t)(int res, struct dali_cmd_t *cb);
 typedef struct dali_cmd_t {
+    uint8_t bus;
     unsigned int addr;
+    // Lights still to be addressed by a multi-light command, and the ones covered by the frame in flight.  While a
+    // multi-light toggle is still finding out whether its lights are on, covering is the lights that it has yet to ask.
+    dali_light_mask_t lights;
+    dali_light_mask_t covering;
     uint16_t op;
-    uint8_t param;
+    uint16_t param;  // Two byte wide configuration values keep the second byte in the upper half.
     bool sendTwice;
+    uint8_t priority;
+    uint8_t coalesce;
+    bool started;
+    // Called just before the command's first frame goes out, to let it decide what that frame should be.
+    void (*prepare)(struct dali_cmd_t *cmd);
     cmd_chain_cb_t then;
     dali_result_cb_t finally;
+    // Finally handlers of older commands that this one replaced in the queue.  They get the same result.
+    dali_result_cb_t superseded[MAX_SUPERSEDED];
+    uint8_t num_superseded;
+    uint64_t queued_at;
 } dali_cmd_t;
 
 #define DALI_ADDR_FROM_CMD(cmd) ((cmd >> 9) & 0x3F)
@@ -78,46 +108,386 @@ typedef struct dali_cmd_t {
 
 #define DALI_MAX_ADDR 63
 
-static const PIO pio = pio0;
-static const unsigned int dali_sm = 0;
+// Fixed depth FIFO that, unlike queue_t, lets us replace an entry that hasn't been sent yet.
+typedef struct {
+    dali_cmd_t *slots;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+} dali_lane_t;
+
+/**
+ * Everything the driver knows about one bus.  Buses share nothing but the register file, so each one has its own queue
+ * and command in flight, and they all run at the same time.
+ */
+typedef struct {
+    unsigned int index;
+    // An enumeration will use 64 entries in the background queue, so we give it some space.
+    dali_cmd_t interactive_slots[16];
+    dali_cmd_t background_slots[70];
+    dali_lane_t queue[DALI_NUM_PRIORITIES];
+    // Commands are queued from both cores.
+    critical_section_t queue_lock;
+    dali_cmd_t in_flight;
+    // A background command chain that was interrupted part way through so that interactive commands could go first.  As
+    // background work is only resumed from here before the background queue is consulted, there can only ever be one.
+    dali_cmd_t preempted;
+
+    bool scan_in_progress;
+    uint64_t scan_started_at;
+    // What the scan has read from the light that it is on, as the bytes of its MINMAX, POWERON, FADE and GROUPS
+    // registers, least significant first.  They go into the registers together once the light's scan is done.
+    uint8_t scanned[8];
+    uint64_t frame_sent_at;
+    dali_stats_t stats;
+
+    // The status bank's level is only trusted until this time.  Zero means that it is stale or unknown.
+    uint64_t shadow_fresh_until[MAX_DALI_LIGHTS];
+    // Bumped whenever a light's level changes (or may have changed).  Level polls carry the generation they were
+    // started under in their param, so that a poll which straddled a change can't mark the shadow fresh.
+    uint8_t shadow_gen[MAX_DALI_LIGHTS];
+
+    // Last value that we broadcast to each of DTR0..DTR2, or -1 if unknown.
+    int dtr_cache[3];
+    uint64_t dtr_cache_valid_until;
+    // Set when a redundant DTR write was skipped, so that dali_poll completes it as though it had been sent.
+    bool elided_result_pending;
+
+    // Time at which each light's level should next be read back, or zero if nothing is scheduled.
+    uint64_t poll_due_at[MAX_DALI_LIGHTS];
+    // Time at which we expect the light's current fade to finish.
+    uint64_t fade_ends_at[MAX_DALI_LIGHTS];
+    // Earliest entry in poll_due_at, so that dali_poll doesn't have to walk the schedule every time round.
+    uint64_t next_poll_due;
+    uint64_t poll_credit_us;
+    uint64_t poll_credit_updated_at;
+} dali_bus_t;
+
+static dali_bus_t buses[DALI_NUM_BUSES];
+
+static dali_toggle_mode_t toggle_mode = DALI_TOGGLE_MODE_SHADOW;
+
+static inline dali_bus_t *bus_of(const dali_cmd_t *cmd) {
+    return &buses[cmd->bus];
+}
 
-#define QUEUE_DEPTH 70
-static queue_t dali_queue;
-static dali_cmd_t in_flight = {.op = 0, .sendTwice = false, .addr = 0xFF, .then = NULL, .finally = NULL, .param = 0};
+// How long a level read back from a gear is trusted for deciding a toggle.  Other bus masters, wall switches and power
+// cycles can all change a light behind our back, so we don't trust it forever.
+#define SHADOW_MAX_AGE_US (30 * 1000 * 1000)
 
-bool dali_scan_in_progress = false;
+static inline void invalidate_shadow(dali_bus_t *bus, unsigned addr) {
+    bus->shadow_fresh_until[addr] = 0;
+    bus->shadow_gen[addr]++;
+}
 
-// ------------------------- in-flight action callbacks ----------------
+static void invalidate_all_shadows(dali_bus_t *bus) {
+    for (int i = 0; i < MAX_DALI_LIGHTS; i++) {
+        invalidate_shadow(bus, i);
+    }
+}
 
-static void request_level_update(int addr);
+static void request_level_update(dali_bus_t *bus, int addr);
 static void scan_got_result(int min, dali_cmd_t *cmd);
 
+// ------------------------- DTR cache ----------------
+
+// Other masters on the bus could write the DTRs too, so we only rely on what we last wrote for a short while.
+#define DTR_CACHE_MAX_AGE_US (1000 * 1000)
+
+static void invalidate_dtr_cache(dali_bus_t *bus) {
+    for (int i = 0; i < count_of(bus->dtr_cache); i++) {
+        bus->dtr_cache[i] = -1;
+    }
+}
+
+// Returns which DTR a frame writes to, or -1 if it isn't a DTR write.
+static int dtr_from_cmd(uint16_t op) {
+    switch (op & 0xFF00) {
+        case DALI_CMD_SET_DTR0(0):
+            return 0;
+        case DALI_CMD_SET_DTR1(0):
+            return 1;
+        case DALI_CMD_SET_DTR2(0):
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// Does the frame change a DTR as a side effect?  Memory bank accesses increment DTR0, and we assume the worst of any
+// special command that we don't recognise.
+static bool cmd_clobbers_dtr(uint16_t op) {
+    bool is_special = (op & 0x8100) == 0x8100 && (op >> 8) >= 0xA1 && (op >> 8) <= 0xCB;
+    return is_special || DALI_CMD_STRIP_ADDR(op) == DALI_CMD_READ_MEMORY_LOCATION(0);
+}
+
+/**
+ * Tracks what we are about to put on the bus, and returns true if it is a DTR write of the value that the DTR is already
+ * known to hold.
+ */
+static bool dtr_write_is_redundant(dali_bus_t *bus, uint16_t op, uint64_t now) {
+    int dtr = dtr_from_cmd(op);
+
+    if (dtr < 0) {
+        if (cmd_clobbers_dtr(op)) {
+            invalidate_dtr_cache(bus);
+        }
+        return false;
+    }
+    if (now < bus->dtr_cache_valid_until && bus->dtr_cache[dtr] == (op & 0xFF)) {
+        return true;
+    }
+    if (now >= bus->dtr_cache_valid_until) {
+        invalidate_dtr_cache(bus);
+    }
+    bus->dtr_cache[dtr] = op & 0xFF;
+    bus->dtr_cache_valid_until = now + DTR_CACHE_MAX_AGE_US;
+    return false;
+}
+
+// ------------------------- fade completion polling ----------------
+
+// While a fade runs we only read the level back this often, to keep the status bank roughly up to date.
+#define FADE_SPARSE_POLL_US (2 * 1000 * 1000)
+// The confirming poll is sent this long after we expect the fade to have finished.
+#define FADE_END_MARGIN_US (50 * 1000)
+// If the gear says it is still fading after we expected it to be done, check again this often.
+#define FADE_OVERRUN_POLL_US (250 * 1000)
+// UP and DOWN always fade for 200ms, at the gear's fade rate.
+#define FADE_UP_DOWN_US (200 * 1000)
+// Used when we don't know a gear's fade time.
+#define FADE_UNKNOWN_US (1000 * 1000)
+
+// Budget for all background level polls on a bus put together.  Each poll is a level query and a status query, so this
+// keeps polling to well under half of the bus' ~30 transactions a second.
+#define POLL_BUDGET_PER_SEC 6
+#define POLL_COST_US (1000 * 1000 / POLL_BUDGET_PER_SEC)
+#define POLL_BURST_US (1000 * 1000)
+
+// DALI fade times 1..15 are 0.5 * sqrt(2^n) seconds.
+static const uint32_t fade_time_ms[16] = {0,     707,   1000,  1414,  2000,  2828,  4000,  5657,
+                                          8000,  11314, 16000, 22627, 32000, 45255, 64000, 90510};
+static const uint32_t ext_fade_multiplier_ms[8] = {0, 100, 1000, 10000, 60000, 0, 0, 0};
+
+/**
+ * Works out how long the gear will take to complete the arc level change that was just sent to it, from the fade time
+ * (and extended fade time) that we read back into the fade bank.
+ */
+static uint64_t predict_fade_us(dali_bus_t *bus, unsigned addr, uint16_t op) {
+    int reg = get_holding_reg(DALI_FADE_HR(bus->index, addr));
+    uint16_t cmd = DALI_CMD_STRIP_ADDR(op);
+
+    if (cmd == DALI_CMD_OFF(0)) {
+        return 0;
+    }
+    if (cmd == DALI_CMD_UP(0) || cmd == DALI_CMD_DOWN(0)) {
+        return FADE_UP_DOWN_US;
+    }
+    if (reg == 0xFFFF) {
+        return FADE_UNKNOWN_US;
+    }
+    unsigned fade_time = (reg >> 4) & 0x0F;
+    if (fade_time) {
+        return fade_time_ms[fade_time] * 1000ull;
+    }
+    // Fade time of 0 means that the extended fade time applies.
+    unsigned ext = reg >> 8;
+    return ((ext & 0x0F) + 1) * ext_fade_multiplier_ms[(ext >> 4) & 0x07] * 1000ull;
+}
+
+static void schedule_level_update(dali_bus_t *bus, unsigned addr, uint64_t when) {
+    if (!bus->poll_due_at[addr] || when < bus->poll_due_at[addr]) {
+        bus->poll_due_at[addr] = when;
+    }
+    if (when < bus->next_poll_due) {
+        bus->next_poll_due = when;
+    }
+}
+
+// Polls sparsely while a fade is expected to be running, then once more just after it should have finished.
+static void schedule_fade_poll(dali_bus_t *bus, unsigned addr, uint64_t now) {
+    uint64_t confirm_at = bus->fade_ends_at[addr] + FADE_END_MARGIN_US;
+    if (now >= bus->fade_ends_at[addr]) {
+        schedule_level_update(bus, addr, now + FADE_OVERRUN_POLL_US);
+    } else if (confirm_at - now > FADE_SPARSE_POLL_US) {
+        schedule_level_update(bus, addr, now + FADE_SPARSE_POLL_US);
+    } else {
+        schedule_level_update(bus, addr, confirm_at);
+    }
+}
+
+static void run_poll_schedule(dali_bus_t *bus) {
+    uint64_t now = dali_hal_time_us();
+    if (now < bus->next_poll_due) {
+        return;
+    }
+
+    bus->poll_credit_us += now - bus->poll_credit_updated_at;
+    if (bus->poll_credit_us > POLL_BURST_US) {
+        bus->poll_credit_us = POLL_BURST_US;
+    }
+    bus->poll_credit_updated_at = now;
+
+    uint64_t next = UINT64_MAX;
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        uint64_t due = bus->poll_due_at[addr];
+        if (!due) {
+            continue;
+        }
+        if (due > now) {
+            next = MIN(next, due);
+        } else if (bus->poll_credit_us >= POLL_COST_US) {
+            bus->poll_credit_us -= POLL_COST_US;
+            bus->poll_due_at[addr] = 0;
+            bus->stats.level_polls++;
+            request_level_update(bus, addr);
+        } else {
+            // Over budget.  Try again once we've earned enough credit for another poll.
+            bus->stats.level_polls_deferred++;
+            next = MIN(next, now + POLL_COST_US - bus->poll_credit_us);
+        }
+    }
+    bus->next_poll_due = next;
+}
+
+// ------------------------- in-flight action callbacks ----------------
+
 static char tmp[30];
 
 static const char *TAG = "DALI";
 
-static void scan_dali_device(int addr) {
+static inline dali_cmd_t *lane_slot(dali_lane_t *lane, unsigned int i) {
+    return &lane->slots[(lane->head + i) % lane->depth];
+}
+
+/**
+ * Folds the finally handler(s) of an older queued command into a newer one, so that every caller still hears about the
+ * outcome.  Returns false if there isn't room, in which case the two can't be coalesced.
+ */
+static bool take_callbacks(dali_cmd_t *newer, const dali_cmd_t *older) {
+    dali_result_cb_t cbs[MAX_SUPERSEDED + 1];
+    unsigned int n = 0;
+
+    if (older->finally) {
+        cbs[n++] = older->finally;
+    }
+    for (int i = 0; i < older->num_superseded; i++) {
+        cbs[n++] = older->superseded[i];
+    }
+    if (newer->num_superseded + n > MAX_SUPERSEDED) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        newer->superseded[newer->num_superseded++] = cbs[i];
+    }
+    return true;
+}
+
+static void raw_cmd_result_handler(int ret, dali_cmd_t *cmd);
+
+// Whether a queued command could affect the light at addr.  Multi-light plans reach the lights in their mask, and a
+// raw frame can reach any light unless it is sent to a short address.
+static bool cmd_may_reach(const dali_cmd_t *cmd, unsigned int addr) {
+    if (cmd->lights || cmd->covering) {
+        return addr < MAX_DALI_LIGHTS && ((cmd->lights | cmd->covering) >> addr) & 1;
+    }
+    if (cmd->then == raw_cmd_result_handler) {
+        return (cmd->op & 0x8000) || DALI_ADDR_FROM_CMD(cmd->op) == addr;
+    }
+    return cmd->addr == addr;
+}
+
+// Queues a command on the bus named in cmd->bus.
+static bool dali_enqueue(dali_cmd_t *cmd, dali_priority_t priority) {
+    dali_bus_t *bus = bus_of(cmd);
+    dali_lane_t *lane = &bus->queue[priority];
+    bool added = false;
+
+    cmd->priority = priority;
+    cmd->started = false;
+    cmd->queued_at = dali_hal_time_us();
+
+    critical_section_enter_blocking(&bus->queue_lock);
+    if (cmd->coalesce != DALI_COALESCE_NONE) {
+        // Only the most recent queued command that reaches this address may be replaced.  Replacing anything earlier
+        // would reorder this command ahead of something else that was asked for in between, including group and
+        // broadcast commands that cover it.
+        for (int i = lane->count - 1; i >= 0; i--) {
+            dali_cmd_t *pending = lane_slot(lane, i);
+            if (cmd_may_reach(pending, cmd->addr)) {
+                if (pending->coalesce == cmd->coalesce && take_callbacks(cmd, pending)) {
+                    // Keep the original queue time, as that is how long the earliest caller has been waiting.
+                    cmd->queued_at = pending->queued_at;
+                    *pending = *cmd;
+                    bus->stats.coalesced++;
+                    added = true;
+                }
+                break;
+            }
+        }
+    }
+    if (!added && lane->count < lane->depth) {
+        *lane_slot(lane, lane->count++) = *cmd;
+        added = true;
+    }
+    critical_section_exit(&bus->queue_lock);
+    if (added) {
+        // Core 0 may be asleep waiting for the bus, and this may have come from core 1.
+        __sev();
+    }
+    return added;
+}
+
+// Queues a command on behalf of a caller of the public API, which may have asked for a bus that doesn't exist.
+static bool dali_submit(int bus, dali_cmd_t *cmd, dali_priority_t priority) {
+    if (bus < 0 || bus >= DALI_NUM_BUSES) {
+        if (cmd->finally) {
+            cmd->finally(DALI_BUS_ERROR);
+        }
+        return false;
+    }
+    cmd->bus = bus;
+    return dali_enqueue(cmd, priority);
+}
+
+static bool lane_remove(dali_bus_t *bus, dali_lane_t *lane, dali_cmd_t *cmd) {
+    bool removed = false;
+
+    critical_section_enter_blocking(&bus->queue_lock);
+    if (lane->count) {
+        *cmd = lane->slots[lane->head];
+        lane->head = (lane->head + 1) % lane->depth;
+        lane->count--;
+        removed = true;
+    }
+    critical_section_exit(&bus->queue_lock);
+    return removed;
+}
+
+static void scan_dali_device(dali_bus_t *bus, int addr) {
     // defer_log(TAG, "Scanning DALI Address %d", addr);
     // This is a new enqueue, rather than a continuation, because we want it
     // possible for other commands to execute interleaved.
 
-    dali_cmd_t cmd = {.op = DALI_CMD_QUERY_DEVICE_TYPE(addr),
+    dali_cmd_t cmd = {.bus = bus->index,
+                      .op = DALI_CMD_QUERY_DEVICE_TYPE(addr),
                       .addr = addr,
                       .then = scan_got_result,
                       .finally = NULL,
                       .sendTwice = false,
                       .param = 0};
-    if (!queue_try_add(&dali_queue, &cmd)) {
+    if (!dali_enqueue(&cmd, DALI_PRIORITY_BACKGROUND)) {
         onError();
     }
 }
 
-static void scan_next(int previousAddr) {
+static void scan_next(dali_bus_t *bus, int previousAddr) {
     if (previousAddr < DALI_MAX_ADDR) {
         // Start a new task to enumerate the next address.
-        scan_dali_device(previousAddr + 1);
+        scan_dali_device(bus, previousAddr + 1);
     } else {
-        dali_scan_in_progress = false;
+        bus->scan_in_progress = false;
+        bus->stats.enumeration_us = dali_hal_time_us() - bus->scan_started_at;
         // defer_log(TAG, "Dali Scan Done");
     }
 }
@@ -135,12 +505,12 @@ static inline char *dali_err_to_str(int val) {
     }
 }
 
-bool dali_is_fadeable(int addr) {
+bool dali_is_fadeable(int bus, int addr) {
     return false;
-    if (addr >= 64) {
+    if (bus < 0 || bus >= DALI_NUM_BUSES || addr >= 64) {
         return false;
     }
-    int minmax = get_holding_reg(DALI_MINMAX_HR_BASE + addr);
+    int minmax = get_holding_reg(DALI_MINMAX_HR(bus, addr));
     int max = minmax >> 8;
     int min = minmax & 0xFF;
     return (min != max);
@@ -150,14 +520,16 @@ static void scan_failed(dali_cmd_t *cmd, int res) {
     // defer_log(TAG, "Scan of device %d cmd 0x%04x %s", addr, cmd->op,
     // dali_err_to_str(res)); enqueue_device_update(EVT_DALI_DEVICE_DISCOVERED,
     // dev);
-    set_holding_reg(DALI_STATUS_HR_BASE + cmd->addr, 0xFFFF);
-    set_holding_reg(DALI_MINMAX_HR_BASE + cmd->addr, 0xFFFF);
-    set_holding_reg(DALI_POWERON_HR_BASE + cmd->addr, 0xFFFF);
-    set_holding_reg(DALI_FADE_HR_BASE + cmd->addr, 0xFFFF);
-    set_holding_reg(DALI_GROUPS_HR_BASE + cmd->addr, 0);
+    invalidate_shadow(bus_of(cmd), cmd->addr);
+    regs_hr_write_t absent[] = {
+        {DALI_STATUS_HR(cmd->bus, cmd->addr), 0xFFFF}, {DALI_MINMAX_HR(cmd->bus, cmd->addr), 0xFFFF},
+        {DALI_POWERON_HR(cmd->bus, cmd->addr), 0xFFFF}, {DALI_FADE_HR(cmd->bus, cmd->addr), 0xFFFF},
+        {DALI_GROUPS_HR(cmd->bus, cmd->addr), 0},
+    };
+    set_holding_reg_list(absent, count_of(absent));
 
     // Start a new task to enumerate the next address.
-    scan_next(cmd->addr);
+    scan_next(bus_of(cmd), cmd->addr);
 }
 
 static uint8_t *memptr;
@@ -214,13 +586,34 @@ static uint8_t *memptr;
 //     }
 // }
 
+// Puts everything that a scan read from a light into its registers at once.
+static void scan_store(dali_bus_t *bus, unsigned addr) {
+    const uint8_t *b = bus->scanned;
+    regs_hr_write_t found[] = {
+        {DALI_MINMAX_HR(bus->index, addr), (b[1] << 8) | b[0]},
+        {DALI_POWERON_HR(bus->index, addr), (b[3] << 8) | b[2]},
+        {DALI_FADE_HR(bus->index, addr), (b[5] << 8) | b[4]},
+        {DALI_GROUPS_HR(bus->index, addr), (b[7] << 8) | b[6]},
+    };
+    set_holding_reg_list(found, count_of(found));
+}
+
+// How many more times a scan asks the same question before giving up on the light, as an answer lost to noise looks
+// just like there being no light there at all.  Counted in the scan's param, which starts again with each question.
+#define SCAN_RETRIES 2
+
 static void scan_got_result(int result, dali_cmd_t *cmd) {
     // defer_log(TAG, "Scan of %d cmd 0x%04x result %d", addr, cmd->op, result);
+    uint8_t *scanned = bus_of(cmd)->scanned;
 
-    if (result < 0) {
+    if (result < 0 && cmd->param < SCAN_RETRIES) {
+        cmd->param++;
+        cmd->then = scan_got_result;
+    } else if (result < 0) {
         scan_failed(cmd, result);
     } else {
         cmd->then = scan_got_result;
+        cmd->param = 0;
 
         switch (DALI_CMD_STRIP_ADDR(cmd->op)) {
             case DALI_CMD_QUERY_DEVICE_TYPE(0):
@@ -229,94 +622,111 @@ static void scan_got_result(int result, dali_cmd_t *cmd) {
                 cmd->op = DALI_CMD_QUERY_MIN(cmd->addr);
                 break;
             case DALI_CMD_QUERY_MIN(0):
-                set_holding_reg_byte(DALI_MINMAX_HR_BASE + cmd->addr, 0, result);
+                scanned[0] = result;
                 cmd->op = DALI_CMD_QUERY_MAX(cmd->addr);
                 break;
             case DALI_CMD_QUERY_MAX(0):
-                set_holding_reg_byte(DALI_MINMAX_HR_BASE + cmd->addr, 1, result);
+                scanned[1] = result;
                 cmd->op = DALI_CMD_QUERY_POWER_ON_LEVEL(cmd->addr);
                 break;
             case DALI_CMD_QUERY_POWER_ON_LEVEL(0):
-                set_holding_reg_byte(DALI_POWERON_HR_BASE + cmd->addr, 0, result);
+                scanned[2] = result;
                 cmd->op = DALI_CMD_QUERY_SYSTEM_FAILURE_LEVEL(cmd->addr);
                 break;
             case DALI_CMD_QUERY_SYSTEM_FAILURE_LEVEL(0):
-                set_holding_reg_byte(DALI_POWERON_HR_BASE + cmd->addr, 1, result);
+                scanned[3] = result;
                 cmd->op = DALI_CMD_QUERY_FADE_RATE_FADE_TIME(cmd->addr);
                 break;
             case DALI_CMD_QUERY_FADE_RATE_FADE_TIME(0):
-                set_holding_reg_byte(DALI_FADE_HR_BASE + cmd->addr, 0, result);
+                scanned[4] = result;
                 cmd->op = DALI_CMD_QUERY_EXTENDED_FADE_RATE(cmd->addr);
                 break;
             case DALI_CMD_QUERY_EXTENDED_FADE_RATE(0):
-                set_holding_reg_byte(DALI_FADE_HR_BASE + cmd->addr, 1, result);
+                scanned[5] = result;
                 cmd->op = DALI_CMD_QUERY_GROUPS_ZERO_TO_SEVEN(cmd->addr);
                 break;
             case DALI_CMD_QUERY_GROUPS_ZERO_TO_SEVEN(0):
-                set_holding_reg_byte(DALI_GROUPS_HR_BASE + cmd->addr, 0, result);
+                scanned[6] = result;
                 cmd->op = DALI_CMD_QUERY_GROUPS_EIGHT_TO_FIFTEEN(cmd->addr);
                 break;
             case DALI_CMD_QUERY_GROUPS_EIGHT_TO_FIFTEEN(0):
-                set_holding_reg_byte(DALI_GROUPS_HR_BASE + cmd->addr, 1, result);
-                request_level_update(cmd->addr);
+                scanned[7] = result;
+                scan_store(bus_of(cmd), cmd->addr);
+                request_level_update(bus_of(cmd), cmd->addr);
                 cmd->then = NULL;
-                scan_next(cmd->addr);
+                scan_next(bus_of(cmd), cmd->addr);
                 break;
         }
     }
 }
 
+// Set in a level poll's param, alongside the shadow generation it started under, once the level has been read.
+#define POLL_LEVEL_READ 0x100
+
 static void fade_received_status(int status, dali_cmd_t *cmd) {
-    int addr = DALI_ADDR_FROM_CMD(cmd->op);
-    int device = 1;
+    dali_bus_t *bus = bus_of(cmd);
     if (status >= 0) {
-        set_holding_reg_byte(DALI_STATUS_HR_BASE + cmd->addr, 1, status);
+        set_holding_reg_byte(DALI_STATUS_HR(cmd->bus, cmd->addr), 1, status);
+        if (!(status & DALI_STATUS_FADE_IN_PROGRESS) && (cmd->param & POLL_LEVEL_READ) &&
+            (cmd->param & 0xFF) == bus->shadow_gen[cmd->addr]) {
+            // Level was read after the last change we know about, and it has settled.
+            bus->shadow_fresh_until[cmd->addr] = dali_hal_time_us() + SHADOW_MAX_AGE_US;
+        }
     }
 
-    if (status & DALI_STATUS_FADE_IN_PROGRESS) {
-        // Fade still active.  Check again
-        request_level_update(cmd->addr);
+    if (status >= 0 && (status & DALI_STATUS_FADE_IN_PROGRESS)) {
+        // Fade still active.  Check again later
+        schedule_fade_poll(bus, cmd->addr, dali_hal_time_us());
     }
 }
 
 static void fade_received_level(int lvl, dali_cmd_t *cmd) {
     int addr = DALI_ADDR_FROM_CMD(cmd->op);
-    int device = 1;
     if (lvl >= 0) {
-        set_holding_reg_byte(DALI_STATUS_HR_BASE + cmd->addr, 0, lvl);
+        set_holding_reg_byte(DALI_STATUS_HR(cmd->bus, cmd->addr), 0, lvl);
+        cmd->param |= POLL_LEVEL_READ;
     }
     cmd->op = DALI_CMD_QUERY_STATUS(addr);
     cmd->then = fade_received_status;
 }
 
+static void level_changed(dali_bus_t *bus, unsigned addr, uint16_t op, uint64_t now) {
+    // The level has changed, so the shadow can't be used again until we've read it back.
+    invalidate_shadow(bus, addr);
+    // We don't want other commands to be stalled waiting for a fade to conclude, so rather than following on with a
+    // query we schedule one for when the fade should be done.
+    bus->fade_ends_at[addr] = now + predict_fade_us(bus, addr, op);
+    schedule_fade_poll(bus, addr, now);
+}
+
 static void async_report_level_with_fade(int ret, dali_cmd_t *cmd) {
-    // We don't want other commands to be stalled waiting for a fade to conclude,
-    // so we push a new command rather than update the existing one.
-    dali_cmd_t newcmd = {.op = DALI_CMD_QUERY_ACTUAL_LEVEL(cmd->addr),
-                         .addr = cmd->addr,
-                         .then = fade_received_level,
-                         .finally = NULL,
-                         .sendTwice = false,
-                         .param = 0};
-    queue_try_add(&dali_queue, &newcmd);
+    level_changed(bus_of(cmd), cmd->addr, cmd->op, dali_hal_time_us());
 }
 
-static void noop_result_handler(int ret, dali_cmd_t *cmd) {}
+static void raw_cmd_result_handler(int ret, dali_cmd_t *cmd) {
+    // We have no idea what a raw command did, or to whom, so none of the shadow levels can be trusted any more, and nor
+    // can what we think the DTRs hold (STORE ACTUAL LEVEL IN DTR0, for one, isn't a DTR write that we would notice).
+    dali_bus_t *bus = bus_of(cmd);
+    invalidate_all_shadows(bus);
+    invalidate_dtr_cache(bus);
+}
 
-void dali_exec_cmd(uint16_t cmd, dali_result_cb_t resultHandler, bool sendTwice) {
+void dali_exec_cmd(int bus, uint16_t cmd, dali_result_cb_t resultHandler, bool sendTwice) {
     dali_cmd_t newcmd = {
-        .op = cmd, .addr = 0, .then = noop_result_handler, .finally = resultHandler, .sendTwice = sendTwice, .param = 0};
-    queue_try_add(&dali_queue, &newcmd);
+        .op = cmd, .addr = 0, .then = raw_cmd_result_handler, .finally = resultHandler, .sendTwice = sendTwice, .param = 0};
+    dali_submit(bus, &newcmd, DALI_PRIORITY_INTERACTIVE);
 }
 
-static void request_level_update(int addr) {
-    dali_cmd_t newcmd = {.op = DALI_CMD_QUERY_ACTUAL_LEVEL(addr),
+static void request_level_update(dali_bus_t *bus, int addr) {
+    dali_cmd_t newcmd = {.bus = bus->index,
+                         .op = DALI_CMD_QUERY_ACTUAL_LEVEL(addr),
                          .addr = addr,
                          .then = fade_received_level,
+                         .coalesce = DALI_COALESCE_POLL,
                          .finally = NULL,
                          .sendTwice = false,
-                         .param = 0};
-    queue_try_add(&dali_queue, &newcmd);
+                         .param = bus->shadow_gen[addr]};
+    dali_enqueue(&newcmd, DALI_PRIORITY_BACKGROUND);
 }
 
 static void toggle_level_received(int lvl, dali_cmd_t *cmd) {
@@ -325,54 +735,318 @@ static void toggle_level_received(int lvl, dali_cmd_t *cmd) {
     cmd->then = async_report_level_with_fade;
 }
 
+/**
+ * Toggles are queued as a level query, but if by the time they reach the front of the queue we have a fresh shadow
+ * of the light's level we can skip straight to the on or off command.  This has to be decided when the command is sent
+ * rather than when it is queued, as anything queued ahead of it may change the level.
+ */
+static void resolve_toggle_from_shadow(dali_cmd_t *cmd) {
+    dali_bus_t *bus = bus_of(cmd);
+    if (toggle_mode == DALI_TOGGLE_MODE_SHADOW && cmd->addr < MAX_DALI_LIGHTS &&
+        dali_hal_time_us() < bus->shadow_fresh_until[cmd->addr]) {
+        int reg = get_holding_reg(DALI_STATUS_HR(cmd->bus, cmd->addr));
+        int lvl = reg & 0xFF;
+        if (reg != 0xFFFF && lvl != 0xFF) {
+            toggle_level_received(lvl, cmd);
+            bus->stats.toggle_shadow_hits++;
+            return;
+        }
+    }
+    bus->stats.toggle_shadow_misses++;
+}
+
+// ------------------------- multi-light planning ----------------
+
+// The plan's command is decided from the lights' levels when it is sent.
+#define PLAN_TOGGLE 1
+// Set in a toggle plan's param once one of its lights is known to be on.
+#define PLAN_ANY_ON 0x100
+
+/**
+ * Works out from the status and groups banks which lights are present on a bus, and which of those belong to each
+ * group.
+ */
+static dali_light_mask_t read_group_members(unsigned int bus, dali_light_mask_t members[16]) {
+    uint8_t status[MAX_DALI_LIGHTS * 2];
+    uint8_t groups[MAX_DALI_LIGHTS * 2];
+    dali_light_mask_t present = 0;
+
+    copy_holding_regs(status, DALI_STATUS_HR(bus, 0), MAX_DALI_LIGHTS);
+    copy_holding_regs(groups, DALI_GROUPS_HR(bus, 0), MAX_DALI_LIGHTS);
+    memset(members, 0, 16 * sizeof(dali_light_mask_t));
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        if (status[addr * 2] == 0xFF && status[addr * 2 + 1] == 0xFF) {
+            continue;
+        }
+        dali_light_mask_t bit = 1ull << addr;
+        unsigned int membership = (groups[addr * 2] << 8) | groups[addr * 2 + 1];
+        present |= bit;
+        for (int group = 0; group < 16; group++) {
+            if (membership & (1 << group)) {
+                members[group] |= bit;
+            }
+        }
+    }
+    return present;
+}
+
+dali_light_mask_t dali_group_members(int bus, int group) {
+    dali_light_mask_t members[16];
+    if (bus < 0 || bus >= DALI_NUM_BUSES) {
+        return 0;
+    }
+    read_group_members(bus, members);
+    return members[group & 0x0F];
+}
+
+/**
+ * Picks the address for the next frame of a multi-light command, so that as few frames as possible are sent.  A
+ * broadcast is used if every light present is wanted, otherwise the largest group that lies entirely within the
+ * remaining lights, and finally individual short addresses.  The lights that the chosen address reaches are moved out
+ * of remaining and into covering.
+ */
+static unsigned int plan_next_address(unsigned int bus, dali_light_mask_t *remaining, dali_light_mask_t *covering) {
+    dali_light_mask_t members[16];
+    dali_light_mask_t present = read_group_members(bus, members);
+    int best_group = -1;
+    int best_count = 1;
+
+    if (present && (present & ~*remaining) == 0) {
+        *covering = *remaining & present;
+        *remaining = 0;
+        return DALI_BROADCAST_ADDR;
+    }
+    for (int group = 0; group < 16; group++) {
+        int count = __builtin_popcountll(members[group]);
+        if (count > best_count && (members[group] & ~*remaining) == 0) {
+            best_group = group;
+            best_count = count;
+        }
+    }
+    if (best_group >= 0) {
+        *covering = members[best_group];
+        *remaining &= ~members[best_group];
+        return DALI_GROUP_ADDR(best_group);
+    }
+    unsigned int addr = __builtin_ctzll(*remaining);
+    *covering = 1ull << addr;
+    *remaining &= ~*covering;
+    return addr;
+}
+
+static void plan_frame_done(int res, dali_cmd_t *cmd) {
+    uint64_t now = dali_hal_time_us();
+    uint16_t action = DALI_CMD_STRIP_ADDR(cmd->op);
+
+    if (res < DALI_NAK) {
+        // The frame didn't make it onto the bus, so give up on the rest.
+        return;
+    }
+    // Update the shadow of every light that the frame reached.
+    for (dali_light_mask_t covered = cmd->covering; covered; covered &= covered - 1) {
+        unsigned int addr = __builtin_ctzll(covered);
+        if (action == DALI_CMD_OFF(0)) {
+            set_holding_reg_byte(DALI_STATUS_HR(cmd->bus, addr), 0, 0);
+        } else if (!(action & 0x100) && action != 0xFF) {
+            // Direct arc power.  The gear will clamp it to its min/max, which the read back will pick up.
+            set_holding_reg_byte(DALI_STATUS_HR(cmd->bus, addr), 0, action);
+        }
+        level_changed(bus_of(cmd), addr, cmd->op, now);
+    }
+    if (cmd->lights) {
+        cmd->op = (plan_next_address(cmd->bus, &cmd->lights, &cmd->covering) << 9) | action;
+        cmd->then = plan_frame_done;
+    }
+}
+
+static void plan_start_frames(dali_cmd_t *cmd, uint16_t action) {
+    cmd->op = (plan_next_address(cmd->bus, &cmd->lights, &cmd->covering) << 9) | action;
+    cmd->then = plan_frame_done;
+}
+
+static void plan_toggle_level_received(int lvl, dali_cmd_t *cmd);
+
+// Asks the next light that we aren't sure of for its level, until one is found to be on.  Once we know, the toggle turns
+// all of the lights off if any of them are on, otherwise on.
+static void plan_toggle_next(dali_cmd_t *cmd) {
+    if (!(cmd->param & PLAN_ANY_ON) && cmd->covering) {
+        cmd->op = DALI_CMD_QUERY_ACTUAL_LEVEL(__builtin_ctzll(cmd->covering));
+        cmd->then = plan_toggle_level_received;
+        return;
+    }
+    cmd->covering = 0;
+    plan_start_frames(cmd, (cmd->param & PLAN_ANY_ON) ? DALI_CMD_OFF(0) : DALI_CMD_RECALL_LAST_ACTIVE_LEVEL(0));
+}
+
+static void plan_toggle_level_received(int lvl, dali_cmd_t *cmd) {
+    unsigned int addr = __builtin_ctzll(cmd->covering);
+
+    cmd->covering &= cmd->covering - 1;
+    if (lvl >= 0) {
+        set_holding_reg_byte(DALI_STATUS_HR(cmd->bus, addr), 0, lvl);
+    }
+    if (lvl > 0) {
+        cmd->param |= PLAN_ANY_ON;
+    }
+    plan_toggle_next(cmd);
+}
+
+/**
+ * Decides a multi-light toggle from the shadow levels of the lights that have fresh ones, as dali_toggle does for a
+ * single light.  The rest are queried first, unless one of the fresh ones is already on.
+ */
+static void plan_toggle_first(dali_cmd_t *cmd) {
+    dali_bus_t *bus = bus_of(cmd);
+    uint64_t now = dali_hal_time_us();
+    uint8_t status[MAX_DALI_LIGHTS * 2];
+
+    copy_holding_regs(status, DALI_STATUS_HR(cmd->bus, 0), MAX_DALI_LIGHTS);
+    cmd->covering = 0;
+    for (dali_light_mask_t l = cmd->lights; l; l &= l - 1) {
+        unsigned int addr = __builtin_ctzll(l);
+        uint8_t lvl = status[addr * 2 + 1];
+        if (status[addr * 2] == 0xFF) {
+            // Not present.
+            continue;
+        }
+        if (toggle_mode == DALI_TOGGLE_MODE_SHADOW && now < bus->shadow_fresh_until[addr] && lvl != 0xFF) {
+            if (lvl) {
+                cmd->param |= PLAN_ANY_ON;
+            }
+        } else {
+            cmd->covering |= 1ull << addr;
+        }
+    }
+    if (!(cmd->param & PLAN_ANY_ON) && cmd->covering) {
+        bus->stats.toggle_shadow_misses++;
+    } else {
+        bus->stats.toggle_shadow_hits++;
+    }
+    plan_toggle_next(cmd);
+}
+
+static void plan_first_frame(dali_cmd_t *cmd) {
+    if (cmd->param & PLAN_TOGGLE) {
+        plan_toggle_first(cmd);
+    } else {
+        plan_start_frames(cmd, DALI_CMD_STRIP_ADDR(cmd->op));
+    }
+}
+
+static void queue_plan(int bus, dali_light_mask_t lights, uint16_t action, uint8_t kind, dali_result_cb_t cb) {
+    if (!lights) {
+        if (cb) {
+            cb(DALI_NAK);
+        }
+        return;
+    }
+    dali_cmd_t cmd = {.op = action,
+                      .addr = DALI_BROADCAST_ADDR,  // Not a single light.
+                      .lights = lights,
+                      .prepare = plan_first_frame,
+                      .then = plan_frame_done,
+                      .finally = cb,
+                      .sendTwice = false,
+                      .param = kind};
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
+}
+
+void dali_set_level_many(int bus, dali_light_mask_t lights, int level, dali_result_cb_t cb) {
+    queue_plan(bus, lights, level & 0xFF, 0, cb);
+}
+
+void dali_set_on_many(int bus, dali_light_mask_t lights, bool is_on, dali_result_cb_t cb) {
+    queue_plan(bus, lights, is_on ? DALI_CMD_RECALL_LAST_ACTIVE_LEVEL(0) : DALI_CMD_OFF(0), 0, cb);
+}
+
+void dali_toggle_many(int bus, dali_light_mask_t lights, dali_result_cb_t cb) {
+    queue_plan(bus, lights, 0, PLAN_TOGGLE, cb);
+}
+
 // ----------------------------- API -------------------------
 
-static inline void send_dali_cmd(uint cmd) {
-    // This says blocking, but it is very unlikely that it will ever block, due to
-    // the serial nature of how commands are executed.
-    pio_sm_put_blocking(pio, dali_sm, ((cmd << 15) | 0x80000000) + 88);
+static inline void send_dali_cmd(dali_bus_t *bus, uint16_t cmd) {
+    dali_cmd_t *in_flight = &bus->in_flight;
+
+    bus->frame_sent_at = dali_hal_time_us();
+    if (!in_flight->started) {
+        in_flight->started = true;
+        if (in_flight->priority == DALI_PRIORITY_INTERACTIVE) {
+            bus->stats.last_interactive_wait_us = bus->frame_sent_at - in_flight->queued_at;
+            if (bus->stats.last_interactive_wait_us > bus->stats.max_interactive_wait_us) {
+                bus->stats.max_interactive_wait_us = bus->stats.last_interactive_wait_us;
+            }
+        }
+    }
+    if (!in_flight->sendTwice && dtr_write_is_redundant(bus, cmd, bus->frame_sent_at)) {
+        // Nothing needs to go out on the bus.  Complete it as though the (never answered) frame was sent.
+        bus->stats.dtr_writes_elided++;
+        bus->elided_result_pending = true;
+        return;
+    }
+    bus->stats.frames_sent++;
+    dali_hal_send(bus->index, cmd);
+}
+
+void dali_get_stats(int bus, dali_stats_t *out) {
+    if (bus >= 0 && bus < DALI_NUM_BUSES) {
+        *out = buses[bus].stats;
+    }
 }
 
-void dali_toggle(int addr, dali_result_cb_t cb) {
+void dali_set_toggle_mode(dali_toggle_mode_t mode) {
+    toggle_mode = mode;
+}
+
+void dali_toggle(int bus, int addr, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_QUERY_ACTUAL_LEVEL(addr),
                       .addr = addr,
+                      .prepare = resolve_toggle_from_shadow,
                       .then = toggle_level_received,
                       .finally = cb,
                       .sendTwice = false,
                       .param = 0};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
-void dali_set_on(int addr, bool is_on, dali_result_cb_t cb) {
+void dali_set_on(int bus, int addr, bool is_on, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = is_on ? DALI_CMD_RECALL_LAST_ACTIVE_LEVEL(addr) : DALI_CMD_OFF(addr),
                       .addr = addr,
                       .then = async_report_level_with_fade,
+                      .coalesce = DALI_COALESCE_LEVEL,
                       .finally = cb,
                       .sendTwice = false,
                       .param = is_on};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
-void dali_set_level(int addr, int level, dali_result_cb_t cb) {
+void dali_set_level(int bus, int addr, int level, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = addr << 9 | level,
                       .addr = addr,
                       .then = async_report_level_with_fade,
+                      .coalesce = DALI_COALESCE_LEVEL,
                       .finally = cb,
                       .sendTwice = false,
                       .param = level};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
+}
+
+// Configuration commands and DTR writes have no backward frame, so a NAK is what success looks like.  Anything worse (a
+// timeout or bus error) means that the frame didn't make it.
+static inline bool config_cmd_ok(int res) {
+    return res >= DALI_NAK;
 }
 
 // --------- MIN / MAX Register
 
 static void set_max_complete(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        set_holding_reg_byte(DALI_MINMAX_HR_BASE + cmd->addr, 1, cmd->param);
+    if (config_cmd_ok(res)) {
+        set_holding_reg_byte(DALI_MINMAX_HR(cmd->bus, cmd->addr), 1, cmd->param);
     }
 }
 
 static void set_max_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_MAX_LEVEL(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set_max_complete;
@@ -380,8 +1054,8 @@ static void set_max_to_dtr0(int res, dali_cmd_t *cmd) {
 }
 
 static void set_min_complete(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        set_holding_reg_byte(DALI_MINMAX_HR_BASE + cmd->addr, 0, cmd->param & 0xFF);
+    if (config_cmd_ok(res)) {
+        set_holding_reg_byte(DALI_MINMAX_HR(cmd->bus, cmd->addr), 0, cmd->param & 0xFF);
 
         cmd->op = DALI_CMD_SET_DTR0(cmd->param >> 8);
         cmd->sendTwice = false;
@@ -390,34 +1064,34 @@ static void set_min_complete(int res, dali_cmd_t *cmd) {
 }
 
 static void set_min_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_MIN_LEVEL(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set_min_complete;
     }
 }
 
-void dali_set_min_max_level(int addr, unsigned min, unsigned max, dali_result_cb_t cb) {
+void dali_set_min_max_level(int bus, int addr, unsigned min, unsigned max, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_SET_DTR0(min),
                       .addr = addr,
                       .then = set_min_to_dtr0,
                       .finally = cb,
                       .sendTwice = false,
                       .param = min | max << 8};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
 // ----- FADE TIME/RATE Register
 
 static void set_fade_rate_complete(int res, dali_cmd_t *cmd) {
-    // Fade time becomes the lower nibble of the LSB of the Holding register.
-    if (res >= 0) {
-        set_holding_reg_nibble(DALI_FADE_HR_BASE + cmd->addr, 0, cmd->param);
+    // Fade rate becomes the lower nibble of the LSB of the Holding register.
+    if (config_cmd_ok(res)) {
+        set_holding_reg_nibble(DALI_FADE_HR(cmd->bus, cmd->addr), 0, cmd->param >> 8);
     }
 }
 
 static void set_fade_rate_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_FADE_RATE(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set_fade_rate_complete;
@@ -426,8 +1100,8 @@ static void set_fade_rate_to_dtr0(int res, dali_cmd_t *cmd) {
 
 static void set_fade_time_complete(int ret, dali_cmd_t *cmd) {
     // Fade time becomes the upper nibble of the LSB of the Holding register.
-    if (ret >= 0) {
-        set_holding_reg_nibble(DALI_FADE_HR_BASE + cmd->addr, 1, cmd->param);
+    if (config_cmd_ok(ret)) {
+        set_holding_reg_nibble(DALI_FADE_HR(cmd->bus, cmd->addr), 1, cmd->param);
 
         cmd->op = DALI_CMD_SET_DTR0(cmd->param >> 8);
         cmd->sendTwice = false;
@@ -436,33 +1110,33 @@ static void set_fade_time_complete(int ret, dali_cmd_t *cmd) {
 }
 
 static void set_fade_time_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_FADE_TIME(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set_fade_time_complete;
     }
 }
 
-void dali_set_fade_time_rate(int addr, unsigned time, unsigned rate, dali_result_cb_t cb) {
+void dali_set_fade_time_rate(int bus, int addr, unsigned time, unsigned rate, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_SET_DTR0(time),
                       .addr = addr,
                       .then = set_fade_time_to_dtr0,
                       .finally = cb,
                       .sendTwice = false,
                       .param = time | rate << 8};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
 // -------------- Power on level Register
 
 static void set_system_failure_level_complete(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        set_holding_reg_byte(DALI_POWERON_HR_BASE + cmd->addr, 1, cmd->param);
+    if (config_cmd_ok(res)) {
+        set_holding_reg_byte(DALI_POWERON_HR(cmd->bus, cmd->addr), 1, cmd->param);
     }
 }
 
 static void dali_set_system_failure_level_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_SYSTEM_FAIL_LEVEL(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set_system_failure_level_complete;
@@ -470,8 +1144,8 @@ static void dali_set_system_failure_level_to_dtr0(int res, dali_cmd_t *cmd) {
 }
 
 static void set__power_on_level_complete(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        set_holding_reg_byte(DALI_POWERON_HR_BASE + cmd->addr, 0, cmd->param);
+    if (config_cmd_ok(res)) {
+        set_holding_reg_byte(DALI_POWERON_HR(cmd->bus, cmd->addr), 0, cmd->param);
 
         cmd->op = DALI_CMD_SET_DTR0(cmd->param >> 8);
         cmd->sendTwice = false;
@@ -480,147 +1154,241 @@ static void set__power_on_level_complete(int res, dali_cmd_t *cmd) {
 }
 
 static void dali_set_power_on_level_to_dtr0(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
+    if (config_cmd_ok(res)) {
         cmd->op = DALI_CMD_SET_POWER_ON_LEVEL(cmd->addr);
         cmd->sendTwice = true;
         cmd->then = set__power_on_level_complete;
     }
 }
 
-void dali_set_power_on_level(int addr, int powerOnLevel, int systemFailLevel, dali_result_cb_t cb) {
+void dali_set_power_on_level(int bus, int addr, int powerOnLevel, int systemFailLevel, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_SET_DTR0(powerOnLevel),
                       .addr = addr,
                       .then = dali_set_power_on_level_to_dtr0,
                       .finally = cb,
                       .sendTwice = false,
                       .param = powerOnLevel | systemFailLevel << 8};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
 // -------------- Groups Register
 
 static void dali_remove_from_group_completed(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        clear_holding_reg_bit(DALI_GROUPS_HR_BASE + cmd->addr, cmd->param);
+    if (config_cmd_ok(res)) {
+        clear_holding_reg_bit(DALI_GROUPS_HR(cmd->bus, cmd->addr), cmd->param);
     }
 }
 
-void dali_remove_from_group(int addr, int group, dali_result_cb_t cb) {
+void dali_remove_from_group(int bus, int addr, int group, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_REMOVE_FROM_GROUP(addr, group),
                       .addr = addr,
                       .then = dali_remove_from_group_completed,
                       .finally = cb,
                       .sendTwice = true,
                       .param = group};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
 static void dali_add_to_group_completed(int res, dali_cmd_t *cmd) {
-    if (res >= 0) {
-        set_holding_reg_bit(DALI_GROUPS_HR_BASE + cmd->addr, cmd->param);
+    if (config_cmd_ok(res)) {
+        set_holding_reg_bit(DALI_GROUPS_HR(cmd->bus, cmd->addr), cmd->param);
     }
 }
 
-void dali_add_to_group(int addr, int group, dali_result_cb_t cb) {
+void dali_add_to_group(int bus, int addr, int group, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = DALI_CMD_ADD_TO_GROUP(addr, group),
                       .addr = addr,
                       .then = dali_add_to_group_completed,
                       .finally = cb,
                       .sendTwice = true,
                       .param = group};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
-bool dali_enumerate() {
-    if (dali_scan_in_progress) {
+static bool enumerate_bus(dali_bus_t *bus) {
+    if (bus->scan_in_progress) {
         return false;
     }
     // First, see if the first address returns a level.  Callbacks will iterate the rest.
-    dali_scan_in_progress = true;
-    scan_dali_device(0);
+    bus->scan_in_progress = true;
+    bus->scan_started_at = dali_hal_time_us();
+    scan_dali_device(bus, 0);
     return true;
 }
 
-void dali_fade(int addr, int velocity, dali_result_cb_t cb) {
+bool dali_enumerate() {
+    bool started = false;
+    for (int i = 0; i < DALI_NUM_BUSES; i++) {
+        started |= enumerate_bus(&buses[i]);
+    }
+    return started;
+}
+
+void dali_fade(int bus, int addr, int velocity, dali_result_cb_t cb) {
     dali_cmd_t cmd = {.op = velocity > 0 ? DALI_CMD_UP(addr) : DALI_CMD_DOWN(addr),
                       .addr = addr,
                       .then = async_report_level_with_fade,
+                      .coalesce = DALI_COALESCE_FADE,
                       .finally = cb,
                       .sendTwice = false,
                       .param = 0};
-    queue_try_add(&dali_queue, &cmd);
+    dali_submit(bus, &cmd, DALI_PRIORITY_INTERACTIVE);
 }
 
-void dali_poll() {
-    if (in_flight.then) {
-        if (!pio_sm_is_rx_fifo_empty(pio, dali_sm)) {
-            uint32_t v = pio_sm_get(pio, dali_sm);
-            int res = v == 0xFFFFFFFF ? -1 : v & 0xFF;
-
-            // We treat a NAK as a valid response for the purposes of repeating ourselves.  This is especially important as
-            // almost every command that requires retransmission always returns NAK
-            if (res >= DALI_NAK && in_flight.sendTwice) {
-                in_flight.sendTwice = false;
-                // We need to repeat the command again.
-                send_dali_cmd(in_flight.op);
-            } else {
-                cmd_chain_cb_t next_action = in_flight.then;
-                in_flight.then = NULL;
-                next_action(res, &in_flight);
-                // If the callback explicitly sets a new *then* callback we willtransmit its operation immediately, otherwise we
-                // will assume that that transaction is done.
-                if (in_flight.then) {
-                    // The callback has set a followup command, so send it out.
-                    if (in_flight.sendTwice == 0) {
-                        in_flight.sendTwice = false;
-                    }
-                    send_dali_cmd(in_flight.op);
-                } else {
-                    // Command is Completely done.  Call Finally handler.
-                    if (in_flight.finally) {
-                        in_flight.finally(res);
-                    }
-                }
-            }
+static bool dali_next_cmd(dali_bus_t *bus, dali_cmd_t *cmd) {
+    if (lane_remove(bus, &bus->queue[DALI_PRIORITY_INTERACTIVE], cmd)) {
+        return true;
+    }
+    if (bus->preempted.then) {
+        *cmd = bus->preempted;
+        bus->preempted.then = NULL;
+        return true;
+    }
+    return lane_remove(bus, &bus->queue[DALI_PRIORITY_BACKGROUND], cmd);
+}
+
+// Fetches the result of the frame in flight, if it has finished.
+static bool dali_take_result(dali_bus_t *bus, int *res) {
+    if (bus->elided_result_pending) {
+        bus->elided_result_pending = false;
+        *res = DALI_NAK;
+        return true;
+    }
+    if (!dali_hal_receive(bus->index, res)) {
+        return false;
+    }
+    bus->stats.bus_busy_us += dali_hal_time_us() - bus->frame_sent_at;
+    if (*res == DALI_NAK) {
+        bus->stats.naks++;
+    } else if (*res < DALI_NAK || dtr_from_cmd(bus->in_flight.op) >= 0) {
+        // Either the bus misbehaved, or something answered a frame that never gets an answer.  Either way we can no
+        // longer be sure what is in the DTRs.
+        invalidate_dtr_cache(bus);
+    }
+    return true;
+}
+
+// Deals with the result of the frame that was in flight, by sending the next frame in its chain or completing it.
+static void dali_handle_result(dali_bus_t *bus, int res) {
+    dali_cmd_t *in_flight = &bus->in_flight;
+    dali_stats_t *stats = &bus->stats;
+
+    // We treat a NAK as a valid response for the purposes of repeating ourselves.  This is especially important as
+    // almost every command that requires retransmission always returns NAK
+    if (res >= DALI_NAK && in_flight->sendTwice) {
+        in_flight->sendTwice = false;
+        // We need to repeat the command again.
+        send_dali_cmd(bus, in_flight->op);
+        return;
+    }
+    cmd_chain_cb_t next_action = in_flight->then;
+    in_flight->then = NULL;
+    next_action(res, in_flight);
+    // If the callback explicitly sets a new *then* callback we willtransmit its operation immediately, otherwise we
+    // will assume that that transaction is done.
+    if (in_flight->then) {
+        if (in_flight->priority != DALI_PRIORITY_INTERACTIVE && bus->queue[DALI_PRIORITY_INTERACTIVE].count) {
+            // Someone is waiting on an interactive command.  Put this chain aside and resume it afterwards.
+            bus->preempted = *in_flight;
+            in_flight->then = NULL;
+            stats->preemptions++;
+            return;
+        }
+        // The callback has set a followup command, so send it out.
+        if (in_flight->sendTwice == 0) {
+            in_flight->sendTwice = false;
+        }
+        send_dali_cmd(bus, in_flight->op);
+    } else {
+        // Command is Completely done.  Call Finally handler.
+        stats->transactions++;
+        stats->last_latency_us = dali_hal_time_us() - in_flight->queued_at;
+        if (stats->last_latency_us > stats->max_latency_us) {
+            stats->max_latency_us = stats->last_latency_us;
         }
-    } else if (queue_try_remove(&dali_queue, &in_flight)) {
-        pio_sm_restart(pio, dali_sm);
-        send_dali_cmd(in_flight.op);
+        if (in_flight->finally) {
+            in_flight->finally(res);
+        }
+        for (int i = 0; i < in_flight->num_superseded; i++) {
+            in_flight->superseded[i](res);
+        }
+    }
+}
+
+// Takes the next command off the queue and puts its first frame on the bus.  Returns false if there wasn't one.
+static bool dali_start_next(dali_bus_t *bus) {
+    dali_cmd_t *in_flight = &bus->in_flight;
+
+    run_poll_schedule(bus);
+    if (!dali_next_cmd(bus, in_flight)) {
+        return false;
+    }
+    if (in_flight->prepare && !in_flight->started) {
+        in_flight->prepare(in_flight);
     }
+    dali_hal_reset(bus->index);
+    send_dali_cmd(bus, in_flight->op);
+    return true;
 }
 
-void dali_init(uint32_t tx_pin, uint32_t rx_pin) {
-    for (int i = 0; i < 64; i++) {
-        set_holding_reg(DALI_STATUS_HR_BASE + i, 0xFFFF);
-        set_holding_reg(DALI_MINMAX_HR_BASE + i, 0xFFFF);
+/**
+ * Keeps going until the bus is waiting on the hardware or has nothing left to do, so that the caller can sleep until
+ * the next interrupt without leaving the bus idle in the mean time.
+ */
+static void dali_bus_poll(dali_bus_t *bus) {
+    int res;
+
+    for (;;) {
+        if (bus->in_flight.then) {
+            if (!dali_take_result(bus, &res)) {
+                return;
+            }
+            dali_handle_result(bus, res);
+        } else if (!dali_start_next(bus)) {
+            return;
+        }
     }
-    // An enumeration will use 64 entries in the queue, so we give it some space.
-    queue_init(&dali_queue, sizeof(dali_cmd_t), QUEUE_DEPTH);
+}
 
-    uint offset = pio_add_program(pio, &dali_tx_program);
+void dali_poll() {
+    // Each bus has its own state machine, so they all have a transaction on the go at once.
+    for (int i = 0; i < DALI_NUM_BUSES; i++) {
+        dali_bus_poll(&buses[i]);
+    }
+}
 
-    // Tell PIO to initially drive output-low on the selected pin, then map PIO
-    // onto that pin with the IO muxes.
-    pio_gpio_init(pio, tx_pin);
-    pio_gpio_init(pio, rx_pin);
-    pio_sm_set_consecutive_pindirs(pio, dali_sm, rx_pin, 1, false);
-    pio_sm_set_consecutive_pindirs(pio, dali_sm, tx_pin, 1, true);
+uint64_t dali_next_poll_time() {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < DALI_NUM_BUSES; i++) {
+        // A busy bus will interrupt us when it is done, and will look at its poll schedule then.
+        if (!buses[i].in_flight.then) {
+            next = MIN(next, buses[i].next_poll_due);
+        }
+    }
+    return next;
+}
 
-    pio_sm_config c = dali_tx_program_get_default_config(offset);
+void dali_init(unsigned int bus_no, uint32_t tx_pin, uint32_t rx_pin) {
+    if (bus_no >= DALI_NUM_BUSES) {
+        return;
+    }
+    dali_bus_t *bus = &buses[bus_no];
 
-    sm_config_set_out_shift(&c, false, true, 32);
-    sm_config_set_in_shift(&c, false, false, 32);
-    sm_config_set_out_pins(&c, tx_pin, 1);
-    sm_config_set_set_pins(&c, tx_pin, 1);
-    sm_config_set_in_pins(&c, rx_pin);
-    sm_config_set_jmp_pin(&c, rx_pin);
+    bus->index = bus_no;
+    bus->queue[DALI_PRIORITY_INTERACTIVE] = (dali_lane_t){.slots = bus->interactive_slots,
+                                                          .depth = count_of(bus->interactive_slots)};
+    bus->queue[DALI_PRIORITY_BACKGROUND] = (dali_lane_t){.slots = bus->background_slots,
+                                                         .depth = count_of(bus->background_slots)};
+    invalidate_dtr_cache(bus);
+    bus->next_poll_due = UINT64_MAX;
+    bus->poll_credit_us = POLL_BURST_US;
 
-    // SM transmits 1 half bit per 8 execution cycles.
-    float div = (float)clock_get_hz(clk_sys) / (2 * 8 * 1200);
-    sm_config_set_clkdiv(&c, div);
+    fill_holding_regs(DALI_STATUS_HR(bus_no, 0), 0xFFFF, MAX_DALI_LIGHTS);
+    fill_holding_regs(DALI_MINMAX_HR(bus_no, 0), 0xFFFF, MAX_DALI_LIGHTS);
+    fill_holding_regs(DALI_FADE_HR(bus_no, 0), 0xFFFF, MAX_DALI_LIGHTS);
+    critical_section_init(&bus->queue_lock);
 
-    pio_sm_init(pio, dali_sm, offset, &c);
-    pio_sm_set_enabled(pio, dali_sm, true);
+    dali_hal_init(bus_no, tx_pin, rx_pin);
 
-    dali_enumerate();
+    enumerate_bus(bus);
 }
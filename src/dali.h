@@ -42,26 +42,69 @@ typedef enum {
 
 typedef void (*dali_result_cb_t)(int result);
 
+// One bit per short address on a bus, for commands that apply to several lights at once.
+typedef uint64_t dali_light_mask_t;
+#define DALI_ALL_LIGHTS (~(dali_light_mask_t)0)
 
-// extern dali_dev_data_t dali_devices[64];
-extern bool dali_scan_in_progress;
+// Addresses (in the same form as a short address) that reach a whole group, or every light on the bus.
+#define DALI_GROUP_ADDR(group) (0x40 | (group))
+#define DALI_BROADCAST_ADDR 0x7F
+
+typedef enum {
+    DALI_TOGGLE_MODE_QUERY,   // Always query the light's level before deciding whether to turn it on or off.
+    DALI_TOGGLE_MODE_SHADOW,  // Decide from the status bank when its level is fresh, otherwise fall back to a query.
+} dali_toggle_mode_t;
+
+// Counters kept for each bus so that bus throughput and queueing delays can be measured without a bench rig.
+typedef struct {
+    uint32_t frames_sent;      // Forward frames put on the bus, including repeats of send-twice commands.
+    uint32_t transactions;     // Queued commands (including their whole callback chain) that have completed.
+    uint32_t naks;             // Forward frames that got no backward frame within 22Te.
+    uint64_t bus_busy_us;      // Total time that a frame was on the bus or awaiting its reply.
+    uint32_t last_latency_us;  // Time from queueing to completion of the most recently completed command.
+    uint32_t max_latency_us;
+    uint32_t enumeration_us;   // Duration of the last complete dali_enumerate() scan.
+    uint32_t last_interactive_wait_us;  // Time from queueing a user command to its first frame going out on the bus.
+    uint32_t max_interactive_wait_us;
+    uint32_t preemptions;               // Background command chains paused to let a user command go first.
+    uint32_t toggle_shadow_hits;        // Toggles decided from the shadow level, without a query round trip.
+    uint32_t toggle_shadow_misses;      // Toggles that had to query the level first.
+    uint32_t coalesced;                 // Queued commands replaced by a newer one for the same address before being sent.
+    uint32_t level_polls;               // Scheduled level/status read backs after a level change.
+    uint32_t level_polls_deferred;      // Times a due poll was held back because the polling budget was spent.
+    uint32_t dtr_writes_elided;         // DTR writes skipped because the DTR already held that value.
+} dali_stats_t;
 
-bool dali_is_fadeable(int addr);
 
-void dali_exec_cmd(uint16_t cmd, dali_result_cb_t resultHandler, bool sendTwice);
+// Every light is named by the bus it is on (0..DALI_NUM_BUSES-1) and its short address on that bus.
+bool dali_is_fadeable(int bus, int addr);
 
-void dali_init(uint32_t tx_pin, uint32_t rx_pin);
+void dali_exec_cmd(int bus, uint16_t cmd, dali_result_cb_t resultHandler, bool sendTwice);
+
+void dali_init(unsigned int bus, uint32_t tx_pin, uint32_t rx_pin);
+// Sends and completes commands on every bus.  Between calls there is nothing to do until either a DALI interrupt,
+// a command being queued (which signals an event), or dali_next_poll_time().
 void dali_poll();
-void dali_toggle(int addr, dali_result_cb_t cb);
-void dali_set_on(int addr, bool is_on, dali_result_cb_t cb);
-void dali_set_level(int addr, int level, dali_result_cb_t cb);
-void dali_set_min_max_level(int addr, unsigned min, unsigned max, dali_result_cb_t cb);
-void dali_set_fade_time_rate(int addr, unsigned time, unsigned rate, dali_result_cb_t cb);
-void dali_set_power_on_level(int addr, int powerOnLevel, int systemFailLevel, dali_result_cb_t cb);
-void dali_remove_from_group(int addr, int group, dali_result_cb_t cb);
-void dali_add_to_group(int addr, int group, dali_result_cb_t cb);
-
-void dali_fade(int addr, int velocity, dali_result_cb_t cb);
+uint64_t dali_next_poll_time();
+void dali_toggle(int bus, int addr, dali_result_cb_t cb);
+void dali_set_on(int bus, int addr, bool is_on, dali_result_cb_t cb);
+void dali_set_level(int bus, int addr, int level, dali_result_cb_t cb);
+void dali_set_min_max_level(int bus, int addr, unsigned min, unsigned max, dali_result_cb_t cb);
+void dali_set_fade_time_rate(int bus, int addr, unsigned time, unsigned rate, dali_result_cb_t cb);
+void dali_set_power_on_level(int bus, int addr, int powerOnLevel, int systemFailLevel, dali_result_cb_t cb);
+void dali_remove_from_group(int bus, int addr, int group, dali_result_cb_t cb);
+void dali_add_to_group(int bus, int addr, int group, dali_result_cb_t cb);
+
+void dali_fade(int bus, int addr, int velocity, dali_result_cb_t cb);
+
+// Multi-light commands are sent as group or broadcast frames where the lights' group memberships allow it.
+void dali_set_level_many(int bus, dali_light_mask_t lights, int level, dali_result_cb_t cb);
+void dali_set_on_many(int bus, dali_light_mask_t lights, bool is_on, dali_result_cb_t cb);
+void dali_toggle_many(int bus, dali_light_mask_t lights, dali_result_cb_t cb);
+dali_light_mask_t dali_group_members(int bus, int group);
+// Starts a scan of every bus that isn't already being scanned.
 bool dali_enumerate();
+void dali_get_stats(int bus, dali_stats_t *stats);
+void dali_set_toggle_mode(dali_toggle_mode_t mode);
 
 #endif
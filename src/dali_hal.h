@@ -0,0 +1,30 @@
+#ifndef _DALI_HAL_H
+#define _DALI_HAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Physical layer for the DALI bus.  dali.c only ever talks to the bus through these calls, so the command queue and its
+ * callback chains can be driven by something other than the PIO (a bench rig, or a virtual-time simulator on a host).
+ *
+ * A transaction is one forward frame followed by either a backward frame or the 22Te reply timeout.  Each bus runs
+ * independently, but only one transaction may be outstanding on a bus at a time.
+ */
+
+void dali_hal_init(unsigned int bus, uint32_t tx_pin, uint32_t rx_pin);
+
+// Discards any half finished transaction and anything waiting to be read.
+void dali_hal_reset(unsigned int bus);
+
+// Transmits a 16 bit forward frame, then listens for a backward frame.
+void dali_hal_send(unsigned int bus, uint16_t frame);
+
+// Returns true once the outstanding transaction has finished, storing the backward frame (0..255) or DALI_NAK into result.
+// Completion raises an interrupt, which wakes a core that is waiting in __wfe().
+bool dali_hal_receive(unsigned int bus, int *result);
+
+// Monotonic microsecond clock that the driver uses for all of its timing.
+uint64_t dali_hal_time_us();
+
+#endif
@@ -0,0 +1,103 @@
+#include <hardware/clocks.h>
+#include <hardware/irq.h>
+#include <hardware/pio.h>
+#include <pico/stdlib.h>
+#include <pico/util/queue.h>
+
+#include "dali.h"
+#include "dali.pio.h"
+#include "dali_hal.h"
+
+// Number of double ticks the state machine waits for a backward frame - 22Te x4 (because each loop takes 2 ticks)
+#define DALI_REPLY_TIMEOUT 88
+
+// Every bus runs the same program, on the state machine with the same number as the bus.
+static const PIO pio = pio0;
+static int program_offset = -1;
+
+// Results are moved out of the RX FIFOs by the PIO interrupt as soon as a transaction ends, so that the main loop can
+// sleep while frames are on the bus.  There is only ever one transaction outstanding per bus, so these stay short.
+#define COMPLETION_QUEUE_DEPTH 2
+static queue_t completions[NUM_PIO_STATE_MACHINES];
+static uint32_t active_sms;
+
+static void __isr dali_pio_irq_handler() {
+    for (unsigned int sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+        if (!(active_sms & (1u << sm))) {
+            continue;
+        }
+        // The state machine pushes exactly one word per transaction: the backward frame or all ones on a timeout.
+        while (!pio_sm_is_rx_fifo_empty(pio, sm)) {
+            uint32_t v = pio_sm_get(pio, sm);
+            int result = v == 0xFFFFFFFF ? DALI_NAK : v & 0xFF;
+            queue_try_add(&completions[sm], &result);
+        }
+        // Flag raised (by `irq 0 rel`) on a timeout.  The RX FIFO tells us everything we need, so just tidy it up.
+        pio_interrupt_clear(pio, sm);
+    }
+    // Make sure that a core about to wait for this doesn't miss it.
+    __sev();
+}
+
+void dali_hal_init(unsigned int bus, uint32_t tx_pin, uint32_t rx_pin) {
+    unsigned int dali_sm = bus;
+
+    if (program_offset < 0) {
+        program_offset = pio_add_program(pio, &dali_tx_program);
+    }
+    uint offset = program_offset;
+
+    // Tell PIO to initially drive output-low on the selected pin, then map PIO
+    // onto that pin with the IO muxes.
+    pio_gpio_init(pio, tx_pin);
+    pio_gpio_init(pio, rx_pin);
+    pio_sm_set_consecutive_pindirs(pio, dali_sm, rx_pin, 1, false);
+    pio_sm_set_consecutive_pindirs(pio, dali_sm, tx_pin, 1, true);
+
+    pio_sm_config c = dali_tx_program_get_default_config(offset);
+
+    sm_config_set_out_shift(&c, false, true, 32);
+    sm_config_set_in_shift(&c, false, false, 32);
+    sm_config_set_out_pins(&c, tx_pin, 1);
+    sm_config_set_set_pins(&c, tx_pin, 1);
+    sm_config_set_in_pins(&c, rx_pin);
+    sm_config_set_jmp_pin(&c, rx_pin);
+
+    // SM transmits 1 half bit per 8 execution cycles.
+    float div = (float)clock_get_hz(clk_sys) / (2 * 8 * 1200);
+    sm_config_set_clkdiv(&c, div);
+
+    pio_sm_init(pio, dali_sm, offset, &c);
+
+    queue_init(&completions[dali_sm], sizeof(int), COMPLETION_QUEUE_DEPTH);
+    if (!active_sms) {
+        irq_set_exclusive_handler(PIO0_IRQ_0, dali_pio_irq_handler);
+        irq_set_enabled(PIO0_IRQ_0, true);
+    }
+    active_sms |= 1u << dali_sm;
+    pio_set_irq0_source_enabled(pio, pis_sm0_rx_fifo_not_empty + dali_sm, true);
+
+    pio_sm_set_enabled(pio, dali_sm, true);
+}
+
+void dali_hal_reset(unsigned int bus) {
+    int stale;
+
+    pio_sm_restart(pio, bus);
+    while (queue_try_remove(&completions[bus], &stale)) {
+    }
+}
+
+void dali_hal_send(unsigned int bus, uint16_t frame) {
+    // This says blocking, but it is very unlikely that it will ever block, due to
+    // the serial nature of how commands are executed.
+    pio_sm_put_blocking(pio, bus, ((frame << 15) | 0x80000000) + DALI_REPLY_TIMEOUT);
+}
+
+bool dali_hal_receive(unsigned int bus, int *result) {
+    return queue_try_remove(&completions[bus], result);
+}
+
+uint64_t dali_hal_time_us() {
+    return time_us_64();
+}
@@ -14,6 +14,7 @@
 #include <pico/types.h>
 #include <pico/util/queue.h>
 #include "modbus_receiver.h"
+#include "regs.h"
 
 #include "pico/multicore.h"
 
@@ -23,14 +24,65 @@
 #define RS485_TX_PIN 4
 #define RS485_RX_PIN 5
 
+// Further DALI buses (see DALI_NUM_BUSES) use the GPIOs that nothing else on the board needs.
+static const uint32_t dali_bus_pins[][2] = {
+    {DALI_TX_PIN, DALI_RX_PIN},
+    {26, 27},
+    {28, 22},
+    {0, 15},
+};
+_Static_assert(DALI_NUM_BUSES <= sizeof(dali_bus_pins) / sizeof(dali_bus_pins[0]), "No pins for that many DALI buses");
+
+// A second RS485 bus (see MODBUS_NUM_BUSES) takes TX, RX and DE from the GPIOs that are otherwise free.
+static const uint32_t modbus_bus_pins[][3] = {
+    {RS485_TX_PIN, RS485_RX_PIN, RS485_CS_PIN},
+    {16, 17, 18},
+};
+_Static_assert(MODBUS_NUM_BUSES <= sizeof(modbus_bus_pins) / sizeof(modbus_bus_pins[0]), "No pins for that many RS485 buses");
+#ifdef MODBUS_TCP
+// The W5100S takes SPI0 on GPIO 16-21 (see modbus_tcp.c).
+_Static_assert(MODBUS_NUM_BUSES == 1, "The second RS485 bus and the W5100S both need GPIO 16-18");
+#endif
+
 #define LED_PIN 25 // Onboard LED pin for the Pico
 
 
+// Time that core 0 has spent asleep in scan_loop, and how often it has woken up, to show how busy the main loop is.
+// They are reported in CONFIG_HR_IDLE_PERMILLE and CONFIG_HR_WAKEUPS_PER_SEC at the end of each window.
+#define LOAD_WINDOW_US 10000000
+static uint64_t load_window_start;
+static uint64_t idle_us;
+static uint32_t wakeups;
+
+static void report_load(uint64_t now) {
+  uint64_t elapsed = now - load_window_start;
+
+  set_holding_reg(CONFIG_HR_IDLE_PERMILLE, idle_us * 1000 / elapsed);
+  set_holding_reg(CONFIG_HR_WAKEUPS_PER_SEC, MIN((uint64_t)wakeups * 1000000 / elapsed, 0xFFFF));
+  load_window_start = now;
+  idle_us = 0;
+  wakeups = 0;
+}
+
 void scan_loop() {
   buttons_poll();
   dali_poll();
   modbus_poll();
   watchdog_update();
+
+  // DALI completions come in by interrupt, and core 1 signals an event when it queues anything, so there is nothing
+  // to do until one of those or the next button scan, DALI poll or modbus deadline.  Modbus responses arrive by DMA,
+  // which the button scans (every 10ms / NUM_FIXTURES) check on often enough.
+  absolute_time_t wake_at = absolute_time_min(buttons_next_scan_time(), from_us_since_boot(dali_next_poll_time()));
+  wake_at = absolute_time_min(wake_at, modbus_next_poll_time());
+  uint64_t slept_at = time_us_64();
+  best_effort_wfe_or_timeout(wake_at);
+  uint64_t now = time_us_64();
+  idle_us += now - slept_at;
+  wakeups++;
+  if (now - load_window_start >= LOAD_WINDOW_US) {
+    report_load(now);
+  }
 }
 
 
@@ -58,9 +110,14 @@ int main() {
   gpio_put(LED_PIN, true);
 
   stdio_init_all();
+  regs_init();
 
-  dali_init(DALI_TX_PIN, DALI_RX_PIN);
-  modbus_init(RS485_TX_PIN, RS485_RX_PIN, RS485_CS_PIN);
+  for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+    dali_init(bus, dali_bus_pins[bus][0], dali_bus_pins[bus][1]);
+  }
+  for (int bus = 0; bus < MODBUS_NUM_BUSES; bus++) {
+    modbus_init(bus, modbus_bus_pins[bus][0], modbus_bus_pins[bus][1], modbus_bus_pins[bus][2]);
+  }
   buttons_init();
 
   multicore_lockout_victim_init();
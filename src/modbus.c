@@ -1,12 +1,14 @@
 #include "modbus.h"
 
 #include <hardware/clocks.h>
+#include <hardware/dma.h>
 #include <hardware/irq.h>
 #include <hardware/structs/timer.h>
 #include <hardware/timer.h>
 #include <pico/platform.h>
 #include <pico/stdio.h>
 #include <pico/stdlib.h>
+#include <pico/sync.h>
 #include <pico/util/queue.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,38 +20,168 @@
 #include "stdbool.h"
 #include "stdint.h"
 
-#define MODBUS_BAUD_RATE 9600
 #define QUEUE_DEPTH 10
 
-static queue_t task_queue;
-static modbus_task_state_t current_task_state = MODBUS_TASK_STATE_IDLE;
-static uint8_t response[256];
-static uint16_t response_crc;
-static uint8_t *response_ptr;
-static size_t response_sz;
+// The rates that we'll run a downstream bus at, fastest first.
+static const uint32_t baud_rates[] = {115200, 57600, 38400, 19200, 9600, 4800, 2400, 1200};
+#define NUM_BAUD_RATES (sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+// Set from either core, and picked up when the bus is next idle.  0 asks for an auto-probe.
+#define NO_BAUD_REQUEST 0xFFFFFFFF
+
+// Auto-probe tries each rate, fastest first, until every relay board that was answering before answers at it.  If none
+// were, the first rate that any board answers at wins.
+#define BAUD_PROBE_TIMEOUT_US 20000
+
+// The RX state machine's FIFO is streamed into a ring by DMA, so that no bytes are lost while the main loop is busy
+// or asleep, and a whole response can be handled at once.  The DMA is restarted at the start of the ring for each
+// request, so a response always starts at rx_ring[0].
+#define RX_RING_BITS 8
+#define RX_DMA_COUNT 0xFFFFFFFF
+
+static modbus_stats_t stats;
+
+// Requests are built straight into their queue entry, so the queue's storage is the pool of frame buffers and nothing
+// is ever allocated.  This is big enough for any request that we send downstream.
+#define MAX_REQUEST_SZ 32
+
+// A batched coil write answers to everyone that asked for one of the changes in it.
+#define MAX_TASK_CALLBACKS 4
 
 typedef struct modbus_task_t {
-    uint8_t *cmd;
+    uint8_t cmd[MAX_REQUEST_SZ];
     size_t sz;
-    modbus_task_cb callback;
+    modbus_task_cb callbacks[MAX_TASK_CALLBACKS];
+    uint8_t num_callbacks;
+    bool background;  // A coil sync read, rather than something that a user asked for.
+    bool baud_probe;  // Part of an auto-probe, so at a rate that the slave may not be using.
+    uint8_t batch_write;
 } modbus_task_t;
 
-static modbus_task_t current_task;
-static absolute_time_t timeout;
+// A coil batch whose changes aren't contiguous goes out as one write per run of changes, and only the last of those
+// writes answers the batch's callers, with the first failure among them.
+#define BATCH_WRITE_NONE 0
+#define BATCH_WRITE_PART 1  // More writes for the same batch follow.
+#define BATCH_WRITE_LAST 2
+
+// The coils of every relay board are read back in turn, so that our shadow catches up with boards that were power
+// cycled or switched by hand.  This only happens when nothing else is waiting, and is limited to a share of bus time.
+#define DEFAULT_SYNC_BUS_SHARE_PCT 10
+static unsigned int sync_bus_share_pct = DEFAULT_SYNC_BUS_SHARE_PCT;
+
+// How long each slave takes to start answering is tracked the way TCP tracks round trip times (RFC 6298), and the
+// response timeout is set from that, rather than always waiting the worst case.  A slave that misses enough responses
+// in a row is taken offline, so that requests for it fail straight away instead of each costing a full timeout.  It is
+// sent a probe now and then, backing off exponentially, until it answers again.
+#define MAX_TRACKED_SLAVES 32
+#define MIN_RESPONSE_TIMEOUT_US 5000
+#define MAX_RESPONSE_TIMEOUT_US 100000
+#define OFFLINE_AFTER_TIMEOUTS 3
+#define PROBE_INTERVAL_US 1000000
+#define MAX_PROBE_BACKOFF 6  // So at most 64 seconds between probes.
+
+typedef struct {
+    uint32_t srtt_us;    // Smoothed response latency, or 0 if we've not heard from the slave yet.
+    uint32_t rttvar_us;  // Smoothed deviation of the latency.
+    uint8_t timeouts;    // In a row.
+    uint8_t backoff;
+    bool offline;
+    absolute_time_t next_probe_at;
+} slave_link_t;
+
+// Each RS485 segment has its own pair of state machines on pio1, its own DE pin and its own queue, and runs its own
+// transaction independently of the others.
+typedef struct {
+    uint8_t rx_ring[1 << RX_RING_BITS] __attribute__((aligned(1 << RX_RING_BITS)));
+    uint8_t response[256];
+    size_t response_sz;
+
+    unsigned int index;
+    unsigned int tx_sm;
+    unsigned int rx_sm;
+    int rx_dma_chan;
+
+    queue_t task_queue;
+    modbus_task_state_t state;
+    modbus_task_t current_task;
+    absolute_time_t timeout;
+    absolute_time_t request_sent_at;
+    absolute_time_t first_rx_at;
+    absolute_time_t last_rx_at;
+
+    // Modbus RTU counts 11 bits per character.  A frame ends after 3.5 characters of silence, which above 19200 baud
+    // is fixed at 1750us.  (The 1.5 character limit between characters within a frame isn't checked, as received bytes
+    // arrive by DMA without a time for each.)
+    uint32_t baud_rate;
+    uint32_t char_us;
+    uint32_t t35_us;
+    volatile uint32_t requested_baud;
+    struct {
+        bool active;
+        uint8_t rate;       // Index into baud_rates of the rate being tried.
+        uint8_t device;     // The board being asked.
+        uint32_t expected;  // Bit n is board n.
+        uint32_t answered;
+        uint32_t fallback;  // Where we go back to if nothing answers at all.
+    } autobaud;
+
+    unsigned int next_sync_device;
+    absolute_time_t next_sync_at;
+
+    slave_link_t slave_links[MAX_TRACKED_SLAVES];
+} modbus_bus_t;
+
+static modbus_bus_t buses[MODBUS_NUM_BUSES];
+
+// Bit n-1 is the bus that relay board n is on.  Set from either core.
+static volatile uint32_t relay_bus_map;
+
+// Changes to one relay board's coils that haven't been sent yet.  They are held back for a short while so that changes
+// made close together (a scene, or several buttons) go out as a single FC15 rather than an FC05 each.
+#define COIL_BATCH_WINDOW_US 2000
+
+typedef struct {
+    uint32_t mask;    // Coils with a change waiting.
+    uint32_t values;  // What those coils are to be set to.
+    absolute_time_t flush_at;
+    modbus_task_cb callbacks[MAX_TASK_CALLBACKS];
+    uint8_t num_callbacks;
+    // How the writes for the batch's runs of changes that have already finished went.
+    modbus_task_state_t runs_state;
+} coil_batch_t;
+
+_Static_assert(MODBUS_NUM_COIL_DEVICES * MODBUS_COILS_PER_DEVICE == MAX_COILS, "Relay coils don't match the devices");
+_Static_assert(MODBUS_NUM_BUSES >= 1 && MODBUS_NUM_BUSES <= 2, "pio1 only has room for two buses");
+static coil_batch_t coil_batches[MODBUS_NUM_COIL_DEVICES];
+// Coil changes come from both cores.
+static critical_section_t batch_lock;
 
 static const PIO pio = pio1;
-static const unsigned int tx_sm = 0;
-static const unsigned int rx_sm = 1;
+static int tx_program_offset = -1;
+static int rx_program_offset = -1;
 
 static const char *TAG = "MODBUS";
 
-bool modbus_downstream_task_enqueue(uint8_t *cmd, size_t sz, modbus_task_cb callback) {
-    modbus_task_t t = {
-        .callback = callback,
-        .cmd = cmd,
-        .sz = sz,
-    };
-    return queue_try_add(&task_queue, &t);
+static inline bool on_bus(modbus_bus_t *bus, unsigned int device) {
+    return ((relay_bus_map >> (device - 1)) & 1) == bus->index;
+}
+
+// Adds a request (built in task, up to end) to a bus' queue.  Returns false, without blocking, if the queue is full.
+static bool modbus_downstream_task_enqueue(modbus_bus_t *bus, modbus_task_t *task, uint8_t *end) {
+    task->sz = end - task->cmd;
+    task->background = false;
+    task->baud_probe = false;
+    if (!queue_try_add(&bus->task_queue, task)) {
+        stats.queue_full++;
+        return false;
+    }
+    unsigned int level = queue_get_level(&bus->task_queue);
+    if (level > stats.queue_high_water) {
+        stats.queue_high_water = level;
+    }
+    // Core 0 may be asleep, and this may have come from core 1.
+    __sev();
+    return true;
 }
 
 #define container_of(ptr, type, member)                    \
@@ -77,81 +209,452 @@ void onError() {
     }
 }
 
-/**
- * This is the only direct action the Device takes on modbus itself (when a
- * button is pressed, if a binding is set)
- */
-void modbus_downstream_set_coil(uint8_t devaddr, uint16_t coil_num, uint16_t value, modbus_task_cb cb) {
-    // Allocate enough space for the command and its buffer.
-    uint8_t *cmd = (uint8_t *)malloc(8);
-    if (cmd == NULL) {
-        onError();
-    }
+// Builds the request for a contiguous run of coil changes on one device: an FC05 if only one coil changes, otherwise an
+// FC15 covering the run.
+static void build_coil_write(modbus_task_t *task, unsigned int device, uint32_t mask, uint32_t values, uint8_t **end) {
+    unsigned int first = __builtin_ctz(mask);
+    unsigned int last = 31 - __builtin_clz(mask);
     uint16_t crc = 0xFFFF;
-    uint8_t *ptr = cmd;
-
-    crc_append(ptr++, devaddr, &crc);
-    crc_append(ptr++, MODBUS_CMD_WRITE_SINGLE_COIL, &crc);
-    crc_append(ptr++, coil_num >> 8, &crc);
-    crc_append(ptr++, coil_num, &crc);
-    crc_append(ptr++, value >> 8, &crc);  // 0x55 = toggle.  0xFF = on, 0x00 = off.
-    crc_append(ptr++, value, &crc);
+    uint8_t *ptr = task->cmd;
+
+    crc_append(ptr++, device, &crc);
+    if (first == last) {
+        crc_append(ptr++, MODBUS_CMD_WRITE_SINGLE_COIL, &crc);
+        crc_append(ptr++, first >> 8, &crc);
+        crc_append(ptr++, first, &crc);
+        crc_append(ptr++, (values & mask) ? 0xFF : 0x00, &crc);
+        crc_append(ptr++, 0x00, &crc);
+    } else {
+        unsigned int count = last - first + 1;
+        unsigned int byte_count = (count + 7) / 8;
+        uint32_t bits = 0;
+
+        for (unsigned int i = 0; i < count; i++) {
+            if (values & (1u << (first + i))) {
+                bits |= 1u << i;
+            }
+        }
+        crc_append(ptr++, MODBUS_CMD_WRITE_MULTIPLE_COILS, &crc);
+        crc_append(ptr++, first >> 8, &crc);
+        crc_append(ptr++, first, &crc);
+        crc_append(ptr++, count >> 8, &crc);
+        crc_append(ptr++, count, &crc);
+        crc_append(ptr++, byte_count, &crc);
+        // The first coil goes in the least significant bit of the first byte.
+        for (unsigned int i = 0; i < byte_count; i++) {
+            crc_append(ptr++, bits >> (i * 8), &crc);
+        }
+    }
     *ptr++ = crc & 0xFF;
     *ptr++ = crc >> 8;
-    modbus_downstream_task_enqueue(cmd, 8, cb);
+    *end = ptr;
 }
 
-void modbus_downstream_set_coils(uint8_t devaddr, uint16_t coil_num, uint16_t count, uint8_t *value, modbus_task_cb cb) {
-    // Allocate enough space for the command and its buffer.
-    int byte_count = 8 + count / 8;
-    if (count % 8) {
-        byte_count++;
+/**
+ * Queues a change to one of the downstream relays, by its coil number in our own coil space.  It goes out with any
+ * other changes to the same device made within COIL_BATCH_WINDOW_US, and cb is called once that write completes.
+ * Returns false (and never calls cb) if too many callers are already waiting on the device's next write.
+ */
+static bool queue_coil_change(unsigned int coil, int value, modbus_task_cb cb) {
+    if (coil >= MAX_COILS) {
+        return false;
+    }
+    coil_batch_t *batch = &coil_batches[coil / MODBUS_COILS_PER_DEVICE];
+    uint32_t bit = 1u << (coil % MODBUS_COILS_PER_DEVICE);
+    bool queued = false;
+
+    critical_section_enter_blocking(&batch_lock);
+    if (!cb || batch->num_callbacks < MAX_TASK_CALLBACKS) {
+        if (value < 0) {
+            // Toggle whatever the coil will be once anything already waiting has gone out.
+            value = (batch->mask & bit) ? !(batch->values & bit) : !is_coil_set(coil);
+        }
+        if (!batch->mask) {
+            batch->flush_at = make_timeout_time_us(COIL_BATCH_WINDOW_US);
+        } else {
+            stats.coil_changes_batched++;
+        }
+        batch->mask |= bit;
+        if (value) {
+            batch->values |= bit;
+        } else {
+            batch->values &= ~bit;
+        }
+        if (cb) {
+            batch->callbacks[batch->num_callbacks++] = cb;
+        }
+        queued = true;
     }
-    uint8_t *cmd = (uint8_t *)malloc(byte_count);
-    if (cmd == NULL) {
-        onError();
+    critical_section_exit(&batch_lock);
+    if (queued) {
+        // Core 0 may be asleep, and this may have come from core 1.
+        __sev();
     }
-    uint16_t crc = 0xFFFF;
-    uint8_t *ptr = cmd;
-
-    crc_append(ptr++, devaddr, &crc);
-    crc_append(ptr++, MODBUS_CMD_WRITE_MULTIPLE_COILS, &crc);
-    crc_append(ptr++, 00, &crc);
-    crc_append(ptr++, coil_num, &crc);
-    crc_append(ptr++, 0x55, &crc);  // 0x55 = toggle.  0xFF = on, 0x00 = off.
-    crc_append(ptr++, 0x00, &crc);
-    *ptr++ = crc & 0xFF;
-    *ptr++ = crc >> 8;
-    modbus_downstream_task_enqueue(cmd, byte_count, cb);
+    return queued;
 }
 
+bool modbus_downstream_write_coil(unsigned int coil, bool on, modbus_task_cb cb) {
+    return queue_coil_change(coil, on, cb);
+}
+
+bool modbus_downstream_toggle_coil(unsigned int coil, modbus_task_cb cb) {
+    return queue_coil_change(coil, -1, cb);
+}
 
 /**
- * This is the only direct action the Device takes on modbus itself (when a
- * button is pressed, if a binding is set)
+ * Queues a run of relay changes, with the first coil's new value in the least significant bit of bits[0], as in an FC15.
+ * The changes for each device go into its batch together, and cb is called once for each device's write.  Returns the
+ * number of calls to expect, or -1 (having changed nothing) if one of the devices already has too many callers waiting.
  */
-void modbus_downstream_get_coils() {
-    // Allocate enough space for the command and its buffer.
-    uint8_t *cmd = (uint8_t *)malloc(8);
-    if (cmd == NULL) {
-        onError();
+int modbus_downstream_write_coils(unsigned int coil, unsigned int count, const uint8_t *bits, modbus_task_cb cb) {
+    unsigned int first_device = coil / MODBUS_COILS_PER_DEVICE;
+    unsigned int end_device = (coil + count + MODBUS_COILS_PER_DEVICE - 1) / MODBUS_COILS_PER_DEVICE;
+    int writes = 0;
+
+    if (count == 0 || coil + count > MAX_COILS) {
+        return -1;
+    }
+    critical_section_enter_blocking(&batch_lock);
+    for (unsigned int i = first_device; i < end_device; i++) {
+        if (cb && coil_batches[i].num_callbacks >= MAX_TASK_CALLBACKS) {
+            critical_section_exit(&batch_lock);
+            return -1;
+        }
     }
+    for (unsigned int i = first_device; i < end_device; i++) {
+        coil_batch_t *batch = &coil_batches[i];
+        unsigned int base = i * MODBUS_COILS_PER_DEVICE;
+        unsigned int from = MAX(coil, base);
+        unsigned int to = MIN(coil + count, base + MODBUS_COILS_PER_DEVICE);
+
+        // Every change but the one that opens the batch has joined it.
+        stats.coil_changes_batched += to - from;
+        if (!batch->mask) {
+            batch->flush_at = make_timeout_time_us(COIL_BATCH_WINDOW_US);
+            stats.coil_changes_batched--;
+        }
+        for (unsigned int c = from; c < to; c++) {
+            unsigned int n = c - coil;
+            uint32_t bit = 1u << (c - base);
+
+            batch->mask |= bit;
+            if ((bits[n / 8] >> (n % 8)) & 1) {
+                batch->values |= bit;
+            } else {
+                batch->values &= ~bit;
+            }
+        }
+        if (cb) {
+            batch->callbacks[batch->num_callbacks++] = cb;
+            writes++;
+        }
+    }
+    critical_section_exit(&batch_lock);
+    // Core 0 may be asleep, and this may have come from core 1.
+    __sev();
+    return writes;
+}
+
+bool modbus_set_relay_bus_map(uint32_t map) {
+    if (map >> MODBUS_NUM_COIL_DEVICES || (MODBUS_NUM_BUSES == 1 && map)) {
+        return false;
+    }
+    // Anything already queued for a board goes out on its old bus.  Changes still being batched follow it to its new
+    // one.
+    relay_bus_map = map;
+    set_holding_reg(CONFIG_HR_RELAY_BUS_MAP, map);
+    return true;
+}
+
+unsigned int modbus_relay_bus(unsigned int device) {
+    return (relay_bus_map >> (device - 1)) & 1;
+}
+
+// The lowest run of consecutive coils in mask.
+static inline uint32_t first_run(uint32_t mask) {
+    // Adding the lowest set bit carries through the run, clearing it.
+    return mask & ~(mask + (mask & -mask));
+}
+
+/**
+ * Sends any of this bus' batches whose window has closed.  Only called while the bus is idle, so that changes made while
+ * it was busy are still gathered up into the next write.  Only one run of consecutive changes goes in each write, as our
+ * shadow of the coils in between may be out of date, and we mustn't write coils that nobody asked to change.  The rest
+ * of the batch waits for the bus to be idle again.
+ */
+static void flush_coil_batches(modbus_bus_t *bus) {
+    for (int i = 0; i < MODBUS_NUM_COIL_DEVICES; i++) {
+        coil_batch_t *batch = &coil_batches[i];
+        modbus_task_t task;
+        uint8_t *end;
+
+        if (!batch->mask || !on_bus(bus, i + 1) || !time_reached(batch->flush_at) || queue_is_full(&bus->task_queue)) {
+            continue;
+        }
+        critical_section_enter_blocking(&batch_lock);
+        uint32_t run = first_run(batch->mask);
+        build_coil_write(&task, i + 1, run, batch->values, &end);
+        batch->mask &= ~run;
+        if (batch->mask) {
+            task.num_callbacks = 0;
+            task.batch_write = BATCH_WRITE_PART;
+        } else {
+            memcpy(task.callbacks, batch->callbacks, sizeof(task.callbacks));
+            task.num_callbacks = batch->num_callbacks;
+            task.batch_write = BATCH_WRITE_LAST;
+            batch->num_callbacks = 0;
+        }
+        critical_section_exit(&batch_lock);
+
+        // Only this core adds to the queue, and we checked that it had room.
+        modbus_downstream_task_enqueue(bus, &task, end);
+        stats.coil_batches++;
+    }
+}
+
+static slave_link_t *slave_link(modbus_bus_t *bus, unsigned int slave) {
+    // Address 0 is broadcast, which never gets an answer.
+    return (slave > 0 && slave < MAX_TRACKED_SLAVES) ? &bus->slave_links[slave] : NULL;
+}
+
+bool modbus_slave_online(unsigned int bus_no, unsigned int slave) {
+    if (bus_no >= MODBUS_NUM_BUSES) {
+        return false;
+    }
+    slave_link_t *link = slave_link(&buses[bus_no], slave);
+    return !link || !link->offline;
+}
+
+static inline bool probe_due(slave_link_t *link) {
+    return link && link->offline && time_reached(link->next_probe_at);
+}
+
+// How long to wait for the start of a response, once the request has been sent.
+static uint32_t response_timeout_us(slave_link_t *link) {
+    if (!link || !link->srtt_us) {
+        return MAX_RESPONSE_TIMEOUT_US;
+    }
+    uint32_t rto = link->srtt_us + 4 * link->rttvar_us;
+    // Back off while a slave is missing responses, in case it has just got slower.
+    rto <<= MIN(link->timeouts, 4);
+    return MAX(MIN_RESPONSE_TIMEOUT_US, MIN(rto, MAX_RESPONSE_TIMEOUT_US));
+}
+
+static void slave_answered(slave_link_t *link, uint32_t latency_us) {
+    if (!link) {
+        return;
+    }
+    if (!link->srtt_us) {
+        link->srtt_us = MAX(latency_us, 1);
+        link->rttvar_us = latency_us / 2;
+    } else {
+        uint32_t err = latency_us > link->srtt_us ? latency_us - link->srtt_us : link->srtt_us - latency_us;
+        link->rttvar_us = (3 * link->rttvar_us + err) / 4;
+        link->srtt_us = MAX((7 * link->srtt_us + latency_us) / 8, 1);
+    }
+    link->timeouts = 0;
+    link->offline = false;
+    link->backoff = 0;
+}
+
+static void slave_timed_out(slave_link_t *link) {
+    if (!link) {
+        return;
+    }
+    if (link->offline) {
+        // A probe that went unanswered.
+        link->backoff = MIN(link->backoff + 1, MAX_PROBE_BACKOFF);
+    } else if (++link->timeouts >= OFFLINE_AFTER_TIMEOUTS) {
+        link->offline = true;
+        link->backoff = 0;
+        stats.slaves_offline++;
+    } else {
+        return;
+    }
+    link->next_probe_at = make_timeout_time_us((uint64_t)PROBE_INTERVAL_US << link->backoff);
+}
+
+// Builds an FC01 that reads all of a relay board's coils.
+static void build_coil_read(modbus_task_t *task, unsigned int device) {
     uint16_t crc = 0xFFFF;
-    uint8_t *ptr = cmd;
+    uint8_t *ptr = task->cmd;
 
-    crc_append(ptr++, 1, &crc);
+    crc_append(ptr++, device, &crc);
     crc_append(ptr++, MODBUS_CMD_READ_COILS, &crc);
     crc_append(ptr++, 0, &crc);  // Address
     crc_append(ptr++, 0, &crc);
     crc_append(ptr++, 0, &crc);  // Number of coils
-    crc_append(ptr++, 32, &crc);
+    crc_append(ptr++, MODBUS_COILS_PER_DEVICE, &crc);
     *ptr++ = crc & 0xFF;
     *ptr++ = crc >> 8;
-    modbus_downstream_task_enqueue(cmd, 8, NULL);
+    task->sz = ptr - task->cmd;
+    task->num_callbacks = 0;
+    task->background = false;
+    task->baud_probe = false;
+    task->batch_write = BATCH_WRITE_NONE;
+}
+
+void modbus_set_sync_bus_share(unsigned int percent) {
+    sync_bus_share_pct = MIN(percent, 100);
+}
+
+static bool user_work_waiting(modbus_bus_t *bus) {
+    if (!queue_is_empty(&bus->task_queue)) {
+        return true;
+    }
+    for (int i = 0; i < MODBUS_NUM_COIL_DEVICES; i++) {
+        if (coil_batches[i].mask && on_bus(bus, i + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Makes the next board's coil read the current task, if the sync is within its share of bus time.  Boards that are
+// offline are left to their probes.
+static bool start_coil_sync(modbus_bus_t *bus) {
+    if (!sync_bus_share_pct || !time_reached(bus->next_sync_at)) {
+        return false;
+    }
+    for (int i = 0; i < MODBUS_NUM_COIL_DEVICES; i++) {
+        unsigned int device = bus->next_sync_device;
+
+        bus->next_sync_device = bus->next_sync_device % MODBUS_NUM_COIL_DEVICES + 1;
+        if (on_bus(bus, device) && !slave_link(bus, device)->offline) {
+            build_coil_read(&bus->current_task, device);
+            bus->current_task.background = true;
+            stats.sync_reads++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void set_baud_rate(modbus_bus_t *bus, uint32_t baud) {
+    bus->baud_rate = baud;
+    bus->char_us = 11 * 1000 * 1000 / baud;
+    bus->t35_us = baud > 19200 ? 1750 : bus->char_us * 7 / 2;
+    modbus_program_set_baud(pio, bus->tx_sm, baud);
+    modbus_program_set_baud(pio, bus->rx_sm, baud);
+    // What we know of each slave's timing, and whether it's there at all, was learnt at the old rate.
+    memset(bus->slave_links, 0, sizeof(bus->slave_links));
+    set_holding_reg(CONFIG_HR_MODBUS(bus->index, CONFIG_HR_MODBUS_BAUD_IN_USE), baud / 100);
+}
+
+bool modbus_set_baud_rate(unsigned int bus_no, uint32_t baud) {
+    if (bus_no >= MODBUS_NUM_BUSES) {
+        return false;
+    }
+    if (baud) {
+        unsigned int i = 0;
+        while (i < NUM_BAUD_RATES && baud_rates[i] != baud) {
+            i++;
+        }
+        if (i == NUM_BAUD_RATES) {
+            return false;
+        }
+    }
+    set_holding_reg(CONFIG_HR_MODBUS(bus_no, CONFIG_HR_MODBUS_BAUD), baud / 100);
+    buses[bus_no].requested_baud = baud;
+    __sev();
+    return true;
+}
+
+uint32_t modbus_get_baud_rate(unsigned int bus_no) {
+    return bus_no < MODBUS_NUM_BUSES ? buses[bus_no].baud_rate : 0;
+}
+
+static inline bool baud_probe_wanted(modbus_bus_t *bus, unsigned int device) {
+    return on_bus(bus, device) && (!bus->autobaud.expected || (bus->autobaud.expected & (1u << device)));
+}
+
+static void start_autobaud(modbus_bus_t *bus) {
+    bus->autobaud.expected = 0;
+    for (int device = 1; device <= MODBUS_NUM_COIL_DEVICES; device++) {
+        slave_link_t *link = slave_link(bus, device);
+        if (on_bus(bus, device) && link->srtt_us && !link->offline) {
+            bus->autobaud.expected |= 1u << device;
+        }
+    }
+    bus->autobaud.fallback = bus->baud_rate;
+    bus->autobaud.active = true;
+    bus->autobaud.rate = 0;
+    bus->autobaud.device = 0;
+    bus->autobaud.answered = 0;
+    set_baud_rate(bus, baud_rates[0]);
+}
+
+// Makes the next auto-probe read the current task.  Returns false once the probe has finished.
+static bool start_baud_probe(modbus_bus_t *bus) {
+    do {
+        bus->autobaud.device++;
+    } while (bus->autobaud.device <= MODBUS_NUM_COIL_DEVICES && !baud_probe_wanted(bus, bus->autobaud.device));
+
+    if (bus->autobaud.device > MODBUS_NUM_COIL_DEVICES) {
+        // Every board has had its chance at this rate.
+        bool good = bus->autobaud.answered &&
+                    (bus->autobaud.answered & bus->autobaud.expected) == bus->autobaud.expected;
+        if (good || ++bus->autobaud.rate == NUM_BAUD_RATES) {
+            bus->autobaud.active = false;
+            if (!good) {
+                set_baud_rate(bus, bus->autobaud.fallback);
+            }
+            return false;
+        }
+        set_baud_rate(bus, baud_rates[bus->autobaud.rate]);
+        bus->autobaud.device = 0;
+        bus->autobaud.answered = 0;
+        return start_baud_probe(bus);
+    }
+    build_coil_read(&bus->current_task, bus->autobaud.device);
+    bus->current_task.baud_probe = true;
+    return true;
+}
+
+static void baud_probe_done(modbus_bus_t *bus, bool answered) {
+    if (answered) {
+        bus->autobaud.answered |= 1u << bus->autobaud.device;
+    } else if (bus->autobaud.expected) {
+        // Someone that has to answer didn't, so there's no point asking the rest at this rate.
+        bus->autobaud.device = MODBUS_NUM_COIL_DEVICES;
+    }
+}
+
+// Starts whatever the latest call to modbus_set_baud_rate() asked for.  Only called while the bus is idle.
+static void apply_requested_baud(modbus_bus_t *bus) {
+    uint32_t baud = bus->requested_baud;
+
+    if (baud == NO_BAUD_REQUEST) {
+        return;
+    }
+    bus->requested_baud = NO_BAUD_REQUEST;
+    bus->autobaud.active = false;
+    if (baud) {
+        set_baud_rate(bus, baud);
+    } else {
+        start_autobaud(bus);
+    }
+}
+
+// Finds something to do with the bus when nobody has asked for anything: a probe of a relay board that has gone
+// offline, or else the next coil sync read.
+static bool start_background_task(modbus_bus_t *bus) {
+    if (user_work_waiting(bus)) {
+        return false;
+    }
+    for (int device = 1; device <= MODBUS_NUM_COIL_DEVICES; device++) {
+        if (on_bus(bus, device) && probe_due(slave_link(bus, device))) {
+            build_coil_read(&bus->current_task, device);
+            bus->current_task.background = true;
+            return true;
+        }
+    }
+    return start_coil_sync(bus);
 }
 
 /**
- * Returns true if we have a complete packet read
+ * Returns the length of the response in buf if it is complete, or minus the length that we're waiting for if not (or 0
+ * if we can't tell yet).
  */
 int modbus_expected_response_length(uint8_t *buf, size_t sz) {
     int expected_len = 0;
@@ -181,158 +684,382 @@ int modbus_expected_response_length(uint8_t *buf, size_t sz) {
                 case MODBUS_CMD_WRITE_MULTIPLE_REGISTERS:
                     expected_len = 8;
                     break;
+                default:
+                    // Our own custom codes are never sent downstream.
+                    break;
             }
         }
     }
-    if (expected_len && response_sz >= expected_len) {
+    if (expected_len && sz >= expected_len) {
         return expected_len;
     }
     return -expected_len;
 }
 
-void reflect_command_success_to_regs(uint8_t *cmd) {
+// Updates our shadow of the downstream coils once a device has accepted a write (or told us what its coils are).
+static void reflect_command_success_to_regs(uint8_t *cmd, uint8_t *response) {
     uint8_t function = cmd[1];
-    uint16_t addr, value;
-    uint32_t coils;
+    uint16_t addr, value, count;
+    uint32_t pending;
+    // The coils of the device that are being changed, and what to.
+    uint32_t mask = 0;
+    uint32_t values = 0;
+    unsigned int base = (cmd[0] - 1) * MODBUS_COILS_PER_DEVICE;
 
+    if (cmd[0] < 1 || cmd[0] > MODBUS_NUM_COIL_DEVICES) {
+        return;
+    }
+    addr = (cmd[2] << 8) | cmd[3];
     switch (function) {
         case MODBUS_CMD_WRITE_SINGLE_COIL:
-            addr = (cmd[2] << 8) | cmd[3];
             value = cmd[4];  // We only care about the high byte
-            if (addr < MAX_COILS) {
+            if (addr < MODBUS_COILS_PER_DEVICE) {
                 switch (value) {
                     case 0:
-                        clear_coil_reg(addr);
+                        clear_coil_reg(base + addr);
                         break;
                     case 0xFF:
-                        set_coil_reg(addr);
+                        set_coil_reg(base + addr);
                         break;
                     case 0x55:
-                        toggle_coil_reg(addr);
+                        toggle_coil_reg(base + addr);
                         break;
                     default:
                         break;
                 }
             }
             break;
+        case MODBUS_CMD_WRITE_MULTIPLE_COILS:
+            count = (cmd[4] << 8) | cmd[5];
+            for (int i = 0; i < count && addr + i < MODBUS_COILS_PER_DEVICE; i++) {
+                mask |= 1u << (addr + i);
+                if (cmd[7 + i / 8] & (1 << (i % 8))) {
+                    values |= 1u << (addr + i);
+                }
+            }
+            update_coil_regs(base, mask, values);
+            break;
         case MODBUS_CMD_READ_COILS:
-            coils = response[6] | (response[5] << 8) | (response[4] << 16) | (response[3] << 24);
-            unsigned bit = 0x01;
-            for (int i = 0; i < 32; i++, bit <<= 1) {
-                if (coils & bit) {
-                    set_coil_reg(i);
-                } else {
-                    clear_coil_reg(i);
+            // Coils come back packed from the least significant bit of the first byte.  Only coils that differ from our
+            // shadow are touched, and not ones with a change of ours still waiting to go out, as this read can't have
+            // seen it.
+            count = (cmd[4] << 8) | cmd[5];
+            critical_section_enter_blocking(&batch_lock);
+            pending = coil_batches[cmd[0] - 1].mask;
+            critical_section_exit(&batch_lock);
+            for (int i = 0; i < count && addr + i < MODBUS_COILS_PER_DEVICE && i / 8 < response[2]; i++) {
+                mask |= 1u << (addr + i);
+                if (response[3 + i / 8] & (1 << (i % 8))) {
+                    values |= 1u << (addr + i);
                 }
             }
+            stats.sync_changes += __builtin_popcount(update_coil_regs(base, mask & ~pending, values));
             break;
     }
 }
 
-void modbus_poll() {
+static void rx_dma_start(modbus_bus_t *bus) {
+    dma_channel_abort(bus->rx_dma_chan);
+    // We want the receive fifo to be completely empty - it should be, but its always good to be sure
+    pio_sm_restart(pio, bus->rx_sm);
+    pio_sm_clear_fifos(pio, bus->rx_sm);
+    dma_channel_set_trans_count(bus->rx_dma_chan, RX_DMA_COUNT, false);
+    dma_channel_set_write_addr(bus->rx_dma_chan, bus->rx_ring, true);
+}
+
+static inline size_t rx_bytes_received(modbus_bus_t *bus) {
+    return RX_DMA_COUNT - dma_channel_hw_addr(bus->rx_dma_chan)->transfer_count;
+}
+
+static uint16_t frame_crc(const uint8_t *buf, size_t sz) {
+    uint16_t crc = 0xFFFF;
+    while (sz--) {
+        crc_update(*buf++, &crc);
+    }
+    return crc;
+}
+
+static void finish_task(modbus_bus_t *bus, modbus_task_state_t state) {
+    modbus_task_t *task = &bus->current_task;
+    uint32_t turnaround = absolute_time_diff_us(bus->request_sent_at, get_absolute_time());
+    slave_link_t *link = slave_link(bus, task->cmd[0]);
+
+    bus->state = state;
+    if (task->baud_probe) {
+        // Any frame with a good CRC, even an exception, shows that the slave is at this rate.
+        baud_probe_done(bus, state == MODBUS_TASK_STATE_DONE);
+        return;
+    }
+    if (task->background && sync_bus_share_pct) {
+        // Leave the bus alone for long enough that the time this read took is no more than our share.
+        bus->next_sync_at =
+            make_timeout_time_us((uint64_t)turnaround * (100 - sync_bus_share_pct) / sync_bus_share_pct);
+    }
+    switch (state) {
+        case MODBUS_TASK_STATE_DONE:
+            stats.transactions++;
+            stats.last_turnaround_us = turnaround;
+            stats.total_turnaround_us += turnaround;
+            if (turnaround > stats.max_turnaround_us) {
+                stats.max_turnaround_us = turnaround;
+            }
+            break;
+        case MODBUS_TASK_STATE_TIMEOUT:
+            stats.timeouts++;
+            slave_timed_out(link);
+            return;
+        default:
+            stats.bad_frames++;
+            break;
+    }
+    // Something came back, even if it was garbled, so the slave is there.  The latency is from the end of our request
+    // to the start of the response.
+    int64_t latency =
+        absolute_time_diff_us(bus->request_sent_at, bus->first_rx_at) - (int64_t)task->sz * bus->char_us;
+    slave_answered(link, MAX(latency, 0));
+}
+
+// Tells everyone waiting on the bus' current task how it went.
+static void complete_task(modbus_bus_t *bus) {
+    modbus_task_t *task = &bus->current_task;
+    modbus_task_state_t state = bus->state;
+
+    if (task->batch_write != BATCH_WRITE_NONE) {
+        // Writes for one device's batch go out on the same bus, in order, so the last one finishes after the others.
+        coil_batch_t *batch = &coil_batches[task->cmd[0] - 1];
+        critical_section_enter_blocking(&batch_lock);
+        if (batch->runs_state == MODBUS_TASK_STATE_DONE) {
+            batch->runs_state = state;
+        }
+        state = batch->runs_state;
+        if (task->batch_write == BATCH_WRITE_LAST) {
+            batch->runs_state = MODBUS_TASK_STATE_DONE;
+        }
+        critical_section_exit(&batch_lock);
+    }
+    for (int i = 0; i < task->num_callbacks; i++) {
+        task->callbacks[i](state, task->cmd, bus->response, bus->response_sz);
+    }
+}
+
+void modbus_get_stats(modbus_stats_t *out) {
+    *out = stats;
+}
+
+static absolute_time_t bus_next_poll_time(modbus_bus_t *bus) {
+    absolute_time_t next;
+
+    switch (bus->state) {
+        case MODBUS_TASK_STATE_IDLE:
+            if (!queue_is_empty(&bus->task_queue) || bus->autobaud.active) {
+                return get_absolute_time();
+            }
+            next = sync_bus_share_pct ? bus->next_sync_at : at_the_end_of_time;
+            for (int i = 0; i < MODBUS_NUM_COIL_DEVICES; i++) {
+                slave_link_t *link = slave_link(bus, i + 1);
+                if (!on_bus(bus, i + 1)) {
+                    continue;
+                }
+                if (coil_batches[i].mask) {
+                    next = absolute_time_min(next, coil_batches[i].flush_at);
+                }
+                if (link->offline) {
+                    next = absolute_time_min(next, link->next_probe_at);
+                }
+            }
+            return next;
+        case MODBUS_TASK_STATE_PENDING:
+            return get_absolute_time();
+        case MODBUS_TASK_STATE_AWAITING_RESPONSE:
+            // Bytes arrive by DMA without waking anyone, so the caller must also poll regularly while a response is due.
+            return bus->response_sz ? absolute_time_min(bus->timeout, delayed_by_us(bus->last_rx_at, bus->t35_us))
+                                    : bus->timeout;
+        default:
+            return bus->timeout;
+    }
+}
+
+absolute_time_t modbus_next_poll_time() {
+    absolute_time_t next = at_the_end_of_time;
+
+    for (int i = 0; i < MODBUS_NUM_BUSES; i++) {
+        next = absolute_time_min(next, bus_next_poll_time(&buses[i]));
+    }
+    return next;
+}
+
+static void bus_poll(modbus_bus_t *bus) {
+    modbus_task_t *task = &bus->current_task;
     int expected;
-    int data_read;
+    size_t received;
+    slave_link_t *link;
 
-    switch (current_task_state) {
+    switch (bus->state) {
         case MODBUS_TASK_STATE_IDLE:
-            // No active task.  Check the queue
-            if (!queue_try_remove(&task_queue, &current_task)) {
+            // No active task.  Send out any coil changes that have waited long enough, then check the queue
+            flush_coil_batches(bus);
+            apply_requested_baud(bus);
+            if (bus->autobaud.active) {
+                // Anything else would be sent at whatever rate is being tried, so it waits until the probe is done.
+                if (!start_baud_probe(bus)) {
+                    break;
+                }
+            } else if (!queue_try_remove(&bus->task_queue, task) && !start_background_task(bus)) {
                 break;
             }
-            current_task_state = MODBUS_TASK_STATE_PENDING;
+            bus->state = MODBUS_TASK_STATE_PENDING;
             // The task _should_ be in the pending state.  Fall through.
 
         case MODBUS_TASK_STATE_PENDING:
-            // We are starting a new task (presumably that has just been de-queued)
-            pio_sm_restart(pio, tx_sm);
-            // Reset read buffer for read, just in case it wasn't already.
-
-            modbus_tx_program_putbuf(pio, tx_sm, current_task.cmd, current_task.sz);
-            current_task_state = MODBUS_TASK_STATE_AWAITING_RESPONSE;
-            response_crc = 0xFFFF;
-            response_sz = 0;
-            response_ptr = response;
-
-            // We want the receive fifo to be completely empty - it should be, but its
-            // always good to be sure
-            pio_sm_restart(pio, rx_sm);
-
-            // We expect to see a response in a handful of ms, but give it a bit
-            // longer, just in case.
-            timeout = make_timeout_time_ms(100);
+            // We are starting a new task (presumably that has just been de-queued).
+            bus->response_sz = 0;
+            link = task->baud_probe ? NULL : slave_link(bus, task->cmd[0]);
+            if (link && link->offline) {
+                if (!time_reached(link->next_probe_at)) {
+                    // Don't spend a timeout on a slave that isn't there.  Nothing went on the bus, so there's no gap to
+                    // wait out either.
+                    stats.offline_rejects++;
+                    bus->state = MODBUS_TASK_STATE_OFFLINE;
+                    complete_task(bus);
+                    bus->state = MODBUS_TASK_STATE_IDLE;
+                    break;
+                }
+                // This one gets to find out whether it has come back.
+                stats.probes++;
+            }
+            // Get ready to receive the response before we send anything.
+            rx_dma_start(bus);
+
+            pio_sm_restart(pio, bus->tx_sm);
+            bus->request_sent_at = get_absolute_time();
+            modbus_tx_program_putbuf(pio, bus->tx_sm, task->cmd, task->sz);
+            bus->state = MODBUS_TASK_STATE_AWAITING_RESPONSE;
+
+            // The timeout runs from when the last character of the request has gone out.
+            bus->timeout = delayed_by_us(bus->request_sent_at,
+                                         task->sz * bus->char_us +
+                                             (task->baud_probe ? BAUD_PROBE_TIMEOUT_US : response_timeout_us(link)));
             // We could fall through here, but there can't be any bytes in the receive buffer yet, so there isn't much point.
             break;
 
         case MODBUS_TASK_STATE_AWAITING_RESPONSE:
+            received = rx_bytes_received(bus);
+            if (received != bus->response_sz) {
+                bus->last_rx_at = get_absolute_time();
+                if (!bus->response_sz) {
+                    // The slave has started answering, so give it as long as the longest frame could take to finish.
+                    bus->first_rx_at = bus->last_rx_at;
+                    bus->timeout = delayed_by_us(bus->first_rx_at, sizeof(bus->rx_ring) * bus->char_us);
+                }
+                bus->response_sz = received;
+            }
             // Check to see if we have enough response bytes.
             // If we do, this call will return a positive number.
-            expected = modbus_expected_response_length(response, response_sz);
+            expected = modbus_expected_response_length(bus->rx_ring, bus->response_sz);
 
-            if (expected > 0) {
-                // We have a valid response packet.  Check its CRC.
-                if (response_crc == 0) {
-                    reflect_command_success_to_regs(current_task.cmd);
-                    current_task_state = MODBUS_TASK_STATE_DONE;
+            if (bus->response_sz > sizeof(bus->rx_ring)) {
+                // Longer than any valid frame, so the ring has wrapped over the start of it.
+                finish_task(bus, MODBUS_TASK_STATE_INVALID_CRC);
+            } else if (expected > 0 || (bus->response_sz &&
+                                        absolute_time_diff_us(bus->last_rx_at, get_absolute_time()) >= bus->t35_us)) {
+                // Either we have as much as the function code says we should get, or the slave has gone quiet for 3.5
+                // characters, which ends the frame regardless.
+                if (expected > 0) {
+                    bus->response_sz = expected;
+                }
+                memcpy(bus->response, bus->rx_ring, bus->response_sz);
+                if (expected > 0 && frame_crc(bus->response, bus->response_sz) == 0) {
+                    if (bus->response[1] == task->cmd[1]) {
+                        // Not an exception.
+                        reflect_command_success_to_regs(task->cmd, bus->response);
+                    }
+                    finish_task(bus, MODBUS_TASK_STATE_DONE);
                 } else {
-                    // Invalid CRC.
-                    current_task_state = MODBUS_TASK_STATE_INVALID_CRC;
+                    // Invalid CRC, or a truncated frame.
+                    finish_task(bus, MODBUS_TASK_STATE_INVALID_CRC);
                 }
-            } else if (time_reached(timeout)) {
+            } else if (time_reached(bus->timeout)) {
                 // defer_log(TAG, "Timeout waiting for Modbus response");
-                current_task_state = MODBUS_TASK_STATE_TIMEOUT;
-            } else {
-                // Not enough data yet. Try to read a character from the RS485 port
-                if ((data_read = modbus_rx_program_getc(pio, rx_sm)) >= 0) {
-                    *response_ptr++ = data_read;
-                    crc_update(data_read, &response_crc);
-                    response_sz++;
-                    // printf("L Read %02X - Expect %d of %d - CRC %d\n", data_read, expected, response_sz, response_crc);
-                }
+                finish_task(bus, MODBUS_TASK_STATE_TIMEOUT);
             }
             // If we changed to a terminal state, call the callback
-            if (current_task_state != MODBUS_TASK_STATE_AWAITING_RESPONSE) {
-                // Task was completed, but we need to wait for the inter-command delay.
-                timeout = make_timeout_time_us(1750);
-                // In the mean time, call the task callback if defined
-                if (current_task.callback) {
-                    current_task.callback(current_task_state, current_task.cmd, response, response_sz);
-                }
-                // We always use dynamically allocated commands, so free it up again. 
-                free(current_task.cmd);
+            if (bus->state != MODBUS_TASK_STATE_AWAITING_RESPONSE) {
+                // Task was completed, but we need to wait for the inter-frame gap.
+                bus->timeout = make_timeout_time_us(bus->t35_us);
+                // In the mean time, call the task callbacks if defined
+                complete_task(bus);
             }
             break;
 
         default:
-            // The task has completed, but we need to wait for the mandatory 1.75ms
-            // break between commands before transmitting another one.
-            if (time_reached(timeout)) {
+            // The task has completed, but we need to wait for the mandatory 3.5
+            // character break between frames before transmitting another one.
+            if (time_reached(bus->timeout)) {
                 // Done!  Let the loop fetch a new task on its next poll.
-                current_task_state = MODBUS_TASK_STATE_IDLE;
+                bus->state = MODBUS_TASK_STATE_IDLE;
             }
             break;
     }
 }
 
-void modbus_init(int tx_pin, int rx_pin, int de_pin) {
-    gpio_init(LED_PIN);
-    gpio_set_dir(LED_PIN, GPIO_OUT);
-
+void modbus_poll() {
+    for (int i = 0; i < MODBUS_NUM_BUSES; i++) {
+        bus_poll(&buses[i]);
+    }
+}
 
-    queue_init(&task_queue, sizeof(modbus_task_t), QUEUE_DEPTH);
+void modbus_init(unsigned int bus_no, int tx_pin, int rx_pin, int de_pin) {
+    if (bus_no >= MODBUS_NUM_BUSES) {
+        return;
+    }
+    modbus_bus_t *bus = &buses[bus_no];
 
-    uint offset = pio_add_program(pio, &modbus_tx_program);
-    modbus_tx_program_init(pio, tx_sm, offset, tx_pin, de_pin, MODBUS_BAUD_RATE);
-    offset = pio_add_program(pio, &modbus_rx_program);
-    modbus_rx_program_init(pio, rx_sm, offset, rx_pin, MODBUS_BAUD_RATE);
+    if (tx_program_offset < 0) {
+        // Everything that the buses share.
+        gpio_init(LED_PIN);
+        gpio_set_dir(LED_PIN, GPIO_OUT);
+        critical_section_init(&batch_lock);
+        for (int i = 0; i < MODBUS_NUM_COIL_DEVICES; i++) {
+            coil_batches[i].runs_state = MODBUS_TASK_STATE_DONE;
+        }
+        tx_program_offset = pio_add_program(pio, &modbus_tx_program);
+        rx_program_offset = pio_add_program(pio, &modbus_rx_program);
+        relay_bus_map = 0;
+        set_holding_reg(CONFIG_HR_RELAY_BUS_MAP, 0);
 
-    // Start with empty coils values.
-    for (int i = 0; i < MAX_COILS; i++) {
-        clear_coil_reg(i);
+        // Start with empty coils values.
+        for (int i = 0; i < MAX_COILS; i += 32) {
+            update_coil_regs(i, 0xFFFFFFFF, 0);
+        }
     }
 
+    bus->index = bus_no;
+    bus->tx_sm = bus_no * 2;
+    bus->rx_sm = bus_no * 2 + 1;
+    bus->state = MODBUS_TASK_STATE_IDLE;
+    bus->requested_baud = NO_BAUD_REQUEST;
+    bus->next_sync_device = 1;
+    queue_init(&bus->task_queue, sizeof(modbus_task_t), QUEUE_DEPTH);
+
+    modbus_tx_program_init(pio, bus->tx_sm, tx_program_offset, tx_pin, de_pin, MODBUS_DEFAULT_BAUD_RATE);
+    modbus_rx_program_init(pio, bus->rx_sm, rx_program_offset, rx_pin, MODBUS_DEFAULT_BAUD_RATE);
+    set_baud_rate(bus, MODBUS_DEFAULT_BAUD_RATE);
+    set_holding_reg(CONFIG_HR_MODBUS(bus_no, CONFIG_HR_MODBUS_BAUD), MODBUS_DEFAULT_BAUD_RATE / 100);
+
+    // Received characters are left justified in the FIFO word, so DMA reads just the top byte.
+    bus->rx_dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(bus->rx_dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, RX_RING_BITS);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, bus->rx_sm, false));
+    dma_channel_configure(bus->rx_dma_chan, &c, bus->rx_ring, (io_rw_8 *)&pio->rxf[bus->rx_sm] + 3, RX_DMA_COUNT,
+                          true);
+
     // The RS485 chip seems to need a little bit of start up time before it can
     // receive commands after reboot. We put a sleep in here as a cheap way of
-    // ensuring that.
+    // ensuring that.  The background sync will then read every board's coils.
     sleep_ms(100);
-    modbus_downstream_get_coils();
-}
\ No newline at end of file
+    bus->next_sync_at = get_absolute_time();
+}
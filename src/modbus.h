@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pico/types.h>
 
 typedef enum {
     MODBUS_TASK_STATE_IDLE,
@@ -13,6 +14,7 @@ typedef enum {
     MODBUS_TASK_STATE_DONE,
     MODBUS_TASK_STATE_TIMEOUT,
     MODBUS_TASK_STATE_INVALID_CRC,
+    MODBUS_TASK_STATE_OFFLINE,  // Never sent, as the slave has stopped answering.  See modbus_slave_online().
 } modbus_task_state_t;
 
 
@@ -23,10 +25,11 @@ typedef enum {
     MODBUS_CMD_READ_INPUT_REGISTERS = 0x04,
     MODBUS_CMD_WRITE_SINGLE_COIL = 0x05,
     MODBUS_CMD_WRITE_SINGLE_REGISTER = 0x06,
-    MODBUS_CMD_WRITE_MULTIPLE_COILS = 0x15,
-    MODBUS_CMD_WRITE_MULTIPLE_REGISTERS = 0x16,
+    MODBUS_CMD_WRITE_MULTIPLE_COILS = 0x0F,
+    MODBUS_CMD_WRITE_MULTIPLE_REGISTERS = 0x10,
     MODBUS_CMD_CUSTOM_EXEC_DALI = 0x44,
     MODBUS_CMD_CUSTOM_START_PROCESS = 0x45,
+    MODBUS_CMD_CUSTOM_READ_CHANGES = 0x46,
 } modbus_cmd_t;
   
 typedef enum {
@@ -42,12 +45,61 @@ typedef enum {
     MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND = 0x0b,
 } modbus_err_t;
 
+// Counters for the downstream master, so that transaction turnaround can be measured on the device.
+typedef struct {
+    uint32_t transactions;        // Requests that got a valid response.
+    uint32_t timeouts;
+    uint32_t bad_frames;          // Responses with a bad CRC, or that were cut short or too long.
+    uint32_t last_turnaround_us;  // From sending a request until its response was complete.
+    uint32_t max_turnaround_us;
+    uint64_t total_turnaround_us;
+    uint32_t queue_high_water;    // Most requests that have been waiting at once.
+    uint32_t queue_full;          // Requests turned away because the queue was full.
+    uint32_t coil_batches;        // Coil writes sent, each covering one or more changes to a device.
+    uint32_t coil_changes_batched;  // Coil changes that joined a write that was already waiting.
+    uint32_t sync_reads;          // Background reads of a relay board's coils.
+    uint32_t sync_changes;        // Coils that a background read found had changed behind our back.
+    uint32_t slaves_offline;      // Times that a slave was marked offline after timing out repeatedly.
+    uint32_t offline_rejects;     // Requests failed without being sent, because their slave was offline.
+    uint32_t probes;              // Requests sent to an offline slave to see whether it is back.
+} modbus_stats_t;
+
 typedef void (*modbus_task_cb)(modbus_task_state_t state, uint8_t *cmd, uint8_t *response, size_t sz);
 
 
-void modbus_init(int tx_pin, int rx_pin, int cs_pin);
+// Sets up one RS485 bus.  Bus n uses pio1 state machines 2n and 2n+1.
+void modbus_init(unsigned int bus, int tx_pin, int rx_pin, int de_pin);
 void modbus_poll();
-void modbus_downstream_set_coil(uint8_t devaddr, uint16_t coil_num, uint16_t value, modbus_task_cb cb);
+// modbus_poll() has nothing to do before this time, other than notice response bytes arriving.
+absolute_time_t modbus_next_poll_time();
+void modbus_get_stats(modbus_stats_t *stats);
+// Downstream relay boards are at unit ids 1, 2, ... each with this many of our coils.
+#define MODBUS_COILS_PER_DEVICE 32
+#define MODBUS_NUM_COIL_DEVICES 8
+
+// Bit n-1 of map is the bus that relay board n is on.  All boards start on bus 0.  Returns false if the map names a bus
+// that doesn't exist.
+bool modbus_set_relay_bus_map(uint32_t map);
+// The bus that relay board device (numbered from 1) is on.
+unsigned int modbus_relay_bus(unsigned int device);
+// Changes a downstream relay, by its number in our coil space.  Changes to the same device made close together are sent
+// as one write.  Returns false, and never calls cb, if the change couldn't be queued because the device is backed up.
+bool modbus_downstream_write_coil(unsigned int coil, bool on, modbus_task_cb cb);
+bool modbus_downstream_toggle_coil(unsigned int coil, modbus_task_cb cb);
+// Changes a run of relays at once, with the first one's value in the low bit of bits[0].  cb is called once for each
+// device's write.  Returns how many calls that will be, or -1 if nothing could be queued.
+int modbus_downstream_write_coils(unsigned int coil, unsigned int count, const uint8_t *bits, modbus_task_cb cb);
+// False once a slave has stopped answering.  Requests to it then fail straight away, other than an occasional one that
+// is let through to see whether it has come back.
+bool modbus_slave_online(unsigned int bus, unsigned int slave);
+// Each bus starts at this rate.  modbus_set_baud_rate() changes it, once the bus is next idle, to one of 1200, 2400,
+// 4800, 9600, 19200, 38400, 57600 or 115200, or with 0 to the fastest that every relay board on the bus answers at.
+// Returns false for any other rate.
+#define MODBUS_DEFAULT_BAUD_RATE 9600
+bool modbus_set_baud_rate(unsigned int bus, uint32_t baud);
+uint32_t modbus_get_baud_rate(unsigned int bus);
+// Limits the background coil sync to this percentage of downstream bus time.  0 turns it off.
+void modbus_set_sync_bus_share(unsigned int percent);
 
 int modbus_expected_length(uint8_t *buf, size_t sz);
 void onError();
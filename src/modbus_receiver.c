@@ -21,72 +21,185 @@
 #include "crcbuf.h"
 #include "dali.h"
 #include "modbus.h"
+#include "modbus_tcp.h"
 #include "regs.h"
 
 static semaphore_t downstream_response_ready;
-static uint16_t read_crc = 0xFFFF;
 
 #define MODBUS_SERVER_READ_MAX_PACKET_SZ 256
-static absolute_time_t last_read = 0;
-static uint8_t cmd_bytes[MODBUS_SERVER_READ_MAX_PACKET_SZ];
-static uint8_t res_bytes[MODBUS_SERVER_READ_MAX_PACKET_SZ];
-static uint8_t *response;
+// Whatever the host has sent that we haven't dealt with yet.  USB delivers data a packet at a time, so this is filled
+// with as much as is available in one go, and may hold several frames, or part of one.
+static uint8_t rx_buf[MODBUS_SERVER_READ_MAX_PACKET_SZ * 2];
+static size_t rx_len;
+// If the rest of a frame hasn't turned up by then, the host has given up on it.
+#define PARTIAL_FRAME_TIMEOUT_US 100000
+// When to give up on the part of a frame in rx_buf.  Kept from one call of modbus_read_frame to the next, as the
+// server thread comes out of it every millisecond while there is TCP or a bus operation to look after.
+static absolute_time_t partial_until = at_the_end_of_time;
 
+// One request and the response that is being built for it.
 typedef struct {
+    uint8_t cmd_bytes[MODBUS_SERVER_READ_MAX_PACKET_SZ];
+    uint8_t *cmd_next;
+    uint8_t *cmd_end;  // Where the CRC starts.
+    uint8_t res_bytes[MODBUS_SERVER_READ_MAX_PACKET_SZ];
+    uint8_t *response;
+    bool waiting;  // For a DALI or relay operation to finish.
+    modbus_origin_t origin;
+} modbus_txn_t;
+
+static const modbus_origin_t usb_origin = {.socket = MODBUS_ORIGIN_USB};
+
+// A read of the change log that finds nothing new can ask to be held until something changes, so that a client hears
+// about changes as they happen without polling.
+#define MAX_CHANGE_WAITERS 4
+#define CHANGE_WAIT_UNIT_MS 100
+// As many records as fit in a response, after the flags, next sequence number and count.
+#define MAX_CHANGE_RECORDS ((253 - 7) / 6)
+typedef struct {
+    bool active;
+    uint8_t unit;
+    uint32_t since;
+    absolute_time_t until;
+    modbus_origin_t origin;
+} change_waiter_t;
+static change_waiter_t change_waiters[MAX_CHANGE_WAITERS];
+static unsigned int num_change_waiters;
+
+// Requests that only touch register memory are answered straight away, in this.  Those that need a DALI or relay bus
+// are parked here and run one at a time, so that a slow bus operation doesn't hold up reads.  Their responses go back
+// when they finish, so can come after the responses to later requests.
+#define MAX_PARKED_TXNS 8
+static modbus_txn_t memory_txn;
+static modbus_txn_t parked_txns[MAX_PARKED_TXNS];
+static unsigned int parked_head;
+static unsigned int parked_count;
+// The parked request whose bus operation is under way.  The completion callbacks (which run on core 0) answer into it,
+// holding bus_txn_lock, so that it can't be answered and reused underneath them.
+static modbus_txn_t *volatile bus_txn;
+static critical_section_t bus_txn_lock;
+static absolute_time_t bus_txn_deadline;
+// A request that times out is answered straight away, but its operation can't be called off part way through a
+// command.  It becomes bus_txn in place of the request, so that whatever the operation still has to say goes nowhere,
+// and the next request waits for it to finish, rather than having its state overwritten.
+static modbus_txn_t orphan_txn;
+// Counted up each time an operation is given up on.  The multi-step operations note it when they start, and stop at
+// the next step once it has moved on.
+static volatile uint32_t bus_op_gen;
+// If an abandoned operation has gone this long without a step finishing, its callback has been lost, and the bus is
+// free for the next request.
+#define BUS_TXN_ABANDON_MS 10000
+// How long a bus operation may go without any step of it finishing.  Writes that span a DALI bank run to hundreds of
+// frames, so the deadline is pushed back each time a step finishes, rather than covering the whole operation.
+#define BUS_TXN_TIMEOUT_MS 1000
+// Counted up (on core 0) as each step finishes.  Core 1 notices the change and moves the deadline, as the deadline
+// can't be written atomically from the other core.
+static volatile uint32_t bus_txn_steps;
+static uint32_t bus_txn_steps_seen;
+// How often we look for a bus operation having finished, while we're also waiting for requests.
+#define BUS_TXN_POLL_US 1000
+
+typedef struct {
+    unsigned bus;
     unsigned addr;
     unsigned changed;
     unsigned newGroups;
     unsigned nextGroupId;
+    uint32_t gen;
+    dali_result_cb_t done;  // Called with the result of the last change, or the first one that failed.
 } dali_group_change_t;
 dali_group_change_t groupChange;
 
-static void set_response_to_error(modbus_err_t err) {
+// The DALI part of a Write Multiple Registers, which is written one register (or run of identical levels) at a time,
+// each step started from the callback of the one before.
+#define MAX_WRITE_REGISTERS 123
+typedef struct {
+    uint16_t values[MAX_WRITE_REGISTERS];
+    unsigned first;  // Register that values[0] is for.
+    unsigned next;   // Next register to write.
+    unsigned dali_end;
+    unsigned end;
+    unsigned in_flight;  // First register of the step under way.
+    uint32_t gen;
+} write_registers_t;
+static write_registers_t writeRegisters;
+
+// A Write Multiple Coils waits for a write to each relay board that it touched, and for a chain of DALI on and off
+// commands, one pair for each DALI bus.  Relay writes finish on core 0, but the DALI chain can finish straight away on
+// core 1, hence the lock.
+typedef struct {
+    dali_light_mask_t on[DALI_NUM_BUSES];
+    dali_light_mask_t off[DALI_NUM_BUSES];
+    unsigned next;  // Bus * 2, plus one for the off half.
+    int pending;    // Relay writes, plus one for the DALI chain.
+    uint32_t gen;
+} write_coils_t;
+static write_coils_t writeCoils;
+static critical_section_t write_coils_lock;
+
+static void set_response_to_error(modbus_txn_t *txn, modbus_err_t err) {
     // reset the buffer, if it had anything written to it.  This will overwrite what was there.
-    res_bytes[0] = cmd_bytes[0];
-    res_bytes[1] = cmd_bytes[1] | 0x80;  // Set the error MSB on the cmd that was set earlier
-    res_bytes[2] = err;
-    response = res_bytes + 3;
+    txn->res_bytes[0] = txn->cmd_bytes[0];
+    txn->res_bytes[1] = txn->cmd_bytes[1] | 0x80;  // Set the error MSB on the cmd that was set earlier
+    txn->res_bytes[2] = err;
+    txn->response = txn->res_bytes + 3;
 }
 
-static bool await_downstream_response() {
-    if (!sem_acquire_timeout_ms(&downstream_response_ready, 1000)) {
-        // Timeout while waiting for a response.
-        // toggleLED();
-        set_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
-        return false;
-    }
-    return true;
+// Answers the request under way with an exception, from a completion callback.
+static void set_bus_response_to_error(modbus_err_t err) {
+    critical_section_enter_blocking(&bus_txn_lock);
+    set_response_to_error(bus_txn, err);
+    critical_section_exit(&bus_txn_lock);
+}
+
+// Called once a bus operation has been started on behalf of txn.  Its response goes out once the operation's callback
+// releases downstream_response_ready.
+static void await_downstream_response(modbus_txn_t *txn) {
+    txn->waiting = true;
+    bus_txn_steps_seen = bus_txn_steps;
+    bus_txn_deadline = make_timeout_time_ms(BUS_TXN_TIMEOUT_MS);
 }
 
-static void modbus_write_registers(uint8_t device, uint8_t cmd, uint16_t addr, uint16_t data[], uint16_t num_regs) {
-    // TODO set the registers
-    *response++ = addr >> 8;
-    *response++ = addr & 0xFF;
-    *response++ = num_regs >> 8;
-    *response++ = num_regs & 0xFF;
+// Whether the operation that started under gen has since been given up on.
+static inline bool bus_op_abandoned(uint32_t gen) {
+    return gen != bus_op_gen;
 }
 
+// Called as each step of a bus operation finishes, so that the operation doesn't time out while it is still going.
+static inline void bus_txn_step_done() {
+    bus_txn_steps++;
+}
+
+
 static void modbus_set_coil_completed(modbus_task_state_t state, uint8_t *cmd, uint8_t *downstream_response, size_t sz) {
     if (state != MODBUS_TASK_STATE_DONE) {
-        set_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+        set_bus_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
     }
     // Let the main thread know it can continue.
     sem_release(&downstream_response_ready);
 }
 
+static inline bool dali_result_ok(int res, bool nakIsOkay) {
+    // Most commands never get a backward frame, so for them a NAK is success.
+    return res >= 0 || (res == DALI_NAK && nakIsOkay);
+}
+
 static bool daliCommandSucceeded(int res, bool nakIsOkay) {
+    if (dali_result_ok(res, nakIsOkay)) {
+        return true;
+    }
     if (res < 0) {
         switch (res) {
             case DALI_NAK:
-                set_response_to_error(MODBUS_ERR_NACK);
+                set_bus_response_to_error(MODBUS_ERR_NACK);
 
                 break;
             case DALI_BUS_ERROR:
-                set_response_to_error(MODBUS_ERR_SLAVE_DEVICE_FAIL);
+                set_bus_response_to_error(MODBUS_ERR_SLAVE_DEVICE_FAIL);
                 break;
             case DALI_TIMEOUT:
             default:
-                set_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+                set_bus_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
                 break;
         }
         return false;
@@ -99,202 +212,436 @@ static void dali_command_complete(int res) {
     sem_release(&downstream_response_ready);
 }
 
-static inline bool no_response_set() { return response - res_bytes == 2; }
+// Whether the relay board with coil on it is answering.  Writes to one that has stopped fail straight away, rather than
+// waiting for their batch to go out and be turned back.  The board's own probes find out when it returns.
+static bool relay_online(unsigned coil) {
+    unsigned device = coil / MODBUS_COILS_PER_DEVICE + 1;
+    return modbus_slave_online(modbus_relay_bus(device), device);
+}
+
+void set_coil(modbus_txn_t *txn, uint16_t addr, uint16_t value) {
+    // The response is a copy of the request, unless the operation sets an error.
+    memcpy(txn->response, txn->cmd_bytes + 2, 4);
+    txn->response += 4;
 
-void set_coil(uint8_t device, uint8_t cmd, uint16_t addr, uint16_t value) {
-    if (addr < MAX_COILS) {
-        modbus_downstream_set_coil(1 + addr / 32, addr % 32, value, modbus_set_coil_completed);
-        await_downstream_response();
-    } else if (addr < MAX_COILS + MAX_DALI_LIGHTS) {
-        dali_toggle(addr - MAX_COILS, dali_command_complete);
-        await_downstream_response();
+    if (addr < MAX_COILS && value != 0x0000 && value != 0xFF00 && value != 0x5500) {
+        // Anything else would be taken as off, once it is only kept as whether the coil is on.
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_VALUE);
+    } else if (addr < MAX_COILS && !relay_online(addr)) {
+        set_response_to_error(txn, MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+    } else if (addr < MAX_COILS) {
+        // The downstream relay boards also understand 0x5500 as a toggle.
+        bool queued = value == 0x5500 ? modbus_downstream_toggle_coil(addr, modbus_set_coil_completed)
+                                      : modbus_downstream_write_coil(addr, value == 0xFF00, modbus_set_coil_completed);
+        if (queued) {
+            await_downstream_response(txn);
+        } else {
+            set_response_to_error(txn, MODBUS_ERR_SLAVE_DEVICE_BUSY);
+        }
+    } else if (addr < DALI_COIL_BASE + MAX_DALI_COILS) {
+        addr -= DALI_COIL_BASE;
+        dali_toggle(addr / MAX_DALI_LIGHTS, addr % MAX_DALI_LIGHTS, dali_command_complete);
+        await_downstream_response(txn);
         // The level is not guaranteed to have been changed immediately after this, as fading is an asynchronous process.
     } else {
-        set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
+    }
+}
+
+static void write_coils_part_done() {
+    critical_section_enter_blocking(&write_coils_lock);
+    bool done = --writeCoils.pending == 0;
+    critical_section_exit(&write_coils_lock);
+    if (done) {
+        sem_release(&downstream_response_ready);
+    }
+}
+
+static void write_coils_relays_done(modbus_task_state_t state, uint8_t *cmd, uint8_t *downstream_response, size_t sz) {
+    bus_txn_step_done();
+    if (state != MODBUS_TASK_STATE_DONE) {
+        set_bus_response_to_error(MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+    }
+    write_coils_part_done();
+}
+
+// Sends the lights to be turned on and then off for each DALI bus in turn, stopping at the first failure.
+static void write_coils_dali_step(int res) {
+    write_coils_t *w = &writeCoils;
+
+    bus_txn_step_done();
+    if (bus_op_abandoned(w->gen)) {
+        res = DALI_TIMEOUT;
+    }
+    if (!daliCommandSucceeded(res, true)) {
+        write_coils_part_done();
+        return;
+    }
+    while (w->next < DALI_NUM_BUSES * 2) {
+        unsigned bus = w->next / 2;
+        bool on = !(w->next & 1);
+        dali_light_mask_t lights = on ? w->on[bus] : w->off[bus];
+
+        w->next++;
+        if (lights) {
+            dali_set_on_many(bus, lights, on, write_coils_dali_step);
+            return;
+        }
+    }
+    write_coils_part_done();
+}
+
+/**
+ * Sets a run of coils, which may span relays and DALI lights.  Relay changes join each board's batched write, and each
+ * bus' DALI changes go out as one on and one off command, which can use group or broadcast frames.  Answered once
+ * everything has finished.
+ */
+static void modbus_write_coils(modbus_txn_t *txn, uint16_t addr, uint16_t count, const uint8_t *bits) {
+    write_coils_t *w = &writeCoils;
+    unsigned relay_count = addr < MAX_COILS ? MIN(count, MAX_COILS - addr) : 0;
+    // One write for each relay board that the run touches.
+    int relay_writes = relay_count ? (addr + relay_count - 1) / MODBUS_COILS_PER_DEVICE - addr / MODBUS_COILS_PER_DEVICE + 1
+                                   : 0;
+
+    if (count == 0 || count > 0x7B0 || addr + count > DALI_COIL_BASE + MAX_DALI_COILS) {
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        return;
     }
-    // Copy the request to the response, if no error was set
-    if (no_response_set()) {
-        memcpy(response, cmd_bytes + 2, 4);
-        response += 4;
+    for (unsigned coil = addr; coil < addr + relay_count; coil += MODBUS_COILS_PER_DEVICE - coil % MODBUS_COILS_PER_DEVICE) {
+        if (!relay_online(coil)) {
+            // Nothing is changed if any of the boards is known not to be there.
+            set_response_to_error(txn, MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+            return;
+        }
+    }
+    memset(w, 0, sizeof(*w));
+    w->gen = bus_op_gen;
+    // Everything that has to finish is counted before any of it is started, as a relay write can finish (on core 0)
+    // before the rest has been queued.  The one for the DALI chain is also held until everything has been started.
+    w->pending = 1 + relay_writes;
+    if (relay_count) {
+        if (modbus_downstream_write_coils(addr, relay_count, bits, write_coils_relays_done) < 0) {
+            set_response_to_error(txn, MODBUS_ERR_SLAVE_DEVICE_BUSY);
+            return;
+        }
+    }
+    for (unsigned n = MAX(addr, DALI_COIL_BASE) - addr; n < count; n++) {
+        unsigned light = addr + n - DALI_COIL_BASE;
+        dali_light_mask_t bit = (dali_light_mask_t)1 << (light % MAX_DALI_LIGHTS);
+
+        if ((bits[n / 8] >> (n % 8)) & 1) {
+            w->on[light / MAX_DALI_LIGHTS] |= bit;
+        } else {
+            w->off[light / MAX_DALI_LIGHTS] |= bit;
+        }
     }
+    *txn->response++ = addr >> 8;
+    *txn->response++ = addr & 0xFF;
+    *txn->response++ = count >> 8;
+    *txn->response++ = count & 0xFF;
+
+    await_downstream_response(txn);
+    write_coils_dali_step(0);
 }
 
 static void dali_custom_command_complete(int res) {
-    if (daliCommandSucceeded(res, true)) {
-        *response++ = res;
+    // A raw command's answer is returned to the caller, so it needs to know when there wasn't one.
+    if (daliCommandSucceeded(res, false)) {
+        critical_section_enter_blocking(&bus_txn_lock);
+        *bus_txn->response++ = res;
+        critical_section_exit(&bus_txn_lock);
     }
     sem_release(&downstream_response_ready);
 }
 
 static void dali_group_change_step(int responseFromLastChange) {
-    if (daliCommandSucceeded(responseFromLastChange, true)) {
+    bus_txn_step_done();
+    if (bus_op_abandoned(groupChange.gen)) {
+        responseFromLastChange = DALI_TIMEOUT;
+    }
+    if (dali_result_ok(responseFromLastChange, true)) {
         while (groupChange.nextGroupId < 16) {
             if (groupChange.changed & 0x01) {
                 // Send the change, then wait for a callback.
                 if (groupChange.newGroups & 1) {
-                    dali_add_to_group(groupChange.addr, groupChange.nextGroupId, dali_group_change_step);
+                    dali_add_to_group(groupChange.bus, groupChange.addr, groupChange.nextGroupId, dali_group_change_step);
                 } else {
-                    dali_remove_from_group(groupChange.addr, groupChange.nextGroupId, dali_group_change_step);
+                    dali_remove_from_group(groupChange.bus, groupChange.addr, groupChange.nextGroupId, dali_group_change_step);
                 }
-                return;  // Without releasing the semaphore, as we haven't finished the loop yet.  The command we just enqueued
-                         // will call this callback again to complete the set command.
+                return;  // Without finishing, as we haven't finished the loop yet.  The command we just enqueued will call
+                         // this callback again to complete the set command.
             }
             groupChange.changed >>= 1;
             groupChange.newGroups >>= 1;
             groupChange.nextGroupId++;
         }
     }
-    sem_release(&downstream_response_ready);
+    groupChange.done(responseFromLastChange);
 }
 
-void set_holding_register_action(int addr, uint16_t value) {
-    // First set of values are Button Bindings
-    if (addr < MAX_DISCRETE_INPUTS) {
-        set_and_persist_binding(addr, value);
-        return;
+// Applies a write to one of the configuration registers.  Returns 0, or the exception to answer with.
+static modbus_err_t set_config_register(unsigned addr, uint16_t value) {
+    if (addr == CONFIG_HR_RELAY_BUS_MAP) {
+        return modbus_set_relay_bus_map(value) ? 0 : MODBUS_ERR_ILLEGAL_DATA_VALUE;
+    }
+    if (addr > CONFIG_HR_RELAY_BUS_MAP) {
+        // Read only.
+        return MODBUS_ERR_ILLEGAL_DATA_ADDR;
+    }
+    switch (CONFIG_HR_MODBUS_ID_FROM_REGID(addr)) {
+        case CONFIG_HR_MODBUS_BAUD:
+            return modbus_set_baud_rate(CONFIG_HR_MODBUS_BUS_FROM_REGID(addr), value * 100)
+                       ? 0
+                       : MODBUS_ERR_ILLEGAL_DATA_VALUE;
+        default:
+            return MODBUS_ERR_ILLEGAL_DATA_ADDR;
     }
+}
 
-    // After the bindings, we have banks of 64 registers, one register for each ballast on the dali bus.
+// Starts writing one of the DALI bank registers, with cb called once it is done.  Returns false if there was nothing
+// to do, in which case cb is never called.
+static bool start_dali_register_write(unsigned addr, uint16_t value, dali_result_cb_t cb) {
+    // Each DALI bus has banks of 64 registers, one register for each ballast on that bus.
+    unsigned bus = DALI_BUS_FROM_REGID(addr);
     unsigned dali_bank = DALI_HR_BANK_ID_FROM_REGID(addr);
-    addr = DALI_ADDR_FROM_REGID(addr);
-    uint16_t currentGroups, diff;
+    unsigned dali_addr = DALI_ADDR_FROM_REGID(addr);
 
     switch (dali_bank) {
         case DALI_HR_BANKID_STATUS:
             // Its light level - Ignore status
-            dali_set_level(addr, value & 0xFF, dali_command_complete);
-            await_downstream_response();
-            break;
+            dali_set_level(bus, dali_addr, value & 0xFF, cb);
+            return true;
         case DALI_HR_BANKID_MINMAX:
-            dali_set_min_max_level(addr, value & 0xFF, value >> 8, dali_command_complete);
-            await_downstream_response();
-            break;
+            dali_set_min_max_level(bus, dali_addr, value & 0xFF, value >> 8, cb);
+            return true;
         case DALI_HR_BANKID_FADE:
             // Its Ext Fade Fade Time and Fade Time/Rate
-            dali_set_fade_time_rate(addr, value & 0xFF, value >> 8, dali_command_complete);
-            await_downstream_response();
-            break;
+            dali_set_fade_time_rate(bus, dali_addr, value & 0xFF, value >> 8, cb);
+            return true;
         case DALI_HR_BANKID_POWERON:
             // Its System Level and failure level
-            dali_set_power_on_level(addr, value & 0xFF, value >> 8, dali_command_complete);
-            await_downstream_response();
-            break;
+            dali_set_power_on_level(bus, dali_addr, value & 0xFF, value >> 8, cb);
+            return true;
         case DALI_HR_BANKID_GROUPS:
             // Each group must be set or removed as a separate operation. We do this as a series of operations, only completing
             // once we've done all 16.
-            groupChange.changed = get_holding_reg(DALI_GROUPS_HR_BASE + addr) ^ value;
-            if (groupChange.changed) {
-                groupChange.newGroups = value;
-                groupChange.nextGroupId = 0;
-                groupChange.addr = addr;
-
-                dali_group_change_step(0);
-                await_downstream_response();
+            groupChange.changed = get_holding_reg(addr) ^ value;
+            if (!groupChange.changed) {
+                return false;
             }
-            break;
+            groupChange.newGroups = value;
+            groupChange.nextGroupId = 0;
+            groupChange.bus = bus;
+            groupChange.addr = dali_addr;
+            groupChange.gen = bus_op_gen;
+            groupChange.done = cb;
+            dali_group_change_step(0);
+            return true;
         default:
-            set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
-            break;
+            return false;
+    }
+}
+
+void set_holding_register_action(modbus_txn_t *txn, int addr, uint16_t value) {
+    modbus_err_t err;
+
+    // First set of values are Button Bindings
+    if (addr < MAX_DISCRETE_INPUTS) {
+        set_and_persist_binding(addr, value);
+        return;
+    }
+
+    if (addr >= CONFIG_HR_BASE) {
+        err = set_config_register(addr, value);
+        if (err) {
+            set_response_to_error(txn, err);
+        }
+        return;
+    }
+
+    await_downstream_response(txn);
+    if (!start_dali_register_write(addr, value, dali_command_complete)) {
+        sem_release(&downstream_response_ready);
+    }
+}
+
+// Finishes a Write Multiple Registers, successfully or with the exception for the register that failed: from the DALI
+// result res if it was a DALI register, or err if it was a configuration register.
+static void write_registers_done(unsigned failed_at, int res, modbus_err_t err) {
+    set_holding_reg(CONFIG_HR_WRITE_FAILED_AT, failed_at);
+    if (failed_at != 0xFFFF) {
+        if (err) {
+            set_bus_response_to_error(err);
+        } else {
+            daliCommandSucceeded(res, true);
+        }
+    }
+    sem_release(&downstream_response_ready);
+}
+
+// Called as each DALI step of a Write Multiple Registers finishes, to start the next.  The configuration registers,
+// which follow the DALI banks, are written once all of the DALI ones have gone in.
+static void write_registers_step(int res) {
+    write_registers_t *w = &writeRegisters;
+
+    bus_txn_step_done();
+    if (bus_op_abandoned(w->gen)) {
+        res = DALI_TIMEOUT;
+    }
+    if (!dali_result_ok(res, true)) {
+        write_registers_done(w->in_flight, res, 0);
+        return;
+    }
+    while (w->next < w->dali_end) {
+        unsigned addr = w->next;
+        uint16_t value = w->values[addr - w->first];
+
+        w->in_flight = addr;
+        if (DALI_HR_BANK_ID_FROM_REGID(addr) == DALI_HR_BANKID_STATUS) {
+            // Lights next to each other being set to the same level are set together, so that they can share group or
+            // broadcast frames.
+            unsigned bus = DALI_BUS_FROM_REGID(addr);
+            dali_light_mask_t lights = 0;
+            do {
+                lights |= (dali_light_mask_t)1 << DALI_ADDR_FROM_REGID(w->next);
+                w->next++;
+            } while (w->next < w->dali_end && DALI_HR_BANK_ID_FROM_REGID(w->next) == DALI_HR_BANKID_STATUS &&
+                     DALI_BUS_FROM_REGID(w->next) == bus && (w->values[w->next - w->first] & 0xFF) == (value & 0xFF));
+            dali_set_level_many(bus, lights, value & 0xFF, write_registers_step);
+            return;
+        }
+        w->next++;
+        if (start_dali_register_write(addr, value, write_registers_step)) {
+            return;
+        }
+    }
+    for (; w->next < w->end; w->next++) {
+        modbus_err_t err = set_config_register(w->next, w->values[w->next - w->first]);
+        if (err) {
+            write_registers_done(w->next, 0, err);
+            return;
+        }
     }
+    write_registers_done(0xFFFF, 0, 0);
 }
 
-void modbus_write_holding_register(uint8_t device, uint8_t cmd, uint16_t addr, uint16_t value) {
+/**
+ * Writes a run of holding registers.  Bindings are all set and then written to flash once, DALI registers are sent as
+ * one chain of commands, and then configuration registers are applied.  It stops at the first register that can't be
+ * written, which is answered with an exception and recorded in CONFIG_HR_WRITE_FAILED_AT.
+ */
+static void modbus_write_registers(modbus_txn_t *txn, uint16_t addr, const uint8_t *data, uint16_t num_regs) {
+    write_registers_t *w = &writeRegisters;
+    bool bindings_changed = false;
+
+    if (num_regs == 0 || num_regs > MAX_WRITE_REGISTERS || addr + num_regs > MAX_HOLDING_REGISTERS) {
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        return;
+    }
+    *txn->response++ = addr >> 8;
+    *txn->response++ = addr & 0xFF;
+    *txn->response++ = num_regs >> 8;
+    *txn->response++ = num_regs & 0xFF;
+
+    w->first = addr;
+    w->gen = bus_op_gen;
+    w->end = addr + num_regs;
+    w->dali_end = MAX(addr, MIN(w->end, CONFIG_HR_BASE));
+    for (unsigned i = 0; i < num_regs; i++) {
+        // The values come big endian, and aren't word aligned.
+        w->values[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+    }
+
+    // Bindings first, so that the flash is only written once, and only if something changed.
+    for (w->next = addr; w->next < w->end && w->next < MAX_DISCRETE_INPUTS; w->next++) {
+        uint16_t value = w->values[w->next - addr];
+        if (get_holding_reg(BINDINGS_HR_BASE + w->next) != value) {
+            set_holding_reg(BINDINGS_HR_BASE + w->next, value);
+            bindings_changed = true;
+        }
+    }
+    if (bindings_changed) {
+        persist_bindings();
+    }
+
+    await_downstream_response(txn);
+    write_registers_step(0);
+}
+
+void modbus_write_holding_register(modbus_txn_t *txn, uint16_t addr, uint16_t value) {
     if (addr >= MAX_HOLDING_REGISTERS) {
-        set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
         return;
     }
 
     // Response is just a reflection of the input
-    *response++ = addr >> 8;
-    *response++ = addr & 0xFF;
-    *response++ = value >> 8;
-    *response++ = value & 0xFF;
+    *txn->response++ = addr >> 8;
+    *txn->response++ = addr & 0xFF;
+    *txn->response++ = value >> 8;
+    *txn->response++ = value & 0xFF;
 
     // We do the action after setting the response, so that it can set an error code if it wants.
-    set_holding_register_action(addr, value);
+    set_holding_register_action(txn, addr, value);
 }
 
-void read_modbus_bits(uint8_t device, modbus_cmd_t cmd, uint16_t addr, uint16_t count) {
+void read_modbus_bits(modbus_txn_t *txn, modbus_cmd_t cmd, uint16_t addr, uint16_t count) {
     if (addr + count > MAX_COILS || addr % 8 != 0 || count % 8 != 0) {
-        set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
         return;
     }
     unsigned numBytes = count / 8;
     // Copy Coil values from regs into the output.
-    *response++ = numBytes;
+    *txn->response++ = numBytes;
     if (cmd == MODBUS_CMD_READ_COILS) {
-        copy_coil_values(response, addr, count);
+        copy_coil_values(txn->response, addr, count);
     } else {
-        copy_discrete_inputs(response, addr, count);
+        copy_discrete_inputs(txn->response, addr, count);
     }
-    response += numBytes;
+    txn->response += numBytes;
 }
 
-void send_modbus_holding_registers(uint8_t device, uint8_t cmd, uint16_t addr, uint16_t count) {
-    binding_t binding;
-    uint16_t val;
-
+void send_modbus_holding_registers(modbus_txn_t *txn, uint16_t addr, uint16_t count) {
     if (addr + count > MAX_HOLDING_REGISTERS) {
-        set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+        set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
         return;
     }
-    *response++ = count * 2;
-    copy_holding_regs(response, addr, count);
-    response += count * 2;
+    *txn->response++ = count * 2;
+    copy_holding_regs(txn->response, addr, count);
+    txn->response += count * 2;
 }
 
-static int modbus_read_device() {
-    int v = getchar();
-    if (v >= 0) {
-        // Update the CRC - As this is the first byte in the stream, we reset the
-        // CRC first.
-        read_crc = 0xFFFF;
-        crc_update(v, &read_crc);
-    }
-    return v;
+// These read the next field of the request, which has already had its CRC checked.  They return -1 if the frame ends
+// first.
+static int modbus_read_uint8(modbus_txn_t *txn) {
+    return txn->cmd_next < txn->cmd_end ? *txn->cmd_next++ : -1;
 }
 
-static int modbus_read_uint8() {
-    int v = getchar_timeout_us(1750);
-    if (v >= 0) {
-        // Update the CRC
-        crc_update(v, &read_crc);
-    }
-    return v;
-}
-
-static bool modbus_read_crc() {
-    int val = modbus_read_uint8();
-    if (val < 0) {
-        return -1;
-    }
-    val = modbus_read_uint8();
-    if (val < 0) {
-        return -1;
-    }
-    return read_crc == 0;
+// True if the whole request has been read, so it was the length that its function code says it should be.  (Its CRC
+// was checked when it was read.)
+static bool modbus_read_end(modbus_txn_t *txn) {
+    return txn->cmd_next == txn->cmd_end;
 }
 
-static int modbus_read_uint16() {
-    int high = modbus_read_uint8();
+static int modbus_read_uint16(modbus_txn_t *txn) {
+    int high = modbus_read_uint8(txn);
     if (high < 0) {
         return -1;
     }
-    int low = modbus_read_uint8();
+    int low = modbus_read_uint8(txn);
     if (low < 0) {
         return -1;
     };
     return high << 8 | low;
 }
 
-static int modbus_read_bytestr(uint8_t *out) {
-    int num_bytes = modbus_read_uint8();
+static int modbus_read_bytestr(modbus_txn_t *txn, uint8_t *out) {
+    int num_bytes = modbus_read_uint8(txn);
     if (num_bytes < 0) {
         return -1;
     }
     int val;
     for (int i = 0; i < num_bytes; i++) {
-        val = modbus_read_uint8();
+        val = modbus_read_uint8(txn);
         if (val < 0) {
             return val;
         }
@@ -303,6 +650,73 @@ static int modbus_read_bytestr(uint8_t *out) {
     return num_bytes;
 }
 
+/**
+ * Answers with the register changes after since.  The response is a flags byte, the sequence number to ask from next
+ * time, a count, and then for each change its bank (the function code that reads it), address, the number of bits that
+ * it covers (for coils and discrete inputs, 1 for holding registers) and the new value.
+ *
+ * Flag bit 1 says that there were more changes than would fit.  Bit 0 says that the log has moved on since, so the
+ * individual changes have been lost.  Then, if bit 2 is set, the records are instead the ranges that changed, with
+ * their length in place of the bit count and no value, and only those need to be re-read.  Otherwise everything does.
+ */
+static void read_changes(modbus_txn_t *txn, uint32_t since) {
+    regs_change_t changes[MAX_CHANGE_RECORDS];
+    uint32_t latest;
+    uint8_t flags = 0;
+    int n = regs_changes_since(since, changes, MAX_CHANGE_RECORDS, &latest);
+    uint32_t next = since + n;
+
+    if (n < 0) {
+        regs_range_t changed[MAX_CHANGE_RECORDS];
+
+        flags |= 0x01;
+        n = regs_ranges_changed_since(since, changed, MAX_CHANGE_RECORDS, &latest);
+        if (n >= 0) {
+            flags |= 0x04;
+            for (int i = 0; i < n; i++) {
+                changes[i] = (regs_change_t){
+                    .bank = changed[i].bank, .addr = changed[i].addr, .count = changed[i].count, .value = 0};
+            }
+        } else {
+            n = 0;
+        }
+        next = latest;
+    } else if (next != latest) {
+        flags |= 0x02;
+    }
+    *txn->response++ = flags;
+    *txn->response++ = next >> 24;
+    *txn->response++ = next >> 16;
+    *txn->response++ = next >> 8;
+    *txn->response++ = next;
+    *txn->response++ = n;
+    for (int i = 0; i < n; i++) {
+        *txn->response++ = changes[i].bank;
+        *txn->response++ = changes[i].addr >> 8;
+        *txn->response++ = changes[i].addr;
+        *txn->response++ = changes[i].count;
+        *txn->response++ = changes[i].value >> 8;
+        *txn->response++ = changes[i].value;
+    }
+}
+
+// Holds a read of the change log for up to wait * CHANGE_WAIT_UNIT_MS.  Returns false if too many already are.
+static bool hold_change_read(modbus_txn_t *txn, uint32_t since, unsigned wait) {
+    for (int i = 0; i < MAX_CHANGE_WAITERS; i++) {
+        change_waiter_t *w = &change_waiters[i];
+        if (!w->active) {
+            w->active = true;
+            w->unit = txn->cmd_bytes[0];
+            w->since = since;
+            w->until = make_timeout_time_ms(wait * CHANGE_WAIT_UNIT_MS);
+            w->origin = txn->origin;
+            num_change_waiters++;
+            return true;
+        }
+    }
+    return false;
+}
+
 static bool start_process(int process_type) {
     switch (process_type) {
         case 0:
@@ -313,109 +727,227 @@ static bool start_process(int process_type) {
     }
 }
 
-static void modbus_run_cmd() {
+// Returns how long the RTU frame at the start of buf is, or 0 if we can't tell yet.  -1 if it can never be a frame that
+// we understand.
+static int modbus_frame_length(const uint8_t *buf, size_t sz) {
+    if (sz < 2) {
+        return 0;
+    }
+    switch (buf[1]) {
+        case MODBUS_CMD_READ_COILS:
+        case MODBUS_CMD_READ_DISCRETE_INPUTS:
+        case MODBUS_CMD_READ_HOLDING_REGISTERS:
+        case MODBUS_CMD_READ_INPUT_REGISTERS:
+        case MODBUS_CMD_WRITE_SINGLE_COIL:
+        case MODBUS_CMD_WRITE_SINGLE_REGISTER:
+            return 8;
+        case MODBUS_CMD_WRITE_MULTIPLE_COILS:
+        case MODBUS_CMD_WRITE_MULTIPLE_REGISTERS:
+            // Address, count and then a byte count for the values that follow.
+            return sz < 7 ? 0 : 9 + buf[6];
+        case MODBUS_CMD_CUSTOM_EXEC_DALI:
+            return 7;
+        case MODBUS_CMD_CUSTOM_START_PROCESS:
+            return 5;
+        case MODBUS_CMD_CUSTOM_READ_CHANGES:
+            return 9;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Waits until there is a whole request with a good CRC at the start of rx_buf, reading from USB as much as is there at
+ * a time.  Anything that isn't a good frame is thrown away, along with everything after it that has already arrived,
+ * as there's no way of finding where the next frame starts.  Returns the frame's length, or 0 if there wasn't one by
+ * until.
+ */
+static size_t modbus_read_frame(absolute_time_t until) {
+    // Whatever was left over when the last frame was taken out (the start of another that came along with it) gets as
+    // long as a frame that has just started arriving would, rather than waiting for more to come.
+    if (rx_len && is_at_the_end_of_time(partial_until)) {
+        partial_until = make_timeout_time_us(PARTIAL_FRAME_TIMEOUT_US);
+    }
+
+    while (true) {
+        int len = modbus_frame_length(rx_buf, rx_len);
+        if (len < 0 || len > MODBUS_SERVER_READ_MAX_PACKET_SZ) {
+            rx_len = 0;
+        } else if (len > 0 && rx_len >= len) {
+            uint16_t crc = 0xFFFF;
+            for (int i = 0; i < len; i++) {
+                crc_update(rx_buf[i], &crc);
+            }
+            if (crc == 0) {
+                partial_until = at_the_end_of_time;
+                return len;
+            }
+            rx_len = 0;
+        }
+
+        absolute_time_t wait_until = absolute_time_min(until, partial_until);
+        int got = stdio_get_until((char *)rx_buf + rx_len, sizeof(rx_buf) - rx_len, wait_until);
+        if (got > 0) {
+            rx_len += got;
+            partial_until = make_timeout_time_us(PARTIAL_FRAME_TIMEOUT_US);
+        } else if (rx_len && time_reached(partial_until)) {
+            // Timed out part way through a frame.
+            rx_len = 0;
+            partial_until = at_the_end_of_time;
+        } else if (time_reached(until)) {
+            return 0;
+        }
+    }
+}
+
+// Copies a request (from the unit id to the end of its data) into txn, to be handled there.
+static void modbus_take_request(modbus_txn_t *txn, const uint8_t *req, size_t sz, const modbus_origin_t *origin) {
+    memcpy(txn->cmd_bytes, req, sz);
+    txn->cmd_next = txn->cmd_bytes;
+    txn->cmd_end = txn->cmd_bytes + sz;
+    txn->waiting = false;
+    txn->origin = *origin;
+}
+
+// Writes txn's response back to wherever its request came from, in a single write.  Over USB it gets a CRC.
+static void modbus_send_response(modbus_txn_t *txn) {
+    size_t sz = txn->response - txn->res_bytes;
+    uint16_t crc = 0xFFFF;
+
+    if (sz <= 2) {
+        return;
+    }
+    if (txn->origin.socket != MODBUS_ORIGIN_USB) {
+        modbus_tcp_send_response(&txn->origin, txn->res_bytes, sz);
+        return;
+    }
+    for (size_t i = 0; i < sz; i++) {
+        crc_update(txn->res_bytes[i], &crc);
+    }
+    txn->res_bytes[sz++] = crc;
+    txn->res_bytes[sz++] = crc >> 8;
+    stdio_put_string((const char *)txn->res_bytes, sz, false, false);
+}
+
+// True if the request might need a DALI or relay bus, rather than just register memory.
+static bool modbus_needs_bus(const uint8_t *frame, size_t sz) {
+    uint16_t addr = sz >= 4 ? (frame[2] << 8) | frame[3] : 0;
+
+    switch (frame[1]) {
+        case MODBUS_CMD_WRITE_SINGLE_COIL:
+        case MODBUS_CMD_WRITE_MULTIPLE_COILS:
+        case MODBUS_CMD_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_CMD_CUSTOM_EXEC_DALI:
+            return true;
+        case MODBUS_CMD_WRITE_SINGLE_REGISTER:
+            // Bindings are only persisted to flash, and configuration takes effect when the bus is next idle.
+            return addr >= DALI_HR_BASE && addr < CONFIG_HR_BASE;
+        default:
+            return false;
+    }
+}
+
+static void modbus_run_cmd(modbus_txn_t *txn) {
     int device, addr, count, value, expected_bytes, byte_count;
     int cmd_repeat;
+    uint32_t since;
     uint8_t bytes[256];
 
-    device = modbus_read_device();
-    int cmd = modbus_read_uint8();
-    if (cmd < 0) {
-        return;
-    }
+    device = modbus_read_uint8(txn);
+    int cmd = modbus_read_uint8(txn);
 
     // Reset the response. Response packets always echo back out the first two
     // bytes (although errors change the MSB of the second)
-    response = res_bytes;
-    *response++ = device;
-    *response++ = cmd;
+    txn->response = txn->res_bytes;
+    *txn->response++ = device;
+    *txn->response++ = cmd;
 
     switch (cmd) {
         case MODBUS_CMD_READ_DISCRETE_INPUTS:
         case MODBUS_CMD_READ_COILS:
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            count = modbus_read_uint16();
+            count = modbus_read_uint16(txn);
             if (count < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
-            read_modbus_bits(device, cmd, addr, count);
+            read_modbus_bits(txn, cmd, addr, count);
             break;
 
         case MODBUS_CMD_READ_INPUT_REGISTERS:
         case MODBUS_CMD_READ_HOLDING_REGISTERS:
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            count = modbus_read_uint16();
+            count = modbus_read_uint16(txn);
             if (count < 0) {
                 break;
             }
             // You can only request up to 125 values.
             if (count > 125) {
-                set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+                set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
                 return;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
 
-            send_modbus_holding_registers(device, cmd, addr, count);
+            send_modbus_holding_registers(txn, addr, count);
             break;
 
         case MODBUS_CMD_WRITE_SINGLE_COIL:
 
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            value = modbus_read_uint16();
+            value = modbus_read_uint16(txn);
             if (value < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
 
-            set_coil(device, cmd, addr, value);
+            set_coil(txn, addr, value);
             break;
 
         case MODBUS_CMD_WRITE_SINGLE_REGISTER:
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            value = modbus_read_uint16();
+            value = modbus_read_uint16(txn);
             if (value < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
 
-            modbus_write_holding_register(device, cmd, addr, value);
+            modbus_write_holding_register(txn, addr, value);
             break;
 
         case MODBUS_CMD_WRITE_MULTIPLE_COILS:
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            count = modbus_read_uint16();
+            count = modbus_read_uint16(txn);
             if (count < 0) {
                 break;
             }
-            byte_count = modbus_read_bytestr(bytes);
+            byte_count = modbus_read_bytestr(txn, bytes);
             if (byte_count < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
 
@@ -425,89 +957,234 @@ static void modbus_run_cmd() {
             }
 
             if (byte_count != expected_bytes) {
-                set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_VALUE);
+                set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_VALUE);
             } else {
-                // we don't support setting multiple coils (yet);
-                set_response_to_error(MODBUS_ERR_ILLEGAL_FUNCTION);
+                modbus_write_coils(txn, addr, count, bytes);
             }
             break;
 
         case MODBUS_CMD_WRITE_MULTIPLE_REGISTERS:
-            addr = modbus_read_uint16();
+            addr = modbus_read_uint16(txn);
             if (addr < 0) {
                 break;
             }
-            count = modbus_read_uint16();
+            count = modbus_read_uint16(txn);
             if (count < 0) {
                 break;
             }
             expected_bytes = count * 2;
-            byte_count = modbus_read_bytestr(bytes);
+            byte_count = modbus_read_bytestr(txn, bytes);
             if (byte_count < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
             if (byte_count != expected_bytes) {
-                set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_VALUE);
+                set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_VALUE);
             } else {
-                // The values will be non word aligned in the source, so we need
-                // to copy them.
-                uint16_t values[count];
-                memcpy(values, bytes, count * 2);
-                modbus_write_registers(device, cmd, addr, values, count);
+                modbus_write_registers(txn, addr, bytes, count);
             }
             break;
 
         case MODBUS_CMD_CUSTOM_EXEC_DALI:
-            value = modbus_read_uint16();
+            value = modbus_read_uint16(txn);
             if (value < 0) {
                 break;
             }
-            cmd_repeat = modbus_read_uint8();
+            cmd_repeat = modbus_read_uint8(txn);
             if (cmd_repeat < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
-            dali_exec_cmd(value, dali_custom_command_complete, cmd_repeat ? true : false);
-            await_downstream_response();
+            // The low bit asks for the command to be sent twice, and the high nibble picks the bus.
+            await_downstream_response(txn);
+            dali_exec_cmd(cmd_repeat >> 4, value, dali_custom_command_complete, cmd_repeat & 0x01 ? true : false);
             break;
 
         case MODBUS_CMD_CUSTOM_START_PROCESS:
-            value = modbus_read_uint8();
-            if (addr < 0) {
+            value = modbus_read_uint8(txn);
+            if (value < 0) {
                 break;
             }
-            if (!modbus_read_crc()) {
+            if (!modbus_read_end(txn)) {
                 break;
             }
             if (start_process(value)) {
-                *response++ = value;
+                *txn->response++ = value;
             } else {
-                set_response_to_error(MODBUS_ERR_ILLEGAL_DATA_ADDR);
+                set_response_to_error(txn, MODBUS_ERR_ILLEGAL_DATA_ADDR);
+            }
+            break;
+
+        case MODBUS_CMD_CUSTOM_READ_CHANGES:
+            value = modbus_read_uint16(txn);
+            if (value < 0) {
+                break;
+            }
+            since = (uint32_t)value << 16;
+            value = modbus_read_uint16(txn);
+            if (value < 0) {
+                break;
             }
+            since |= value;
+            // How long to wait for a change, if there hasn't been one since, in tenths of a second.
+            count = modbus_read_uint8(txn);
+            if (count < 0) {
+                break;
+            }
+            if (!modbus_read_end(txn)) {
+                break;
+            }
+            if (count && since == regs_change_seq() && hold_change_read(txn, since, count)) {
+                // Answered by modbus_answer_change_waiters(), once there's something to say.
+                break;
+            }
+            read_changes(txn, since);
+            break;
+
+        default:
+            // Only requests that didn't come over RTU get here, as we can't find the end of an RTU frame that we don't
+            // understand.
+            set_response_to_error(txn, MODBUS_ERR_ILLEGAL_FUNCTION);
             break;
     }
-    size_t sz = response - res_bytes;
-    if (sz > 2) {
-        // Send the response packet to the user.
-        response = res_bytes;
-        uint16_t crc = 0xFFFF;
-        while (sz--) {
-            stdio_putchar_raw(*response);
-            crc_update(*response++, &crc);
+}
+
+// Starts the parked requests in order, until one of them is waiting on a bus.  Those that turn out not to need to
+// wait are answered as they go.
+static void modbus_start_parked() {
+    while (!bus_txn && parked_count) {
+        modbus_txn_t *txn = &parked_txns[parked_head];
+
+        // Callbacks can come from core 0 as soon as the operation has started, so they must know where to answer.  Any
+        // release left over from an abandoned operation whose callback was lost mustn't count for this one.
+        bus_txn = txn;
+        sem_reset(&downstream_response_ready, 0);
+        modbus_run_cmd(txn);
+        if (txn->waiting) {
+            return;
         }
-        stdio_putchar_raw(crc);
-        stdio_putchar_raw(crc >> 8);
+        modbus_send_response(txn);
+        bus_txn = NULL;
+        parked_head = (parked_head + 1) % MAX_PARKED_TXNS;
+        parked_count--;
+    }
+}
+
+// Answers the parked request under way, if its bus operation has finished (or taken too long).
+static void modbus_finish_parked() {
+    modbus_txn_t *txn = bus_txn;
+
+    if (!txn) {
+        return;
+    }
+    if (sem_try_acquire(&downstream_response_ready)) {
+        if (txn != &orphan_txn) {
+            modbus_send_response(txn);
+            parked_head = (parked_head + 1) % MAX_PARKED_TXNS;
+            parked_count--;
+        }
+        bus_txn = NULL;
+        return;
+    }
+    if (bus_txn_steps != bus_txn_steps_seen) {
+        bus_txn_steps_seen = bus_txn_steps;
+        bus_txn_deadline = make_timeout_time_ms(txn == &orphan_txn ? BUS_TXN_ABANDON_MS : BUS_TXN_TIMEOUT_MS);
+    }
+    if (!time_reached(bus_txn_deadline)) {
+        return;
+    }
+    if (txn == &orphan_txn) {
+        bus_txn = NULL;
+        return;
+    }
+
+    // Give up on it.  The operation stops at its next step, and until then it answers into orphan_txn.
+    orphan_txn.cmd_bytes[0] = txn->cmd_bytes[0];
+    orphan_txn.cmd_bytes[1] = txn->cmd_bytes[1];
+    orphan_txn.response = orphan_txn.res_bytes;
+    critical_section_enter_blocking(&bus_txn_lock);
+    bus_op_gen++;
+    bus_txn = &orphan_txn;
+    critical_section_exit(&bus_txn_lock);
+    bus_txn_deadline = make_timeout_time_ms(BUS_TXN_ABANDON_MS);
+
+    set_response_to_error(txn, MODBUS_ERR_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+    modbus_send_response(txn);
+    parked_head = (parked_head + 1) % MAX_PARKED_TXNS;
+    parked_count--;
+}
+
+// Answers the held reads of the change log that now have something to report, or have waited long enough.
+static void modbus_answer_change_waiters() {
+    if (!num_change_waiters) {
+        return;
+    }
+    uint32_t seq = regs_change_seq();
+    for (int i = 0; i < MAX_CHANGE_WAITERS; i++) {
+        change_waiter_t *w = &change_waiters[i];
+        if (!w->active || (seq == w->since && !time_reached(w->until))) {
+            continue;
+        }
+        memory_txn.cmd_bytes[0] = w->unit;
+        memory_txn.cmd_bytes[1] = MODBUS_CMD_CUSTOM_READ_CHANGES;
+        memory_txn.origin = w->origin;
+        memory_txn.response = memory_txn.res_bytes;
+        *memory_txn.response++ = w->unit;
+        *memory_txn.response++ = MODBUS_CMD_CUSTOM_READ_CHANGES;
+        read_changes(&memory_txn, w->since);
+        modbus_send_response(&memory_txn);
+        w->active = false;
+        num_change_waiters--;
+    }
+}
+
+void modbus_handle_request(const uint8_t *req, size_t sz, const modbus_origin_t *origin) {
+    // Over TCP the length comes from the header, so a request of the wrong length can still be answered.
+    int len = origin->socket == MODBUS_ORIGIN_USB ? sz + 2 : modbus_frame_length(req, sz + 2);
+    if (len >= 0 && len != sz + 2) {
+        modbus_take_request(&memory_txn, req, sz, origin);
+        set_response_to_error(&memory_txn, MODBUS_ERR_ILLEGAL_DATA_VALUE);
+        modbus_send_response(&memory_txn);
+    } else if (!modbus_needs_bus(req, sz)) {
+        modbus_take_request(&memory_txn, req, sz, origin);
+        modbus_run_cmd(&memory_txn);
+        modbus_send_response(&memory_txn);
+    } else if (parked_count < MAX_PARKED_TXNS) {
+        modbus_take_request(&parked_txns[(parked_head + parked_count) % MAX_PARKED_TXNS], req, sz, origin);
+        parked_count++;
+    } else {
+        // Too many requests are already waiting on the buses.
+        modbus_take_request(&memory_txn, req, sz, origin);
+        set_response_to_error(&memory_txn, MODBUS_ERR_SLAVE_DEVICE_BUSY);
+        modbus_send_response(&memory_txn);
     }
 }
 
 void modbus_server_thread() {
     sem_init(&downstream_response_ready, 0, 1);
+    set_holding_reg(CONFIG_HR_WRITE_FAILED_AT, 0xFFFF);
+    critical_section_init(&write_coils_lock);
+    critical_section_init(&bus_txn_lock);
+    modbus_tcp_init();
     while (1) {
-        modbus_run_cmd();
+        modbus_finish_parked();
+        modbus_start_parked();
+        modbus_tcp_poll();
+        modbus_answer_change_waiters();
+
+        // While a bus operation is under way, there are sockets to look at, or reads waiting for a change, keep an eye
+        // out for those as well as for requests over USB.
+        bool poll = bus_txn || modbus_tcp_enabled() || num_change_waiters;
+        size_t frame_sz = modbus_read_frame(poll ? make_timeout_time_us(BUS_TXN_POLL_US) : at_the_end_of_time);
+        if (!frame_sz) {
+            continue;
+        }
+        modbus_handle_request(rx_buf, frame_sz - 2, &usb_origin);
+        rx_len -= frame_sz;
+        memmove(rx_buf, rx_buf + frame_sz, rx_len);
     }
 }
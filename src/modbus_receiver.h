@@ -1,7 +1,19 @@
 #ifndef _MODBUS_RECEIVER_H
 #define _MODBUS_RECEIVER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Where a request came from, so that its response (which can come after later ones) goes back the same way.
+#define MODBUS_ORIGIN_USB -1
+typedef struct {
+    int8_t socket;           // MODBUS_ORIGIN_USB, or the TCP socket that it came in on.
+    uint8_t connection;      // Which of that socket's clients sent it, so that a late answer doesn't go to the next one.
+    uint16_t transaction_id;  // From the MBAP header, to be echoed back.
+} modbus_origin_t;
 
 void modbus_server_thread();
+// Handles a request from somewhere other than USB, from its unit id to the end of its data.  Called on core 1.
+void modbus_handle_request(const uint8_t *req, size_t sz, const modbus_origin_t *origin);
 
 #endif
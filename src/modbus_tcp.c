@@ -0,0 +1,196 @@
+#include "modbus_tcp.h"
+
+#include <hardware/gpio.h>
+#include <hardware/spi.h>
+#include <pico/stdlib.h>
+#include <pico/unique_id.h>
+#include <string.h>
+
+#include "socket.h"
+#include "wizchip_conf.h"
+
+// How the W5100S is wired on the W5100S-EVB-Pico.  These overlap the second RS485 bus, so the two can't be built in
+// together.
+#define W5100S_SPI spi0
+#define W5100S_MISO_PIN 16
+#define W5100S_CS_PIN 17
+#define W5100S_SCK_PIN 18
+#define W5100S_MOSI_PIN 19
+#define W5100S_RST_PIN 20
+#define W5100S_SPI_HZ (33 * 1000 * 1000)
+
+#define MODBUS_TCP_PORT 502
+// The W5100S has four sockets, each of which listens for a client of its own.  Each gets 2KB of its buffer memory for
+// each direction.
+#define MODBUS_TCP_NUM_SOCKETS 4
+static uint8_t socket_buffer_kb[2][MODBUS_TCP_NUM_SOCKETS] = {{2, 2, 2, 2}, {2, 2, 2, 2}};
+
+// The MBAP header is the transaction id, a protocol id (always 0) and the length of what follows it, which starts with
+// the unit id.  That is followed by a PDU of up to 253 bytes.
+#define MBAP_HEADER_SZ 7
+#define MAX_ADU_SZ (MBAP_HEADER_SZ + 253)
+
+typedef struct {
+    uint8_t rx[MAX_ADU_SZ];  // What has arrived of the next request.
+    size_t rx_len;
+    uint8_t connection;  // Counts clients, so that responses to a client that has gone are dropped.
+    bool connected;
+} tcp_client_t;
+
+static tcp_client_t clients[MODBUS_TCP_NUM_SOCKETS];
+static bool enabled;
+
+static void w5100s_select() {
+    gpio_put(W5100S_CS_PIN, 0);
+}
+
+static void w5100s_deselect() {
+    gpio_put(W5100S_CS_PIN, 1);
+}
+
+static uint8_t w5100s_read_byte() {
+    uint8_t b;
+    spi_read_blocking(W5100S_SPI, 0x00, &b, 1);
+    return b;
+}
+
+static void w5100s_write_byte(uint8_t b) {
+    spi_write_blocking(W5100S_SPI, &b, 1);
+}
+
+static void w5100s_read_burst(uint8_t *buf, uint16_t len) {
+    spi_read_blocking(W5100S_SPI, 0x00, buf, len);
+}
+
+static void w5100s_write_burst(uint8_t *buf, uint16_t len) {
+    spi_write_blocking(W5100S_SPI, buf, len);
+}
+
+void modbus_tcp_init() {
+    pico_unique_board_id_t id;
+
+    spi_init(W5100S_SPI, W5100S_SPI_HZ);
+    gpio_set_function(W5100S_MISO_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(W5100S_SCK_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(W5100S_MOSI_PIN, GPIO_FUNC_SPI);
+    gpio_init(W5100S_CS_PIN);
+    gpio_set_dir(W5100S_CS_PIN, GPIO_OUT);
+    gpio_put(W5100S_CS_PIN, 1);
+
+    gpio_init(W5100S_RST_PIN);
+    gpio_set_dir(W5100S_RST_PIN, GPIO_OUT);
+    gpio_put(W5100S_RST_PIN, 0);
+    sleep_ms(2);
+    gpio_put(W5100S_RST_PIN, 1);
+    sleep_ms(10);
+
+    reg_wizchip_cs_cbfunc(w5100s_select, w5100s_deselect);
+    reg_wizchip_spi_cbfunc(w5100s_read_byte, w5100s_write_byte);
+    reg_wizchip_spiburst_cbfunc(w5100s_read_burst, w5100s_write_burst);
+    if (ctlwizchip(CW_INIT_WIZCHIP, socket_buffer_kb) < 0) {
+        // Carry on with USB alone.
+        return;
+    }
+
+    // A locally administered MAC, made from the flash chip's unique id.
+    pico_get_unique_board_id(&id);
+    wiz_NetInfo net = {.mac = {0x02, id.id[3], id.id[4], id.id[5], id.id[6], id.id[7]},
+                       .ip = {MODBUS_TCP_IP},
+                       .sn = {MODBUS_TCP_NETMASK},
+                       .gw = {MODBUS_TCP_GATEWAY},
+                       .dhcp = NETINFO_STATIC};
+    wizchip_setnetinfo(&net);
+    enabled = true;
+}
+
+bool modbus_tcp_enabled() {
+    return enabled;
+}
+
+// Reads whatever a client has sent, handling each request as soon as the whole of it is there.
+static void receive(uint8_t sn, tcp_client_t *client) {
+    uint16_t avail = getSn_RX_RSR(sn);
+
+    while (avail) {
+        // Only what is already there is asked for, so this doesn't block.
+        int32_t got = recv(sn, client->rx + client->rx_len, MIN(avail, sizeof(client->rx) - client->rx_len));
+        if (got <= 0) {
+            return;
+        }
+        client->rx_len += got;
+        avail -= got;
+
+        while (client->rx_len >= MBAP_HEADER_SZ) {
+            const uint8_t *rx = client->rx;
+            uint16_t len = (rx[4] << 8) | rx[5];
+            size_t adu_sz = MBAP_HEADER_SZ - 1 + len;
+
+            if (rx[2] || rx[3] || len < 2 || adu_sz > MAX_ADU_SZ) {
+                // It isn't talking Modbus, and we can't tell where its next request would start.
+                disconnect(sn);
+                client->connected = false;
+                return;
+            }
+            if (client->rx_len < adu_sz) {
+                break;
+            }
+            modbus_origin_t origin = {.socket = sn, .connection = client->connection, .transaction_id = (rx[0] << 8) | rx[1]};
+            modbus_handle_request(rx + MBAP_HEADER_SZ - 1, len, &origin);
+            client->rx_len -= adu_sz;
+            memmove(client->rx, client->rx + adu_sz, client->rx_len);
+        }
+    }
+}
+
+void modbus_tcp_poll() {
+    if (!enabled) {
+        return;
+    }
+    for (uint8_t sn = 0; sn < MODBUS_TCP_NUM_SOCKETS; sn++) {
+        tcp_client_t *client = &clients[sn];
+
+        switch (getSn_SR(sn)) {
+            case SOCK_ESTABLISHED:
+                if (!client->connected) {
+                    client->connected = true;
+                    client->connection++;
+                    client->rx_len = 0;
+                }
+                receive(sn, client);
+                break;
+            case SOCK_CLOSE_WAIT:
+                // The client has closed its end, and answers to anything that it is still waiting for are dropped.
+                client->connected = false;
+                disconnect(sn);
+                break;
+            case SOCK_CLOSED:
+                client->connected = false;
+                socket(sn, Sn_MR_TCP, MODBUS_TCP_PORT, 0);
+                break;
+            case SOCK_INIT:
+                listen(sn);
+                break;
+            default:
+                // Listening, or part way through opening or closing a connection.
+                break;
+        }
+    }
+}
+
+void modbus_tcp_send_response(const modbus_origin_t *origin, const uint8_t *res, size_t sz) {
+    tcp_client_t *client = &clients[origin->socket];
+    uint8_t adu[MAX_ADU_SZ];
+
+    if (!client->connected || client->connection != origin->connection || sz > MAX_ADU_SZ - MBAP_HEADER_SZ + 1) {
+        return;
+    }
+    adu[0] = origin->transaction_id >> 8;
+    adu[1] = origin->transaction_id;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = sz >> 8;
+    adu[5] = sz;
+    memcpy(adu + MBAP_HEADER_SZ - 1, res, sz);
+    // Blocks until the last response on this socket has gone, which on a LAN is no time at all.
+    send(origin->socket, adu, MBAP_HEADER_SZ - 1 + sz);
+}
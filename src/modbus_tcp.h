@@ -0,0 +1,32 @@
+#ifndef _MODBUS_TCP_H
+#define _MODBUS_TCP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modbus_receiver.h"
+
+// Modbus TCP, on port 502 of a W5100S, is built in with -DMODBUS_TCP=ON.  It serves the same registers, through the
+// same handlers, as RTU over USB.  All of these are called from the server thread on core 1.
+#ifdef MODBUS_TCP
+void modbus_tcp_init();
+// Accepts clients, and passes each whole request that has arrived to modbus_handle_request().
+void modbus_tcp_poll();
+// False if the W5100S didn't answer when we set it up.
+bool modbus_tcp_enabled();
+// Sends res (from the unit id on) back to the client that origin names, if it is still connected.
+void modbus_tcp_send_response(const modbus_origin_t *origin, const uint8_t *res, size_t sz);
+#else
+static inline void modbus_tcp_init() {
+}
+static inline void modbus_tcp_poll() {
+}
+static inline bool modbus_tcp_enabled() {
+    return false;
+}
+static inline void modbus_tcp_send_response(const modbus_origin_t *origin, const uint8_t *res, size_t sz) {
+}
+#endif
+
+#endif
@@ -1,13 +1,14 @@
 #include "regs.h"
 
-#include <pico/mutex.h>
+#include <hardware/sync.h>
+#include <pico/critical_section.h>
+#include <pico/platform.h>
 #include <string.h>
 #include "modbus.h"
 
 extern uint8_t coils[MAX_COILS / 8];
 extern uint8_t discrete_input[MAX_COILS / 8];
 extern uint8_t holding_registers[MAX_HOLDING_REGISTERS * 2];
-auto_init_mutex(register_access_lock);
 
 #define LIGHT_REG_BANK_SZ (MAX_DALI_LIGHTS * 2)
 #define SWITCH_BINDINGS_SZ (MAX_DISCRETE_INPUTS * 2)
@@ -28,15 +29,186 @@ auto_init_mutex(register_access_lock);
 
 #define light_groups_ptr (light_system_failure_lvl_ptr + LIGHT_REG_BANK_SZ)
 
-static inline void lock_regs() {
-    mutex_enter_blocking(&register_access_lock);
+/*
+ * Writers (from either core) take regs_write_lock, which also covers the change log, and make their bank's sequence
+ * count odd while they are changing it.  Readers don't lock at all: they copy what they want, and copy it again if the
+ * count was odd or has moved on while they were copying.  Writes are a few instructions long, so a retry is rare, and
+ * a read never holds up the button scan or a DALI callback on the other core.  Writes disable interrupts, so a reader
+ * in an interrupt handler can't spin on a write that it has interrupted.
+ */
+static critical_section_t regs_write_lock;
+static volatile uint32_t bank_seq[REGS_BANK_HOLDING_REGISTERS + 1];
+
+static inline void write_begin(regs_bank_t bank) {
+    critical_section_enter_blocking(&regs_write_lock);
+    bank_seq[bank]++;
+    __dmb();
+}
+
+static inline void write_end(regs_bank_t bank) {
+    __dmb();
+    bank_seq[bank]++;
+    critical_section_exit(&regs_write_lock);
+}
+
+static inline uint32_t read_begin(regs_bank_t bank) {
+    uint32_t seq;
+    while ((seq = bank_seq[bank]) & 1) {
+        tight_loop_contents();
+    }
+    __dmb();
+    return seq;
+}
+
+// True if what was read since read_begin() may be torn, and has to be read again.
+static inline bool read_retry(regs_bank_t bank, uint32_t seq) {
+    __dmb();
+    return bank_seq[bank] != seq;
+}
+
+void regs_init() {
+    critical_section_init(&regs_write_lock);
 }
-static inline void unlock_regs() { mutex_exit(&register_access_lock); }
 
 uint8_t coils[MAX_COILS / 8];
 uint8_t discrete_input[MAX_COILS / 8];
 uint8_t holding_registers[MAX_HOLDING_REGISTERS * 2];
 
+// Every change to a register's value is recorded here, so that a client can pick up what has changed rather than
+// re-reading everything.  Record n is at n % REGS_CHANGE_LOG_SZ, so only the latest REGS_CHANGE_LOG_SZ are kept.
+static regs_change_t change_log[REGS_CHANGE_LOG_SZ];
+static uint32_t change_seq;  // The last record written.
+
+// Each bank is also split into ranges of REGS_RANGE_SZ registers (or bits), each of which remembers the sequence number
+// of its last change.  So what has changed since any point can still be found once the log has moved on, for any
+// number of clients, each with their own idea of when they last looked.
+#define NUM_RANGES(sz) (((sz) + REGS_RANGE_SZ - 1) / REGS_RANGE_SZ)
+static uint32_t coil_versions[NUM_RANGES(MAX_COILS)];
+static uint32_t discrete_input_versions[NUM_RANGES(MAX_DISCRETE_INPUTS)];
+static uint32_t holding_reg_versions[NUM_RANGES(MAX_HOLDING_REGISTERS)];
+
+static const struct {
+    uint32_t *versions;
+    unsigned num;  // Ranges in the bank
+    unsigned sz;   // Registers in the bank
+} ranges[] = {
+    [REGS_BANK_COILS] = {coil_versions, NUM_RANGES(MAX_COILS), MAX_COILS},
+    [REGS_BANK_DISCRETE_INPUTS] = {discrete_input_versions, NUM_RANGES(MAX_DISCRETE_INPUTS), MAX_DISCRETE_INPUTS},
+    [REGS_BANK_HOLDING_REGISTERS] = {holding_reg_versions, NUM_RANGES(MAX_HOLDING_REGISTERS), MAX_HOLDING_REGISTERS},
+};
+
+// Called from inside a write.
+static inline void log_change(regs_bank_t bank, unsigned addr, unsigned count, unsigned value) {
+    regs_change_t *rec = &change_log[++change_seq % REGS_CHANGE_LOG_SZ];
+    rec->seq = change_seq;
+    rec->bank = bank;
+    rec->addr = addr;
+    rec->count = count;
+    rec->value = value;
+    // A run of bits can straddle two ranges.
+    ranges[bank].versions[addr / REGS_RANGE_SZ] = change_seq;
+    ranges[bank].versions[(addr + count - 1) / REGS_RANGE_SZ] = change_seq;
+}
+
+int regs_ranges_changed_since(uint32_t since, regs_range_t *out, size_t max, uint32_t *latest) {
+    int n = 0;
+
+    critical_section_enter_blocking(&regs_write_lock);
+    *latest = change_seq;
+    if (since > change_seq) {
+        // From before a reboot.
+        critical_section_exit(&regs_write_lock);
+        return -1;
+    }
+    for (regs_bank_t bank = REGS_BANK_COILS; bank <= REGS_BANK_HOLDING_REGISTERS; bank++) {
+        for (unsigned i = 0; i < ranges[bank].num; i++) {
+            if (ranges[bank].versions[i] <= since) {
+                continue;
+            }
+            if (n == max) {
+                critical_section_exit(&regs_write_lock);
+                return -1;
+            }
+            out[n].bank = bank;
+            out[n].addr = i * REGS_RANGE_SZ;
+            out[n].count = MIN(REGS_RANGE_SZ, ranges[bank].sz - out[n].addr);
+            n++;
+        }
+    }
+    critical_section_exit(&regs_write_lock);
+    return n;
+}
+
+// Writes a byte of register memory, returning whether that changed it.  Called from inside a write.
+static inline bool update_byte(uint8_t *ptr, uint8_t value) {
+    if (*ptr == value) {
+        return false;
+    }
+    *ptr = value;
+    return true;
+}
+
+// Records the whole of a holding register, once part of it has changed.  Called from inside a write.
+static inline void log_holding_reg_change(unsigned addr) {
+    log_change(REGS_BANK_HOLDING_REGISTERS, addr, 1, (holding_registers[addr * 2] << 8) | holding_registers[addr * 2 + 1]);
+}
+
+uint32_t regs_change_seq() {
+    // A single word, so it can't be torn.
+    return *(volatile uint32_t *)&change_seq;
+}
+
+int regs_changes_since(uint32_t since, regs_change_t *out, size_t max, uint32_t *latest) {
+    int n = 0;
+
+    critical_section_enter_blocking(&regs_write_lock);
+    *latest = change_seq;
+    if (since > change_seq || change_seq - since > REGS_CHANGE_LOG_SZ) {
+        // From before a reboot, or so long ago that the records have been overwritten.
+        critical_section_exit(&regs_write_lock);
+        return -1;
+    }
+    for (uint32_t seq = since + 1; seq <= change_seq && n < max; seq++) {
+        out[n++] = change_log[seq % REGS_CHANGE_LOG_SZ];
+    }
+    critical_section_exit(&regs_write_lock);
+    return n;
+}
+
+/**
+ * Sets the bits in mask (bit n being base + n) to the matching bit of values, in a single write.  The changes are
+ * logged as one record for each run of up to 16 bits, rather than one per bit.  Returns the bits that changed.
+ */
+static uint32_t update_bits(regs_bank_t bank, uint8_t *bits, unsigned base, uint32_t mask, uint32_t values) {
+    uint32_t changed = 0;
+    uint32_t now = 0;
+
+    write_begin(bank);
+    for (unsigned i = 0; i < 32; i++) {
+        uint8_t *ptr = bits + (base + i) / 8;
+        uint8_t bit = 1 << ((base + i) % 8);
+
+        if (mask & (1u << i)) {
+            if (update_byte(ptr, (values & (1u << i)) ? (*ptr | bit) : (*ptr & ~bit))) {
+                changed |= 1u << i;
+            }
+        }
+        if (*ptr & bit) {
+            now |= 1u << i;
+        }
+    }
+    for (uint32_t left = changed; left;) {
+        unsigned first = __builtin_ctz(left);
+        uint32_t window = (left >> first) & 0xFFFF;
+        unsigned count = 32 - __builtin_clz(window);
+
+        log_change(bank, base + first, count, (now >> first) & ((1u << count) - 1));
+        left &= ~(window << first);
+    }
+    write_end(bank);
+    return changed;
+}
+
 // -- Discrete Inputs
 
 void set_discrete_input(int addr) {
@@ -44,9 +216,11 @@ void set_discrete_input(int addr) {
         return;
     }
     uint8_t *reg_ptr = discrete_input + addr / 8;
-    lock_regs();
-    *reg_ptr |= 1 << (addr % 8);
-    unlock_regs();
+    write_begin(REGS_BANK_DISCRETE_INPUTS);
+    if (update_byte(reg_ptr, *reg_ptr | (1 << (addr % 8)))) {
+        log_change(REGS_BANK_DISCRETE_INPUTS, addr, 1, 1);
+    }
+    write_end(REGS_BANK_DISCRETE_INPUTS);
 }
 
 void clear_discrete_input(int addr) {
@@ -54,18 +228,29 @@ void clear_discrete_input(int addr) {
         return;
     }
     uint8_t *reg_ptr = discrete_input + addr / 8;
-    lock_regs();
-    *reg_ptr &= ~(1 << (addr % 8));
-    unlock_regs();
+    write_begin(REGS_BANK_DISCRETE_INPUTS);
+    if (update_byte(reg_ptr, *reg_ptr & ~(1 << (addr % 8)))) {
+        log_change(REGS_BANK_DISCRETE_INPUTS, addr, 1, 0);
+    }
+    write_end(REGS_BANK_DISCRETE_INPUTS);
+}
+
+uint32_t update_discrete_inputs(unsigned base, uint32_t mask, uint32_t values) {
+    if (base + 32 > MAX_DISCRETE_INPUTS) {
+        return 0;
+    }
+    return update_bits(REGS_BANK_DISCRETE_INPUTS, discrete_input, base, mask, values);
 }
 
 void copy_discrete_inputs(uint8_t *out, unsigned addr, size_t num) {
-    if (addr + num >= MAX_DISCRETE_INPUTS) {
+    if (addr + num > MAX_DISCRETE_INPUTS) {
         return;
     }
-    lock_regs();
-    memcpy(out, discrete_input + (addr / 8), num / 8);
-    unlock_regs();
+    uint32_t seq;
+    do {
+        seq = read_begin(REGS_BANK_DISCRETE_INPUTS);
+        memcpy(out, discrete_input + (addr / 8), num / 8);
+    } while (read_retry(REGS_BANK_DISCRETE_INPUTS, seq));
 }
 
 // -- Coils
@@ -77,9 +262,11 @@ void set_coil_reg(int addr) {
 
     uint8_t *reg_ptr = coils + (addr / 8);
     uint8_t val = 1 << (addr % 8);
-    lock_regs();
-    *reg_ptr |= val;
-    unlock_regs();
+    write_begin(REGS_BANK_COILS);
+    if (update_byte(reg_ptr, *reg_ptr | val)) {
+        log_change(REGS_BANK_COILS, addr, 1, 1);
+    }
+    write_end(REGS_BANK_COILS);
 }
 
 void clear_coil_reg(int addr) {
@@ -89,9 +276,11 @@ void clear_coil_reg(int addr) {
 
     uint8_t *reg_ptr = coils + (addr / 8);
     uint8_t val = ~(1 << (addr % 8));
-    lock_regs();
-    *reg_ptr &= val;
-    unlock_regs();
+    write_begin(REGS_BANK_COILS);
+    if (update_byte(reg_ptr, *reg_ptr & val)) {
+        log_change(REGS_BANK_COILS, addr, 1, 0);
+    }
+    write_end(REGS_BANK_COILS);
 }
 
 void toggle_coil_reg(int addr) {
@@ -101,9 +290,17 @@ void toggle_coil_reg(int addr) {
 
     uint8_t *reg_ptr = coils + (addr / 8);
     uint8_t val = 1 << (addr % 8);
-    lock_regs();
+    write_begin(REGS_BANK_COILS);
     *reg_ptr ^= val;
-    unlock_regs();
+    log_change(REGS_BANK_COILS, addr, 1, (*reg_ptr & val) != 0);
+    write_end(REGS_BANK_COILS);
+}
+
+uint32_t update_coil_regs(unsigned base, uint32_t mask, uint32_t values) {
+    if (base + 32 > MAX_COILS) {
+        return 0;
+    }
+    return update_bits(REGS_BANK_COILS, coils, base, mask, values);
 }
 
 bool is_coil_set(unsigned coil) {
@@ -111,41 +308,88 @@ bool is_coil_set(unsigned coil) {
         return false;
     }
 
-    lock_regs();
-    bool val = coils[coil / 8] & (1 << (coil % 8));
-    unlock_regs();
+    bool val;
+    uint32_t seq;
+    do {
+        seq = read_begin(REGS_BANK_COILS);
+        val = coils[coil / 8] & (1 << (coil % 8));
+    } while (read_retry(REGS_BANK_COILS, seq));
     return val;
 }
 
 void copy_coil_values(uint8_t *out, unsigned addr, size_t num) {
-    if (addr + num >= MAX_COILS) {
+    if (addr + num > MAX_COILS) {
         return;
     }
-    lock_regs();
-    memcpy(out, coils + addr / 8, num / 8);
-    unlock_regs();
+    uint32_t seq;
+    do {
+        seq = read_begin(REGS_BANK_COILS);
+        memcpy(out, coils + addr / 8, num / 8);
+    } while (read_retry(REGS_BANK_COILS, seq));
 }
 
 // -- Holding registers
 
 void copy_holding_regs(uint8_t *out, unsigned addr, size_t num) {
-    if (addr + num >= MAX_HOLDING_REGISTERS) {
+    if (addr + num > MAX_HOLDING_REGISTERS) {
         return;
     }
-    lock_regs();
-    memcpy(out, holding_registers + addr * 2, num * 2);
-    unlock_regs();
+    uint32_t seq;
+    do {
+        seq = read_begin(REGS_BANK_HOLDING_REGISTERS);
+        memcpy(out, holding_registers + addr * 2, num * 2);
+    } while (read_retry(REGS_BANK_HOLDING_REGISTERS, seq));
+}
+
+// Called from inside a write.
+static inline void update_holding_reg(unsigned addr, unsigned value) {
+    uint8_t *reg_ptr = holding_registers + addr * 2;
+    bool changed = update_byte(reg_ptr, value >> 8);
+    changed |= update_byte(reg_ptr + 1, value);
+    if (changed) {
+        log_holding_reg_change(addr);
+    }
 }
 
 void set_holding_reg(unsigned addr, unsigned value) {
     if (addr >= MAX_HOLDING_REGISTERS) {
         return;
     }
-    uint8_t *reg_ptr = holding_registers + addr * 2;
-    lock_regs();
-    *reg_ptr++ = value >> 8;
-    *reg_ptr++ = value;
-    unlock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    update_holding_reg(addr, value);
+    write_end(REGS_BANK_HOLDING_REGISTERS);
+}
+
+void set_holding_regs(unsigned addr, const uint16_t *values, size_t num) {
+    if (addr + num > MAX_HOLDING_REGISTERS) {
+        return;
+    }
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    for (size_t i = 0; i < num; i++) {
+        update_holding_reg(addr + i, values[i]);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
+}
+
+void fill_holding_regs(unsigned addr, unsigned value, size_t num) {
+    if (addr + num > MAX_HOLDING_REGISTERS) {
+        return;
+    }
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    for (size_t i = 0; i < num; i++) {
+        update_holding_reg(addr + i, value);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
+}
+
+void set_holding_reg_list(const regs_hr_write_t *writes, size_t num) {
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    for (size_t i = 0; i < num; i++) {
+        if (writes[i].addr < MAX_HOLDING_REGISTERS) {
+            update_holding_reg(writes[i].addr, writes[i].value);
+        }
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
 
 void set_holding_reg_byte(unsigned addr, unsigned byte, unsigned value) {
@@ -153,9 +397,11 @@ void set_holding_reg_byte(unsigned addr, unsigned byte, unsigned value) {
         return;
     }
     uint8_t *ptr = holding_registers + addr * 2 + 1 - byte;
-    lock_regs();
-    *ptr = value;
-    unlock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    if (update_byte(ptr, value)) {
+        log_holding_reg_change(addr);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
 
 void set_holding_reg_nibble(unsigned addr, unsigned nibble_no, unsigned value) {
@@ -165,12 +411,14 @@ void set_holding_reg_nibble(unsigned addr, unsigned nibble_no, unsigned value) {
     assert(nibble_no < 4);
     uint8_t *ptr = holding_registers + addr * 2 + 1 - (nibble_no / 2);
     unsigned shift = (nibble_no % 2) * 4;
-    unsigned mask = ~(7 << shift);
-    unsigned shiftedVal = (value & 7) << shift;
+    unsigned mask = 0x0F << shift;
+    unsigned shiftedVal = (value & 0x0F) << shift;
 
-    lock_regs();
-    *ptr = (*ptr & ~mask) | shiftedVal;
-    unlock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    if (update_byte(ptr, (*ptr & ~mask) | shiftedVal)) {
+        log_holding_reg_change(addr);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
 
 int get_holding_reg(unsigned addr) {
@@ -178,9 +426,12 @@ int get_holding_reg(unsigned addr) {
         return -1;
     }
     uint8_t *reg_ptr = holding_registers + addr * 2;
-    lock_regs();
-    int val = (*reg_ptr << 8) | *(reg_ptr + 1);
-    unlock_regs();
+    int val;
+    uint32_t seq;
+    do {
+        seq = read_begin(REGS_BANK_HOLDING_REGISTERS);
+        val = (*reg_ptr << 8) | *(reg_ptr + 1);
+    } while (read_retry(REGS_BANK_HOLDING_REGISTERS, seq));
     return val;
 }
 
@@ -189,37 +440,42 @@ void set_holding_reg_bit(int addr, int bit) {
     if (addr >= MAX_HOLDING_REGISTERS) {
         return;
     }
-    uint8_t *reg_ptr = coils + addr * 2;
+    uint8_t *reg_ptr = holding_registers + addr * 2;
     if (bit < 8) {
         reg_ptr++;
     }
-    lock_regs();
-    *reg_ptr |= 1 << (addr % 8);
-    unlock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    if (update_byte(reg_ptr, *reg_ptr | (1 << (bit % 8)))) {
+        log_holding_reg_change(addr);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
 
 void clear_holding_reg_bit(int addr, int bit) {
     if (addr >= MAX_HOLDING_REGISTERS) {
         return;
     }
-    uint8_t *reg_ptr = coils + addr * 2;
+    uint8_t *reg_ptr = holding_registers + addr * 2;
     if (bit < 8) {
         reg_ptr++;
     }
-    lock_regs();
-    *reg_ptr &= ~(1 << (bit % 8));
-    unlock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
+    if (update_byte(reg_ptr, *reg_ptr & ~(1 << (bit % 8)))) {
+        log_holding_reg_change(addr);
+    }
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
 
 void toggle_holding_reg_bit(int addr, int bit) {
     if (addr >= MAX_HOLDING_REGISTERS) {
         return;
     }
-    uint8_t *reg_ptr = coils + addr * 2;
+    uint8_t *reg_ptr = holding_registers + addr * 2;
     if (bit < 8) {
         reg_ptr++;
     }
-    lock_regs();
+    write_begin(REGS_BANK_HOLDING_REGISTERS);
     *reg_ptr ^= 1 << (bit % 8);
-    unlock_regs();
+    log_holding_reg_change(addr);
+    write_end(REGS_BANK_HOLDING_REGISTERS);
 }
@@ -10,11 +10,24 @@
 #define MAX_DALI_LIGHTS 64
 #define NUM_VALUES_PER_LIGHT 16
 
+// Number of DALI buses, each driven by its own PIO state machine.  At most 4.
+#ifndef DALI_NUM_BUSES
+#define DALI_NUM_BUSES 1
+#endif
+
+// Number of downstream RS485 buses, each driven by a pair of pio1 state machines.  At most 2.
+#ifndef MODBUS_NUM_BUSES
+#define MODBUS_NUM_BUSES 1
+#endif
+
+// DALI on/off coils follow the relay coils, 64 per bus.
+#define DALI_COIL_BASE MAX_COILS
+#define DALI_COIL(bus, addr) (DALI_COIL_BASE + (bus)*MAX_DALI_LIGHTS + (addr))
+#define MAX_DALI_COILS (DALI_NUM_BUSES * MAX_DALI_LIGHTS)
 
 #define BINDINGS_HR_BASE 0
 #define DALI_HR_BASE (BINDINGS_HR_BASE + MAX_DISCRETE_INPUTS)
 
-#define DALI_HR_BANK(bank_no) (DALI_HR_BASE + (bank_no)*MAX_DALI_LIGHTS)
 typedef enum { 
     DALI_HR_BANKID_STATUS = 0,
     DALI_HR_BANKID_MINMAX,
@@ -24,34 +37,114 @@ typedef enum {
     DALI_HR_BANKID_MAX
 } dali_hr_bankid_t;
 
-#define MAX_HOLDING_REGISTERS DALI_HR_BANK(DALI_HR_BANKID_MAX)
-
-
-#define DALI_HR_BANK_ID_FROM_REGID(addr) (((addr) - DALI_HR_BASE) / MAX_DALI_LIGHTS)
+// Each bus has a full set of banks, one bus after the other.
+#define DALI_HR_BUS_SZ (DALI_HR_BANKID_MAX * MAX_DALI_LIGHTS)
+#define DALI_HR_BANK(bus, bank_no) (DALI_HR_BASE + (bus)*DALI_HR_BUS_SZ + (bank_no)*MAX_DALI_LIGHTS)
+
+// Configuration registers follow the last DALI bus' banks: a set for each downstream modbus bus, then the map of relay
+// boards onto those buses.
+#define CONFIG_HR_BASE DALI_HR_BANK(DALI_NUM_BUSES, 0)
+
+typedef enum {
+    CONFIG_HR_MODBUS_BAUD = 0,     // Baud rate / 100, or 0 to auto-probe.
+    CONFIG_HR_MODBUS_BAUD_IN_USE,  // Read only.  What the bus is actually running at / 100.
+    CONFIG_HR_MODBUS_BUS_SZ
+} config_hr_modbus_id_t;
+
+#define CONFIG_HR_MODBUS(bus, id) (CONFIG_HR_BASE + (bus)*CONFIG_HR_MODBUS_BUS_SZ + (id))
+#define CONFIG_HR_MODBUS_BUS_FROM_REGID(addr) (((addr) - CONFIG_HR_BASE) / CONFIG_HR_MODBUS_BUS_SZ)
+#define CONFIG_HR_MODBUS_ID_FROM_REGID(addr) (((addr) - CONFIG_HR_BASE) % CONFIG_HR_MODBUS_BUS_SZ)
+// Bit n-1 is the bus that relay board n is on.
+#define CONFIG_HR_RELAY_BUS_MAP CONFIG_HR_MODBUS(MODBUS_NUM_BUSES, 0)
+// Read only.  The first register that the last Write Multiple Registers couldn't write, or 0xFFFF if it all went in.
+#define CONFIG_HR_WRITE_FAILED_AT (CONFIG_HR_RELAY_BUS_MAP + 1)
+// Read only.  How busy core 0's main loop is: the thousandths of the last measurement window that it spent asleep, and
+// how many times a second it woke up over that window.
+#define CONFIG_HR_IDLE_PERMILLE (CONFIG_HR_WRITE_FAILED_AT + 1)
+#define CONFIG_HR_WAKEUPS_PER_SEC (CONFIG_HR_IDLE_PERMILLE + 1)
+
+#define MAX_HOLDING_REGISTERS (CONFIG_HR_WAKEUPS_PER_SEC + 1)
+
+
+#define DALI_BUS_FROM_REGID(addr) (((addr) - DALI_HR_BASE) / DALI_HR_BUS_SZ)
+#define DALI_HR_BANK_ID_FROM_REGID(addr) ((((addr) - DALI_HR_BASE) % DALI_HR_BUS_SZ) / MAX_DALI_LIGHTS)
 #define DALI_ADDR_FROM_REGID(addr) (((addr) - DALI_HR_BASE) % MAX_DALI_LIGHTS)
 
-#define DALI_STATUS_HR_BASE DALI_HR_BANK(DALI_HR_BANKID_STATUS)
-#define DALI_MINMAX_HR_BASE DALI_HR_BANK(DALI_HR_BANKID_MINMAX)
-#define DALI_FADE_HR_BASE DALI_HR_BANK(DALI_HR_BANKID_FADE)
-#define DALI_POWERON_HR_BASE DALI_HR_BANK(DALI_HR_BANKID_POWERON)
-#define DALI_GROUPS_HR_BASE DALI_HR_BANK(DALI_HR_BANKID_GROUPS)
+#define DALI_STATUS_HR(bus, addr) (DALI_HR_BANK(bus, DALI_HR_BANKID_STATUS) + (addr))
+#define DALI_MINMAX_HR(bus, addr) (DALI_HR_BANK(bus, DALI_HR_BANKID_MINMAX) + (addr))
+#define DALI_FADE_HR(bus, addr) (DALI_HR_BANK(bus, DALI_HR_BANKID_FADE) + (addr))
+#define DALI_POWERON_HR(bus, addr) (DALI_HR_BANK(bus, DALI_HR_BANKID_POWERON) + (addr))
+#define DALI_GROUPS_HR(bus, addr) (DALI_HR_BANK(bus, DALI_HR_BANKID_GROUPS) + (addr))
+
+// Change log.  Each register change is given the next sequence number, starting from 1 at boot.
+typedef enum {
+    // Numbered after the function codes that read them.
+    REGS_BANK_COILS = 1,
+    REGS_BANK_DISCRETE_INPUTS = 2,
+    REGS_BANK_HOLDING_REGISTERS = 3,
+} regs_bank_t;
+
+typedef struct {
+    uint32_t seq;
+    uint16_t addr;
+    // A holding register's new value, or for coils and discrete inputs the new state of count bits from addr, the first
+    // in the least significant bit.
+    uint16_t value;
+    uint8_t count;  // Always 1 for a holding register.
+    uint8_t bank;   // A regs_bank_t
+} regs_change_t;
+
+#define REGS_CHANGE_LOG_SZ 128
+uint32_t regs_change_seq();
+// Copies up to max of the changes after since into out, oldest first, and sets latest to the last change so far.
+// Returns how many were copied, or -1 if some of the changes after since have been lost (or since is from before a
+// reboot), in which case the caller has to re-read everything.
+int regs_changes_since(uint32_t since, regs_change_t *out, size_t max, uint32_t *latest);
+
+// When the log has moved on, what has changed can still be found a range at a time.
+#define REGS_RANGE_SZ 32
+typedef struct {
+    uint16_t addr;
+    uint8_t count;
+    uint8_t bank;  // A regs_bank_t
+} regs_range_t;
+// Copies the ranges that have changed after since into out, and sets latest to the last change so far.  Returns how
+// many there were, or -1 if there were more than max (or since is from before a reboot), in which case the caller has
+// to re-read everything.
+int regs_ranges_changed_since(uint32_t since, regs_range_t *out, size_t max, uint32_t *latest);
+
+// Must be called before anything else here, and before core 1 is started.
+void regs_init();
 
 // Discrete Inputs
 void set_discrete_input(int addr);
 void clear_discrete_input(int addr);
 void copy_discrete_inputs(uint8_t *out, unsigned addr, size_t num);
+// Sets the inputs in mask (bit n being base + n) to the matching bits of values, all at once.  Returns those that
+// changed.
+uint32_t update_discrete_inputs(unsigned base, uint32_t mask, uint32_t values);
 
 // Coils
 void set_coil_reg(int addr);
 void clear_coil_reg(int addr);
 void toggle_coil_reg(int addr);
 bool is_coil_set(unsigned coil);
+// As update_discrete_inputs(), for coils.
+uint32_t update_coil_regs(unsigned base, uint32_t mask, uint32_t values);
 void copy_coil_values(uint8_t *out, unsigned addr, size_t num);
 
 // Holding Regs
 void copy_holding_regs(uint8_t *out, unsigned addr, size_t num);
 void set_holding_reg(unsigned addr, unsigned value);
 int get_holding_reg(unsigned addr);
+// Each of these makes all of its changes at once, so that a reader sees either none or all of them.
+void set_holding_regs(unsigned addr, const uint16_t *values, size_t num);
+void fill_holding_regs(unsigned addr, unsigned value, size_t num);
+typedef struct {
+    uint16_t addr;
+    uint16_t value;
+} regs_hr_write_t;
+void set_holding_reg_list(const regs_hr_write_t *writes, size_t num);
 
 void set_holding_reg_byte(unsigned addr, unsigned byte, unsigned value);
 void set_holding_reg_nibble(unsigned addr, unsigned nibble_no, unsigned value);
@@ -0,0 +1,372 @@
+/**
+ * Benchmark for the DALI driver (dali.c), run against the virtual-time bus in dali_sim.c.  Everything is timed in bus
+ * time, so the figures are those of a real 1200 baud bus with the same gears on it, while the run itself takes well
+ * under a second.  Reports how long enumeration takes, how many commands a second get through, and how long a toggle
+ * takes, both on an idle bus and during an enumeration, and fails if the lights or the register banks don't end up as
+ * the commands asked.
+ *
+ * Built once for each bus count, so that buses running side by side can be compared with one on its own.
+ */
+#include <pico/platform.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dali.h"
+#include "dali_sim.h"
+#include "modbus.h"
+#include "regs.h"
+
+#define SECONDS(s) ((uint64_t)((s) * 1000 * 1000))
+#define EVERY_FOURTH_LIGHT 0x1111111111111111ull
+#define TOGGLES 10
+// What a gear reports for min and max after a reset.
+#define DEFAULT_MINMAX 0xFE01
+
+void onError() {
+    printf("FAIL: DALI queue overflowed\n");
+    exit(1);
+}
+
+static int failures;
+
+static void check(bool ok, const char *fmt, ...) {
+    va_list args;
+
+    if (ok) {
+        return;
+    }
+    va_start(args, fmt);
+    printf("FAIL: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    failures++;
+}
+
+static void report(const char *what, double value, const char *unit) {
+    printf("%-52s %10.1f %s\n", what, value, unit);
+}
+
+// ------------------------- driving the driver in virtual time ----------------
+
+static int completed;
+static uint64_t completed_at;
+
+static void count_done(int res) {
+    completed++;
+    completed_at = dali_sim_now();
+}
+
+// Starts anything that has just been queued, then moves the clock on to the next thing that will happen and deals with
+// it.  Returns false if nothing ever will.
+static bool step() {
+    dali_poll();
+    uint64_t next = MIN(dali_sim_next_event(), dali_next_poll_time());
+    if (next == UINT64_MAX) {
+        return false;
+    }
+    dali_sim_advance_to(next);
+    dali_poll();
+    return true;
+}
+
+static void run_for(uint64_t us) {
+    uint64_t end = dali_sim_now() + us;
+
+    for (;;) {
+        dali_poll();
+        uint64_t next = MIN(dali_sim_next_event(), dali_next_poll_time());
+        if (next > end) {
+            break;
+        }
+        dali_sim_advance_to(next);
+    }
+    dali_sim_advance_to(end);
+    dali_poll();
+}
+
+// Runs until count commands have completed, and returns false if that took longer than the limit.
+static bool run_until_completed(int count, uint64_t limit_us) {
+    uint64_t limit = dali_sim_now() + limit_us;
+
+    while (completed < count && dali_sim_now() < limit) {
+        if (!step()) {
+            break;
+        }
+    }
+    return completed >= count;
+}
+
+// Runs until every bus is idle with nothing (such as a level poll) scheduled.
+static void settle() {
+    uint64_t limit = dali_sim_now() + SECONDS(300);
+
+    while (dali_sim_now() < limit && step()) {
+    }
+}
+
+static dali_stats_t stats_of(int bus) {
+    dali_stats_t stats;
+    dali_get_stats(bus, &stats);
+    return stats;
+}
+
+static uint32_t total_frames() {
+    uint32_t frames = 0;
+    for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+        frames += dali_sim_frames(bus);
+    }
+    return frames;
+}
+
+// ------------------------- benchmarks ----------------
+
+// Scans every bus, each with gears at the given addresses, and checks what the scan put in the registers.
+static void bench_enumeration(const char *name, dali_light_mask_t present, unsigned loss_permille, bool first) {
+    uint32_t before[DALI_NUM_BUSES];
+    uint32_t frames = total_frames();
+    uint64_t start = dali_sim_now();
+    bool done = false;
+
+    for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+        dali_sim_populate(bus, present);
+        before[bus] = stats_of(bus).enumeration_us;
+    }
+    dali_sim_set_reply_loss(loss_permille);
+    if (first) {
+        for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+            dali_init(bus, 0, 0);
+        }
+    } else {
+        dali_enumerate();
+    }
+    for (;;) {
+        done = true;
+        for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+            done &= stats_of(bus).enumeration_us != before[bus];
+        }
+        if (done || dali_sim_now() - start > SECONDS(300) || !step()) {
+            break;
+        }
+    }
+    check(done, "%s didn't finish", name);
+    report(name, (dali_sim_now() - start) / 1e6, "s");
+    report("  frames per bus", (double)(total_frames() - frames) / DALI_NUM_BUSES, "");
+
+    int found = 0;
+    int wrong = 0;
+    for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+        for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+            bool is_present = present & (1ull << addr);
+            int minmax = get_holding_reg(DALI_MINMAX_HR(bus, addr));
+            if (minmax == 0xFFFF) {
+                wrong += is_present;
+                continue;
+            }
+            found++;
+            if (!is_present || minmax != DEFAULT_MINMAX ||
+                get_holding_reg(DALI_GROUPS_HR(bus, addr)) != dali_sim_groups(bus, addr)) {
+                wrong++;
+            }
+        }
+    }
+    report("  gears found", found, "");
+    // A lost answer is asked for again, so noise shouldn't make any difference to what is found.
+    check(!wrong, "%s: %d gears missed or scanned wrongly", name, wrong);
+    dali_sim_set_reply_loss(0);
+    settle();
+}
+
+// Keeps a few commands queued on every bus at once, setting each light to its own level, and counts how many complete
+// each second.
+static void bench_set_level_throughput(dali_light_mask_t present) {
+    int lights = __builtin_popcountll(present);
+    int count = lights * DALI_NUM_BUSES;
+    int submitted = 0;
+    uint64_t start = dali_sim_now();
+
+    completed = 0;
+    while (completed < count && dali_sim_now() - start < SECONDS(300)) {
+        while (submitted < count && submitted - completed < 8 * DALI_NUM_BUSES) {
+            int bus = submitted % DALI_NUM_BUSES;
+            int addr = submitted / DALI_NUM_BUSES;
+            dali_set_level(bus, addr, 10 + addr * 3, count_done);
+            submitted++;
+        }
+        if (!step()) {
+            break;
+        }
+    }
+    check(completed == count, "only %d of %d level changes completed", completed, count);
+    report("set level, commands/s across all buses", completed / ((completed_at - start) / 1e6), "/s");
+
+    int wrong = 0;
+    for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+        for (int addr = 0; addr < lights; addr++) {
+            wrong += dali_sim_level(bus, addr) != 10 + addr * 3;
+        }
+    }
+    check(!wrong, "%d lights not at the level they were set to", wrong);
+    settle();
+    for (int bus = 0; bus < DALI_NUM_BUSES; bus++) {
+        for (int addr = 0; addr < lights; addr++) {
+            wrong += (get_holding_reg(DALI_STATUS_HR(bus, addr)) & 0xFF) != 10 + addr * 3;
+        }
+    }
+    check(!wrong, "%d levels not read back into the status bank", wrong);
+}
+
+/**
+ * Toggles one light a number of times, a second apart, and reports how long each took from being asked for to being
+ * done.  If during_enumeration is set, an enumeration is started first, so that the toggles have to get past it.
+ */
+static void bench_toggle_latency(const char *name, dali_toggle_mode_t mode, bool during_enumeration) {
+    const int addr = 5;
+    uint64_t total = 0;
+    uint64_t worst = 0;
+    dali_stats_t before = stats_of(0);
+    uint64_t enumeration_start = dali_sim_now();
+
+    dali_set_toggle_mode(mode);
+    if (during_enumeration) {
+        dali_enumerate();
+    }
+    for (int i = 0; i < TOGGLES; i++) {
+        bool was_on = dali_sim_level(0, addr) > 0;
+        uint64_t start = dali_sim_now();
+
+        completed = 0;
+        dali_toggle(0, addr, count_done);
+        check(run_until_completed(1, SECONDS(60)), "%s: toggle %d never completed", name, i);
+        total += completed_at - start;
+        worst = MAX(worst, completed_at - start);
+        check((dali_sim_level(0, addr) > 0) != was_on, "%s: toggle %d didn't change the light", name, i);
+        run_for(SECONDS(1));
+    }
+    dali_stats_t after = stats_of(0);
+    report(name, total / 1e3 / TOGGLES, "ms mean");
+    report("  worst", worst / 1e3, "ms");
+    report("  decided without a query", after.toggle_shadow_hits - before.toggle_shadow_hits, "toggles");
+    if (during_enumeration) {
+        while (stats_of(0).enumeration_us == before.enumeration_us && dali_sim_now() - enumeration_start < SECONDS(300)) {
+            step();
+        }
+        report("  enumeration time with the toggles", stats_of(0).enumeration_us / 1e6, "s");
+        report("  background chains preempted", after.preemptions - before.preemptions, "");
+    }
+    settle();
+}
+
+// Multi-light commands, which should use group and broadcast frames.
+static void bench_plans(dali_light_mask_t present) {
+    // Groups 0 and 1, then lights 16..19 one at a time.
+    dali_light_mask_t twenty = 0xFFFFFull & present;
+    uint32_t frames = dali_sim_frames(0);
+
+    completed = 0;
+    dali_set_level_many(0, twenty, 150, count_done);
+    check(run_until_completed(1, SECONDS(10)), "set level many never completed");
+    report("frames to set 20 lights' level", dali_sim_frames(0) - frames, "");
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        if (twenty & (1ull << addr)) {
+            check(dali_sim_level(0, addr) == 150, "light %d at %d after set level many", addr, dali_sim_level(0, addr));
+        }
+    }
+
+    frames = dali_sim_frames(0);
+    completed = 0;
+    dali_set_on_many(0, present, false, count_done);
+    check(run_until_completed(1, SECONDS(10)), "set on many never completed");
+    report("frames to turn every light off", dali_sim_frames(0) - frames, "");
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        if (present & (1ull << addr)) {
+            check(dali_sim_level(0, addr) == 0, "light %d still on after set on many", addr);
+        }
+    }
+    settle();
+
+    // Once the shadow levels are too old to trust, someone turns one of group 0's lights on at a wall switch.  Toggling
+    // the group has to find that out, and turn them all off, rather than acting on the stale levels and turning them on.
+    dali_light_mask_t group = dali_group_members(0, 0);
+    dali_stats_t before = stats_of(0);
+    run_for(SECONDS(31));
+    dali_sim_set_level(0, 3, 100);
+    frames = dali_sim_frames(0);
+    completed = 0;
+    dali_toggle_many(0, group, count_done);
+    check(run_until_completed(1, SECONDS(10)), "toggle many never completed");
+    report("frames to toggle a group with stale levels", dali_sim_frames(0) - frames, "");
+    for (dali_light_mask_t l = group; l; l &= l - 1) {
+        unsigned int addr = __builtin_ctzll(l);
+        check(dali_sim_level(0, addr) == 0, "light %d on after toggling its group, with light 3 on", addr);
+    }
+    check(stats_of(0).toggle_shadow_misses == before.toggle_shadow_misses + 1, "group toggle not counted as a miss");
+    settle();
+}
+
+/**
+ * Gives every light a 2s fade and fades them all at once, then reports how much of the bus the level polls that follow
+ * take, and checks that the status bank ends up with the final levels.
+ */
+static void bench_fade_polls(dali_light_mask_t present) {
+    const unsigned fade_time = 4;  // 2s
+    int lights = __builtin_popcountll(present);
+    dali_stats_t before = stats_of(0);
+    uint32_t frames = dali_sim_frames(0);
+
+    completed = 0;
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        if (present & (1ull << addr)) {
+            dali_set_fade_time_rate(0, addr, fade_time, 7, count_done);
+            check(run_until_completed(completed + 1, SECONDS(10)), "setting light %d's fade time never completed", addr);
+            check(dali_sim_fade_time(0, addr) == fade_time, "light %d's fade time is %d", addr, dali_sim_fade_time(0, addr));
+        }
+    }
+    report("frames per fade time and rate change", (double)(dali_sim_frames(0) - frames) / lights, "");
+    settle();
+
+    before = stats_of(0);
+    uint32_t queries = dali_sim_queries(0);
+    uint64_t start = dali_sim_now();
+    completed = 0;
+    dali_set_level_many(0, present, 200, count_done);
+    check(run_until_completed(1, SECONDS(10)), "fading every light never completed");
+    check(dali_sim_fading(0, __builtin_ctzll(present)), "lights aren't fading");
+    settle();
+    dali_stats_t after = stats_of(0);
+    report("level polls after fading every light", after.level_polls - before.level_polls, "");
+    report("  queries", dali_sim_queries(0) - queries, "");
+    report("  until the status bank had settled", (dali_sim_now() - start) / 1e6, "s");
+    report("  bus busy over that time", 100.0 * (after.bus_busy_us - before.bus_busy_us) / (dali_sim_now() - start), "%");
+
+    int wrong = 0;
+    for (int addr = 0; addr < MAX_DALI_LIGHTS; addr++) {
+        if (present & (1ull << addr)) {
+            int status = get_holding_reg(DALI_STATUS_HR(0, addr));
+            wrong += dali_sim_level(0, addr) != 200 || (status & 0xFF) != 200 || (status >> 8) & 0x10;
+        }
+    }
+    check(!wrong, "%d lights' status doesn't show the end of the fade", wrong);
+}
+
+int main() {
+    regs_init();
+    printf("%d DALI bus%s, timed in bus time\n", DALI_NUM_BUSES, DALI_NUM_BUSES > 1 ? "es" : "");
+
+    bench_enumeration("enumeration, 16 gears per bus", EVERY_FOURTH_LIGHT, 0, true);
+    bench_enumeration("enumeration, 64 gears per bus", DALI_ALL_LIGHTS, 0, false);
+    bench_enumeration("enumeration, 64 gears, 2% of answers lost", DALI_ALL_LIGHTS, 20, false);
+    // The lossy scan will have missed some, so put everything back.
+    bench_enumeration("enumeration, 64 gears per bus, again", DALI_ALL_LIGHTS, 0, false);
+
+    bench_set_level_throughput(DALI_ALL_LIGHTS);
+    bench_toggle_latency("toggle latency, always querying", DALI_TOGGLE_MODE_QUERY, false);
+    bench_toggle_latency("toggle latency, from the shadow level", DALI_TOGGLE_MODE_SHADOW, false);
+    bench_toggle_latency("toggle latency, during an enumeration", DALI_TOGGLE_MODE_SHADOW, true);
+    bench_plans(DALI_ALL_LIGHTS);
+    bench_fade_polls(DALI_ALL_LIGHTS);
+
+    printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
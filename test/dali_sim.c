@@ -0,0 +1,488 @@
+/**
+ * Virtual-time DALI bus for the host, standing in for dali_hal_pio.c.  See dali_sim.h.
+ *
+ * Timings are those of the PIO program in dali.pio: a forward frame (start bit, 16 bits and two stop bits) takes 38Te,
+ * after which the state machine waits 22Te for a backward frame.  When one comes (7 to 22Te after the forward frame) it
+ * takes 18Te, and the state machine then keeps the bus idle for another 22Te before it will send again.
+ */
+#include <string.h>
+
+#include "dali_hal.h"
+#include "dali_sim.h"
+
+// Half a bit period at 1200 baud, in nanoseconds, so that 60Te or so doesn't pick up rounding errors.
+#define TE_NS 416667ull
+#define TE_TO_US(te) ((te) * TE_NS / 1000)
+
+#define FORWARD_FRAME_TE 38
+#define BACKWARD_FRAME_TE 18
+#define REPLY_TIMEOUT_TE 22
+#define MIN_SETTLING_TE 7
+#define MAX_SETTLING_TE 22
+#define POST_REPLY_IDLE_TE 22
+// Configuration commands only take effect if they are received twice within this time.
+#define SEND_TWICE_WINDOW_US (100 * 1000)
+// UP and DOWN fade for 200ms at the fade rate.
+#define UP_DOWN_US (200 * 1000)
+
+#define NUM_ADDRS 64
+#define DEVICE_TYPE_LED 6
+#define YES 0xFF
+
+#define STATUS_ARC_POWER_ON 0x04
+#define STATUS_FADE_RUNNING 0x10
+
+typedef struct {
+    bool present;
+    // Level at the start of the current fade, the level it is heading to, and when it gets there.
+    uint8_t from;
+    uint8_t target;
+    uint64_t fade_start;
+    uint64_t fade_end;
+    uint8_t last_active;
+    uint8_t min;
+    uint8_t max;
+    uint8_t power_on;
+    uint8_t system_failure;
+    uint8_t fade_time;
+    uint8_t fade_rate;
+    uint8_t ext_fade;
+    uint16_t groups;
+} sim_gear_t;
+
+typedef struct {
+    sim_gear_t gears[NUM_ADDRS];
+    uint8_t dtr[3];
+    // The transaction in progress, if any.
+    bool outstanding;
+    int result;
+    uint64_t done_at;
+    // The line is busy (sending, or in the idle time after a reply) until this time.
+    uint64_t line_free_at;
+    // The last configuration command, which will be applied if the next frame repeats it in time.
+    uint16_t armed_config;
+    uint64_t armed_until;
+    uint32_t frames;
+    uint32_t queries;
+} sim_bus_t;
+
+static sim_bus_t buses[DALI_SIM_MAX_BUSES];
+static uint64_t now_us;
+static unsigned int reply_loss_permille;
+static uint32_t rng_state = 0x2545F491;
+
+// DALI fade times 1..15 are 0.5 * sqrt(2^n) seconds, and fade rates 1..15 are 506 / sqrt(2^n) steps a second.
+static const uint32_t fade_time_ms[16] = {0,     707,   1000,  1414,  2000,  2828,  4000,  5657,
+                                          8000,  11314, 16000, 22627, 32000, 45255, 64000, 90510};
+static const uint32_t fade_rate_steps_per_10s[16] = {0,   3578, 2530, 1789, 1265, 894, 633, 447,
+                                                     316, 224,  158,  112,  79,   56,  40,  28};
+static const uint32_t ext_fade_multiplier_ms[8] = {0, 100, 1000, 10000, 60000, 0, 0, 0};
+
+static uint32_t next_random() {
+    // xorshift32, so that runs are repeatable.
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// ------------------------- gears ----------------
+
+static void reset_gear(sim_gear_t *g) {
+    *g = (sim_gear_t){.present = true,
+                      .from = 0,
+                      .target = 0,
+                      .last_active = 254,
+                      .min = 1,
+                      .max = 254,
+                      .power_on = 254,
+                      .system_failure = 254,
+                      .fade_time = 0,
+                      .fade_rate = 7,
+                      .ext_fade = 0};
+}
+
+static uint8_t gear_level(const sim_gear_t *g, uint64_t t) {
+    if (t >= g->fade_end) {
+        return g->target;
+    }
+    if (t <= g->fade_start) {
+        return g->from;
+    }
+    int64_t span = g->fade_end - g->fade_start;
+    return g->from + ((int)g->target - g->from) * (int64_t)(t - g->fade_start) / span;
+}
+
+static uint8_t clamp_level(const sim_gear_t *g, int level) {
+    if (level <= 0) {
+        return 0;
+    }
+    return level < g->min ? g->min : level > g->max ? g->max : level;
+}
+
+static void go_to_level(sim_gear_t *g, int level, uint64_t fade_us, uint64_t t) {
+    g->from = gear_level(g, t);
+    g->target = clamp_level(g, level);
+    g->fade_start = t;
+    g->fade_end = t + fade_us;
+    if (g->target) {
+        g->last_active = g->target;
+    }
+}
+
+static uint64_t fade_time_us(const sim_gear_t *g) {
+    if (g->fade_time) {
+        return fade_time_ms[g->fade_time] * 1000ull;
+    }
+    return ((g->ext_fade & 0x0F) + 1) * ext_fade_multiplier_ms[(g->ext_fade >> 4) & 0x07] * 1000ull;
+}
+
+// Levels moved by an UP or DOWN, which fades at the fade rate for 200ms.
+static int up_down_steps(const sim_gear_t *g) {
+    int steps = fade_rate_steps_per_10s[g->fade_rate] * (UP_DOWN_US / 1000) / 10000;
+    return steps ? steps : 1;
+}
+
+static void direct_arc_power(sim_gear_t *g, uint8_t level, uint64_t t) {
+    if (level == 0xFF) {
+        // MASK stops a fade where it is.
+        go_to_level(g, gear_level(g, t), 0, t);
+    } else {
+        go_to_level(g, level, fade_time_us(g), t);
+    }
+}
+
+static void run_command(sim_bus_t *bus, sim_gear_t *g, uint8_t op, uint64_t t) {
+    uint8_t level = gear_level(g, t);
+
+    if (op >= 0x60 && op <= 0x6F) {
+        g->groups |= 1 << (op & 0x0F);
+        return;
+    }
+    if (op >= 0x70 && op <= 0x7F) {
+        g->groups &= ~(1 << (op & 0x0F));
+        return;
+    }
+    switch (op) {
+        case 0x00:  // OFF
+            go_to_level(g, 0, 0, t);
+            break;
+        case 0x01:  // UP
+            if (level) {
+                go_to_level(g, level + up_down_steps(g), UP_DOWN_US, t);
+            }
+            break;
+        case 0x02:  // DOWN
+            if (level) {
+                go_to_level(g, level > g->min + up_down_steps(g) ? level - up_down_steps(g) : g->min, UP_DOWN_US, t);
+            }
+            break;
+        case 0x03:  // STEP UP
+            if (level) {
+                go_to_level(g, level + 1, 0, t);
+            }
+            break;
+        case 0x04:  // STEP DOWN
+            if (level > g->min) {
+                go_to_level(g, level - 1, 0, t);
+            }
+            break;
+        case 0x05:  // RECALL MAX LEVEL
+            go_to_level(g, g->max, 0, t);
+            break;
+        case 0x06:  // RECALL MIN LEVEL
+            go_to_level(g, g->min, 0, t);
+            break;
+        case 0x07:  // STEP DOWN AND OFF
+            go_to_level(g, level <= g->min ? 0 : level - 1, 0, t);
+            break;
+        case 0x08:  // ON AND STEP UP
+            go_to_level(g, level ? level + 1 : g->min, 0, t);
+            break;
+        case 0x0A:  // GO TO LAST ACTIVE LEVEL
+            go_to_level(g, g->last_active, fade_time_us(g), t);
+            break;
+        case 0x20:  // RESET
+            reset_gear(g);
+            g->from = g->target = 254;
+            break;
+        case 0x21:  // STORE ACTUAL LEVEL IN DTR0
+            bus->dtr[0] = level;
+            break;
+        case 0x2A:  // SET MAX LEVEL
+            g->max = bus->dtr[0] < g->min ? g->min : bus->dtr[0] > 254 ? 254 : bus->dtr[0];
+            break;
+        case 0x2B:  // SET MIN LEVEL
+            g->min = bus->dtr[0] < 1 ? 1 : bus->dtr[0] > g->max ? g->max : bus->dtr[0];
+            break;
+        case 0x2C:  // SET SYSTEM FAILURE LEVEL
+            g->system_failure = bus->dtr[0];
+            break;
+        case 0x2D:  // SET POWER ON LEVEL
+            g->power_on = bus->dtr[0];
+            break;
+        case 0x2E:  // SET FADE TIME
+            g->fade_time = bus->dtr[0] > 15 ? 15 : bus->dtr[0];
+            break;
+        case 0x2F:  // SET FADE RATE
+            g->fade_rate = bus->dtr[0] < 1 ? 1 : bus->dtr[0] > 15 ? 15 : bus->dtr[0];
+            break;
+        case 0x30:  // SET EXTENDED FADE TIME
+            g->ext_fade = bus->dtr[0] > 0x4F ? 0 : bus->dtr[0];
+            break;
+    }
+}
+
+// Returns the gear's answer to a query, or -1 if it doesn't answer.
+static int run_query(sim_bus_t *bus, const sim_gear_t *g, uint8_t op, uint64_t t) {
+    uint8_t level = gear_level(g, t);
+
+    switch (op) {
+        case 0x90:  // QUERY STATUS
+            return (level ? STATUS_ARC_POWER_ON : 0) | (t < g->fade_end ? STATUS_FADE_RUNNING : 0);
+        case 0x91:  // QUERY CONTROL GEAR PRESENT
+            return YES;
+        case 0x93:  // QUERY LAMP POWER ON
+            return level ? YES : -1;
+        case 0x98:  // QUERY CONTENT DTR0
+            return bus->dtr[0];
+        case 0x99:  // QUERY DEVICE TYPE
+            return DEVICE_TYPE_LED;
+        case 0x9C:  // QUERY CONTENT DTR1
+            return bus->dtr[1];
+        case 0x9D:  // QUERY CONTENT DTR2
+            return bus->dtr[2];
+        case 0xA0:  // QUERY ACTUAL LEVEL
+            return level;
+        case 0xA1:  // QUERY MAX LEVEL
+            return g->max;
+        case 0xA2:  // QUERY MIN LEVEL
+            return g->min;
+        case 0xA3:  // QUERY POWER ON LEVEL
+            return g->power_on;
+        case 0xA4:  // QUERY SYSTEM FAILURE LEVEL
+            return g->system_failure;
+        case 0xA5:  // QUERY FADE TIME/FADE RATE
+            return g->fade_time << 4 | g->fade_rate;
+        case 0xA8:  // QUERY EXTENDED FADE TIME
+            return g->ext_fade;
+        case 0xC0:  // QUERY GROUPS 0-7
+            return g->groups & 0xFF;
+        case 0xC1:  // QUERY GROUPS 8-15
+            return g->groups >> 8;
+        default:
+            // Memory banks, scenes and everything else that we don't model.
+            return -1;
+    }
+}
+
+// ------------------------- frames ----------------
+
+// Works out which gears a forward frame is addressed to.
+static dali_light_mask_t frame_targets(const sim_bus_t *bus, uint8_t addr_byte) {
+    dali_light_mask_t targets = 0;
+
+    for (int i = 0; i < NUM_ADDRS; i++) {
+        const sim_gear_t *g = &bus->gears[i];
+        if (!g->present) {
+            continue;
+        }
+        if ((addr_byte & 0x80) == 0) {
+            // Short address.
+            if (i == ((addr_byte >> 1) & 0x3F)) {
+                targets |= 1ull << i;
+            }
+        } else if ((addr_byte & 0xE0) == 0x80) {
+            if (g->groups & (1 << ((addr_byte >> 1) & 0x0F))) {
+                targets |= 1ull << i;
+            }
+        } else if ((addr_byte & 0xFE) == 0xFE) {
+            targets |= 1ull << i;
+        }
+    }
+    return targets;
+}
+
+// Short, group and broadcast addresses, as opposed to special commands and the reserved address bytes.
+static bool is_addressed(uint8_t addr_byte) {
+    return !(addr_byte & 0x80) || (addr_byte & 0xE0) == 0x80 || (addr_byte & 0xFE) == 0xFE;
+}
+
+static bool is_special(uint8_t addr_byte) {
+    return (addr_byte & 1) && addr_byte >= 0xA1 && addr_byte <= 0xCB;
+}
+
+/**
+ * Acts on a forward frame as the gears would at the moment that it finishes, and returns the backward frame, DALI_NAK
+ * if there wasn't one, or DALI_BUS_ERROR if more than one gear answered at once.
+ */
+static int deliver(sim_bus_t *bus, uint16_t frame, uint64_t t) {
+    uint8_t addr_byte = frame >> 8;
+    uint8_t op = frame & 0xFF;
+    bool is_command = is_addressed(addr_byte) && (addr_byte & 1);
+    bool is_config = is_command && op >= 0x20 && op <= 0x81;
+    bool repeated = is_config && frame == bus->armed_config && t <= bus->armed_until;
+
+    // A configuration command is armed by its first frame, and anything in between cancels it.
+    bus->armed_config = is_config && !repeated ? frame : 0;
+    bus->armed_until = t + SEND_TWICE_WINDOW_US;
+
+    if (is_special(addr_byte)) {
+        switch (addr_byte) {
+            case 0xA3:
+                bus->dtr[0] = op;
+                break;
+            case 0xC3:
+                bus->dtr[1] = op;
+                break;
+            case 0xC5:
+                bus->dtr[2] = op;
+                break;
+        }
+        return DALI_NAK;
+    }
+
+    dali_light_mask_t targets = frame_targets(bus, addr_byte);
+    int answers = 0;
+    int answer = DALI_NAK;
+    for (dali_light_mask_t left = targets; left; left &= left - 1) {
+        sim_gear_t *g = &bus->gears[__builtin_ctzll(left)];
+        if (!(addr_byte & 1)) {
+            direct_arc_power(g, op, t);
+        } else if (op < 0x20 || (is_config && repeated)) {
+            run_command(bus, g, op, t);
+        } else if (op >= 0x90) {
+            int a = run_query(bus, g, op, t);
+            if (a >= 0) {
+                answer = a;
+                answers++;
+            }
+        }
+    }
+    if (is_command && op >= 0x90) {
+        bus->queries++;
+    }
+    if (answers > 1) {
+        return DALI_BUS_ERROR;
+    }
+    if (answers && next_random() % 1000 < reply_loss_permille) {
+        return DALI_NAK;
+    }
+    return answer;
+}
+
+// ------------------------- dali_hal.h ----------------
+
+void dali_hal_init(unsigned int bus, uint32_t tx_pin, uint32_t rx_pin) {
+    dali_hal_reset(bus);
+}
+
+void dali_hal_reset(unsigned int bus) {
+    // Like restarting the state machine, this drops the result but can't take back what is already on the wire.
+    buses[bus].outstanding = false;
+}
+
+void dali_hal_send(unsigned int bus_no, uint16_t frame) {
+    sim_bus_t *bus = &buses[bus_no];
+    uint64_t start = now_us > bus->line_free_at ? now_us : bus->line_free_at;
+    uint64_t sent = start + TE_TO_US(FORWARD_FRAME_TE);
+
+    bus->frames++;
+    bus->result = deliver(bus, frame, sent);
+    bus->outstanding = true;
+    if (bus->result == DALI_NAK) {
+        bus->done_at = sent + TE_TO_US(REPLY_TIMEOUT_TE);
+        bus->line_free_at = bus->done_at;
+    } else {
+        unsigned settling = MIN_SETTLING_TE + next_random() % (MAX_SETTLING_TE - MIN_SETTLING_TE + 1);
+        bus->done_at = sent + TE_TO_US(settling + BACKWARD_FRAME_TE);
+        bus->line_free_at = bus->done_at + TE_TO_US(POST_REPLY_IDLE_TE);
+    }
+}
+
+bool dali_hal_receive(unsigned int bus_no, int *result) {
+    sim_bus_t *bus = &buses[bus_no];
+    if (!bus->outstanding || now_us < bus->done_at) {
+        return false;
+    }
+    bus->outstanding = false;
+    *result = bus->result;
+    return true;
+}
+
+uint64_t dali_hal_time_us() {
+    return now_us;
+}
+
+// ------------------------- dali_sim.h ----------------
+
+void dali_sim_populate(unsigned int bus_no, dali_light_mask_t present) {
+    sim_bus_t *bus = &buses[bus_no];
+
+    memset(bus->gears, 0, sizeof(bus->gears));
+    for (int i = 0; i < NUM_ADDRS; i++) {
+        if (present & (1ull << i)) {
+            reset_gear(&bus->gears[i]);
+            bus->gears[i].groups = 1 << (i / 8);
+        }
+    }
+}
+
+void dali_sim_set_reply_loss(unsigned int permille) {
+    reply_loss_permille = permille;
+}
+
+uint64_t dali_sim_now() {
+    return now_us;
+}
+
+void dali_sim_advance_to(uint64_t t) {
+    if (t > now_us) {
+        now_us = t;
+    }
+}
+
+uint64_t dali_sim_next_event() {
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < DALI_SIM_MAX_BUSES; i++) {
+        if (buses[i].outstanding && buses[i].done_at < next) {
+            next = buses[i].done_at;
+        }
+    }
+    return next;
+}
+
+bool dali_sim_busy(unsigned int bus) {
+    return buses[bus].outstanding;
+}
+
+void dali_sim_set_level(unsigned int bus, unsigned int addr, uint8_t level) {
+    go_to_level(&buses[bus].gears[addr], level, 0, now_us);
+}
+
+int dali_sim_level(unsigned int bus, unsigned int addr) {
+    const sim_gear_t *g = &buses[bus].gears[addr];
+    return g->present ? gear_level(g, now_us) : -1;
+}
+
+bool dali_sim_fading(unsigned int bus, unsigned int addr) {
+    const sim_gear_t *g = &buses[bus].gears[addr];
+    return g->present && now_us < g->fade_end;
+}
+
+int dali_sim_fade_time(unsigned int bus, unsigned int addr) {
+    const sim_gear_t *g = &buses[bus].gears[addr];
+    return g->present ? g->fade_time : -1;
+}
+
+uint16_t dali_sim_groups(unsigned int bus, unsigned int addr) {
+    return buses[bus].gears[addr].groups;
+}
+
+uint32_t dali_sim_frames(unsigned int bus) {
+    return buses[bus].frames;
+}
+
+uint32_t dali_sim_queries(unsigned int bus) {
+    return buses[bus].queries;
+}
@@ -0,0 +1,49 @@
+#ifndef _DALI_SIM_H
+#define _DALI_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dali.h"
+
+/**
+ * A virtual-time DALI bus, implementing dali_hal.h on the host.  Each bus has 64 short addresses, any of which can have
+ * a control gear on it.  Frames take as long as they would at 1200 baud: 38Te for a forward frame, then either a
+ * backward frame 7 to 22Te later or a NAK once 22Te have passed without one.  Gears keep their own levels, limits,
+ * fade times and group memberships, and fade between levels as real ones do.
+ *
+ * Nothing happens by itself: the caller moves the clock on, normally to whichever of dali_sim_next_event() and
+ * dali_next_poll_time() comes first, and then calls dali_poll().
+ */
+
+#define DALI_SIM_MAX_BUSES 4
+
+// Removes every gear from the bus, then puts a freshly reset gear at each of the given short addresses.  Gear n starts
+// out in group n / 8, and off.
+void dali_sim_populate(unsigned int bus, dali_light_mask_t present);
+
+// Loses this many in every thousand backward frames, as a NAK, to stand in for a noisy bus.  Repeatable, as the
+// random numbers come from a fixed seed.
+void dali_sim_set_reply_loss(unsigned int permille);
+
+uint64_t dali_sim_now();
+// Moves the virtual clock on (never back).
+void dali_sim_advance_to(uint64_t t);
+// Time at which the next outstanding transaction on any bus finishes, or UINT64_MAX if none is.
+uint64_t dali_sim_next_event();
+bool dali_sim_busy(unsigned int bus);
+
+// Changes a gear's level straight away, as a wall switch or another bus master would, behind the driver's back.
+void dali_sim_set_level(unsigned int bus, unsigned int addr, uint8_t level);
+
+// What a gear is doing right now, or -1 if there is no gear at that address.
+int dali_sim_level(unsigned int bus, unsigned int addr);
+bool dali_sim_fading(unsigned int bus, unsigned int addr);
+int dali_sim_fade_time(unsigned int bus, unsigned int addr);
+uint16_t dali_sim_groups(unsigned int bus, unsigned int addr);
+
+// Forward frames seen on a bus, and how many of those were queries.
+uint32_t dali_sim_frames(unsigned int bus);
+uint32_t dali_sim_queries(unsigned int bus);
+
+#endif
@@ -0,0 +1,597 @@
+/**
+ * Runs the Modbus TCP server (modbus_tcp.c and modbus_receiver.c) against real TCP clients, through the socket-backed
+ * stand-in for the WIZnet driver in wiznet_posix/, and against RTU requests through the pipes in usb_posix/.  The DALI and relay buses are faked, with each operation finishing a
+ * little later on a thread that stands in for core 0, so that bus requests are parked and answered after later reads,
+ * as they are on the device.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "buttons.h"
+#include "crcbuf.h"
+#include "dali.h"
+#include "modbus.h"
+#include "modbus_receiver.h"
+#include "regs.h"
+#include "usb_posix.h"
+
+// Not socket.h, whose names would hide the C library's.
+uint16_t wiznet_posix_port();
+
+#define BUS_DELAY_US 50000
+// The answer that the fake DALI bus gives to a raw command.
+#define RAW_DALI_ANSWER 0x42
+
+// ------------------------- fake buses, finishing on a stand-in for core 0 ----------------
+
+typedef struct {
+    dali_result_cb_t dali_cb;
+    modbus_task_cb relay_cb;
+    int res;
+    uint64_t at;
+} completion_t;
+
+#define MAX_COMPLETIONS 32
+static completion_t completions[MAX_COMPLETIONS];
+static pthread_mutex_t completions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void complete_later(dali_result_cb_t dali_cb, modbus_task_cb relay_cb, int res) {
+    pthread_mutex_lock(&completions_lock);
+    for (int i = 0; i < MAX_COMPLETIONS; i++) {
+        if (!completions[i].dali_cb && !completions[i].relay_cb) {
+            completions[i] = (completion_t){dali_cb, relay_cb, res, time_us_64() + BUS_DELAY_US};
+            break;
+        }
+    }
+    pthread_mutex_unlock(&completions_lock);
+}
+
+static void *core0_thread(void *arg) {
+    while (true) {
+        completion_t due = {0};
+
+        pthread_mutex_lock(&completions_lock);
+        for (int i = 0; i < MAX_COMPLETIONS && !due.at; i++) {
+            if ((completions[i].dali_cb || completions[i].relay_cb) && time_us_64() >= completions[i].at) {
+                due = completions[i];
+                completions[i] = (completion_t){0};
+            }
+        }
+        pthread_mutex_unlock(&completions_lock);
+        if (due.dali_cb) {
+            due.dali_cb(due.res);
+        } else if (due.relay_cb) {
+            due.relay_cb(due.res, NULL, NULL, 0);
+        } else {
+            sleep_ms(1);
+        }
+    }
+    return NULL;
+}
+
+void dali_exec_cmd(int bus, uint16_t cmd, dali_result_cb_t resultHandler, bool sendTwice) {
+    complete_later(resultHandler, NULL, RAW_DALI_ANSWER);
+}
+
+void dali_toggle(int bus, int addr, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_level(int bus, int addr, int level, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_min_max_level(int bus, int addr, unsigned min, unsigned max, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_fade_time_rate(int bus, int addr, unsigned time, unsigned rate, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_power_on_level(int bus, int addr, int powerOnLevel, int systemFailLevel, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_remove_from_group(int bus, int addr, int group, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_add_to_group(int bus, int addr, int group, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_level_many(int bus, dali_light_mask_t lights, int level, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+void dali_set_on_many(int bus, dali_light_mask_t lights, bool is_on, dali_result_cb_t cb) {
+    complete_later(cb, NULL, 0);
+}
+
+bool dali_enumerate() {
+    return true;
+}
+
+bool modbus_downstream_write_coil(unsigned int coil, bool on, modbus_task_cb cb) {
+    complete_later(NULL, cb, MODBUS_TASK_STATE_DONE);
+    return true;
+}
+
+bool modbus_downstream_toggle_coil(unsigned int coil, modbus_task_cb cb) {
+    complete_later(NULL, cb, MODBUS_TASK_STATE_DONE);
+    return true;
+}
+
+int modbus_downstream_write_coils(unsigned int coil, unsigned int count, const uint8_t *bits, modbus_task_cb cb) {
+    int writes = 0;
+    for (unsigned int device = coil / MODBUS_COILS_PER_DEVICE; device * MODBUS_COILS_PER_DEVICE < coil + count; device++) {
+        complete_later(NULL, cb, MODBUS_TASK_STATE_DONE);
+        writes++;
+    }
+    return writes;
+}
+
+bool modbus_slave_online(unsigned int bus, unsigned int slave) {
+    return true;
+}
+
+unsigned int modbus_relay_bus(unsigned int device) {
+    return 0;
+}
+
+bool modbus_set_relay_bus_map(uint32_t map) {
+    return map == 0;
+}
+
+bool modbus_set_baud_rate(unsigned int bus, uint32_t baud) {
+    return true;
+}
+
+void set_and_persist_binding(unsigned int addr, uint16_t encoded_binding) {
+    set_holding_reg(addr, encoded_binding);
+}
+
+void persist_bindings() {
+}
+
+// ------------------------- clients ----------------
+
+static int failures;
+
+static void check(bool ok, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    printf("%s: ", ok ? "ok" : "FAIL");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) {
+        failures++;
+    }
+}
+
+static int connect_client() {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = htons(wiznet_posix_port())};
+    struct timeval timeout = {2, 0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(2);
+    }
+    return fd;
+}
+
+// Builds an ADU (MBAP header, unit id 1 and pdu) into out, returning its length.
+static size_t build_adu(uint8_t *out, uint16_t tid, const uint8_t *pdu, size_t pdu_sz) {
+    out[0] = tid >> 8;
+    out[1] = tid;
+    out[2] = 0;
+    out[3] = 0;
+    out[4] = (pdu_sz + 1) >> 8;
+    out[5] = pdu_sz + 1;
+    out[6] = 1;
+    memcpy(out + 7, pdu, pdu_sz);
+    return pdu_sz + 7;
+}
+
+static void send_request(int fd, uint16_t tid, const uint8_t *pdu, size_t pdu_sz) {
+    uint8_t adu[260];
+    send(fd, adu, build_adu(adu, tid, pdu, pdu_sz), 0);
+}
+
+static bool read_all(int fd, uint8_t *buf, size_t sz) {
+    while (sz) {
+        ssize_t got = recv(fd, buf, sz, 0);
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        sz -= got;
+    }
+    return true;
+}
+
+// Reads a response, storing its transaction id and its PDU (without the unit id).  Returns the PDU's length, or -1 if
+// nothing came, or 0 if the server closed the connection.
+static int read_response(int fd, uint16_t *tid, uint8_t *pdu) {
+    uint8_t header[7];
+
+    errno = 0;
+    if (!read_all(fd, header, sizeof(header))) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+    }
+    size_t len = (header[4] << 8) | header[5];
+    *tid = (header[0] << 8) | header[1];
+    if (header[2] || header[3] || header[6] != 1 || len < 2 || !read_all(fd, pdu, len - 1)) {
+        return -1;
+    }
+    return len - 1;
+}
+
+static void test_write_then_read_binding() {
+    int fd = connect_client();
+    uint8_t write[] = {MODBUS_CMD_WRITE_SINGLE_REGISTER, 0x00, 0x05, 0x12, 0x34};
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x05, 0x00, 0x01};
+    uint8_t pdu[256];
+    uint16_t tid;
+
+    send_request(fd, 1, write, sizeof(write));
+    int len = read_response(fd, &tid, pdu);
+    check(len == sizeof(write) && tid == 1 && !memcmp(pdu, write, len), "write single register is echoed");
+    send_request(fd, 2, read, sizeof(read));
+    len = read_response(fd, &tid, pdu);
+    check(len == 4 && tid == 2 && pdu[0] == MODBUS_CMD_READ_HOLDING_REGISTERS && pdu[1] == 2 && pdu[2] == 0x12 &&
+              pdu[3] == 0x34,
+          "read holding registers returns what was written");
+    close(fd);
+}
+
+static void test_pipelined_and_split_requests() {
+    int fd = connect_client();
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x05, 0x00, 0x01};
+    uint8_t adus[520];
+    uint8_t pdu[256];
+    uint16_t tid1, tid2;
+
+    size_t sz = build_adu(adus, 10, read, sizeof(read));
+    sz += build_adu(adus + sz, 11, read, sizeof(read));
+    send(fd, adus, sz, 0);
+    int len1 = read_response(fd, &tid1, pdu);
+    int len2 = read_response(fd, &tid2, pdu);
+    check(len1 == 4 && len2 == 4 && tid1 == 10 && tid2 == 11, "two requests in one segment are both answered, in order");
+
+    sz = build_adu(adus, 12, read, sizeof(read));
+    send(fd, adus, 5, 0);
+    sleep_ms(20);
+    send(fd, adus + 5, sz - 5, 0);
+    len1 = read_response(fd, &tid1, pdu);
+    check(len1 == 4 && tid1 == 12, "a request split across segments is answered once it is all there");
+    close(fd);
+}
+
+static void test_exceptions() {
+    int fd = connect_client();
+    uint8_t unknown[] = {0x2B, 0x0E, 0x01, 0x00};
+    uint8_t too_long[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x05, 0x00, 0x01, 0x00};
+    uint8_t pdu[256];
+    uint16_t tid;
+
+    send_request(fd, 30, unknown, sizeof(unknown));
+    int len = read_response(fd, &tid, pdu);
+    check(len == 2 && tid == 30 && pdu[0] == (0x2B | 0x80) && pdu[1] == MODBUS_ERR_ILLEGAL_FUNCTION,
+          "an unknown function code gets Illegal Function");
+    send_request(fd, 31, too_long, sizeof(too_long));
+    len = read_response(fd, &tid, pdu);
+    check(len == 2 && tid == 31 && pdu[0] == (MODBUS_CMD_READ_HOLDING_REGISTERS | 0x80) &&
+              pdu[1] == MODBUS_ERR_ILLEGAL_DATA_VALUE,
+          "a request of the wrong length gets Illegal Data Value");
+
+    uint8_t bad_coil[] = {MODBUS_CMD_WRITE_SINGLE_COIL, 0x00, 0x00, 0x12, 0x34};
+    send_request(fd, 34, bad_coil, sizeof(bad_coil));
+    len = read_response(fd, &tid, pdu);
+    check(len == 2 && tid == 34 && pdu[0] == (MODBUS_CMD_WRITE_SINGLE_COIL | 0x80) && pdu[1] == MODBUS_ERR_ILLEGAL_DATA_VALUE,
+          "a relay coil written with neither 0x0000 nor 0xFF00 gets Illegal Data Value");
+
+    // The same exception as Write Single Register would give, for the register that it stopped at.
+    uint8_t read_only[] = {MODBUS_CMD_WRITE_MULTIPLE_REGISTERS,
+                           CONFIG_HR_IDLE_PERMILLE >> 8,
+                           CONFIG_HR_IDLE_PERMILLE & 0xFF,
+                           0x00,
+                           0x01,
+                           0x02,
+                           0x00,
+                           0x01};
+    uint8_t failed_at[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, CONFIG_HR_WRITE_FAILED_AT >> 8,
+                           CONFIG_HR_WRITE_FAILED_AT & 0xFF, 0x00, 0x01};
+    send_request(fd, 32, read_only, sizeof(read_only));
+    len = read_response(fd, &tid, pdu);
+    check(len == 2 && tid == 32 && pdu[0] == (MODBUS_CMD_WRITE_MULTIPLE_REGISTERS | 0x80) &&
+              pdu[1] == MODBUS_ERR_ILLEGAL_DATA_ADDR,
+          "writing multiple registers to a read only one gets Illegal Data Address");
+    send_request(fd, 33, failed_at, sizeof(failed_at));
+    len = read_response(fd, &tid, pdu);
+    check(len == 4 && tid == 33 && ((pdu[2] << 8) | pdu[3]) == CONFIG_HR_IDLE_PERMILLE,
+          "the register it stopped at is recorded");
+    close(fd);
+}
+
+static void test_bus_write_answered_after_later_read() {
+    int fd = connect_client();
+    uint8_t toggle[] = {MODBUS_CMD_WRITE_SINGLE_COIL, DALI_COIL_BASE >> 8, DALI_COIL_BASE & 0xFF, 0x55, 0x00};
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x05, 0x00, 0x01};
+    uint8_t raw[] = {MODBUS_CMD_CUSTOM_EXEC_DALI, 0xFF, 0x90, 0x00};
+    uint8_t adus[520];
+    uint8_t pdu[256];
+    uint16_t tid1, tid2;
+
+    size_t sz = build_adu(adus, 20, toggle, sizeof(toggle));
+    sz += build_adu(adus + sz, 21, read, sizeof(read));
+    send(fd, adus, sz, 0);
+    int len1 = read_response(fd, &tid1, pdu);
+    int len2 = read_response(fd, &tid2, pdu);
+    check(len1 == 4 && tid1 == 21 && len2 == sizeof(toggle) && tid2 == 20 && !memcmp(pdu, toggle, len2),
+          "a DALI write is answered after a read sent behind it");
+
+    send_request(fd, 22, raw, sizeof(raw));
+    len1 = read_response(fd, &tid1, pdu);
+    check(len1 == 2 && tid1 == 22 && pdu[0] == MODBUS_CMD_CUSTOM_EXEC_DALI && pdu[1] == RAW_DALI_ANSWER,
+          "a raw DALI command returns the bus' answer");
+    close(fd);
+}
+
+static void test_clients_are_kept_apart() {
+    int a = connect_client();
+    int b = connect_client();
+    uint8_t toggle[] = {MODBUS_CMD_WRITE_SINGLE_COIL, DALI_COIL_BASE >> 8, DALI_COIL_BASE & 0xFF, 0x55, 0x00};
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x05, 0x00, 0x01};
+    uint8_t pdu[256];
+    uint16_t tid;
+
+    // a goes away before its write has finished, so that answer has nowhere to go.
+    send_request(a, 40, toggle, sizeof(toggle));
+    sleep_ms(5);
+    close(a);
+    send_request(b, 41, read, sizeof(read));
+    int len = read_response(b, &tid, pdu);
+    check(len == 4 && tid == 41, "a second client is answered while the first one's write is under way");
+    sleep_ms(BUS_DELAY_US / 1000 * 2);
+    send_request(b, 42, read, sizeof(read));
+    len = read_response(b, &tid, pdu);
+    check(len == 4 && tid == 42, "the answer for a client that has gone isn't sent to another");
+    close(b);
+}
+
+static void test_not_modbus_is_dropped() {
+    int fd = connect_client();
+    uint8_t adu[] = {0x00, 0x01, 0x00, 0x01, 0x00, 0x06, 0x01, 0x03, 0x00, 0x05, 0x00, 0x01};
+    uint8_t pdu[256];
+    uint16_t tid;
+
+    send(fd, adu, sizeof(adu), 0);
+    check(read_response(fd, &tid, pdu) == 0, "a client using another protocol id is disconnected");
+    close(fd);
+}
+
+// ------------------------- read latency under mixed load ----------------
+
+#define LATENCY_READS 200
+
+static volatile bool stop_writer;
+
+// Keeps a relay write or a DALI register write parked on the server, one after another, until told to stop.
+static void *bus_writer(void *arg) {
+    int fd = connect_client();
+    uint8_t relay[] = {MODBUS_CMD_WRITE_SINGLE_COIL, 0x00, 0x00, 0xFF, 0x00};
+    uint8_t levels[] = {MODBUS_CMD_WRITE_MULTIPLE_REGISTERS,
+                        DALI_STATUS_HR(0, 0) >> 8,
+                        DALI_STATUS_HR(0, 0) & 0xFF,
+                        0x00,
+                        0x02,
+                        0x04,
+                        0x00,
+                        0x80,
+                        0x00,
+                        0x80};
+    uint8_t pdu[256];
+    uint16_t tid;
+    int *writes = arg;
+
+    for (uint16_t n = 0; !stop_writer; n++) {
+        if (n & 1) {
+            send_request(fd, n, levels, sizeof(levels));
+        } else {
+            send_request(fd, n, relay, sizeof(relay));
+        }
+        if (read_response(fd, &tid, pdu) > 1 && !(pdu[0] & 0x80)) {
+            (*writes)++;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times reads of the discrete inputs and holding registers, one at a time, and returns the 99th percentile.
+static uint64_t time_reads(const char *name) {
+    int fd = connect_client();
+    uint8_t inputs[] = {MODBUS_CMD_READ_DISCRETE_INPUTS, 0x00, 0x00, 0x00, 0x10};
+    uint8_t regs[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x10};
+    uint64_t latency[LATENCY_READS];
+    uint8_t pdu[256];
+    uint16_t tid;
+    int good = 0;
+
+    for (int i = 0; i < LATENCY_READS; i++) {
+        uint64_t start = time_us_64();
+        if (i & 1) {
+            send_request(fd, i, regs, sizeof(regs));
+        } else {
+            send_request(fd, i, inputs, sizeof(inputs));
+        }
+        good += read_response(fd, &tid, pdu) > 1 && tid == i && !(pdu[0] & 0x80);
+        latency[i] = time_us_64() - start;
+    }
+    close(fd);
+    qsort(latency, LATENCY_READS, sizeof(latency[0]), compare_u64);
+    printf("%-40s p50 %6llu us  p99 %6llu us\n", name, (unsigned long long)latency[LATENCY_READS / 2],
+           (unsigned long long)latency[LATENCY_READS * 99 / 100]);
+    check(good == LATENCY_READS, "%s: %d of %d reads answered", name, good, LATENCY_READS);
+    return latency[LATENCY_READS * 99 / 100];
+}
+
+/**
+ * Reads are answered from register memory, so they shouldn't wait behind a bus write that is parked on the server.
+ * Each bus write here takes BUS_DELAY_US, so a read that waited for one would take at least that long.
+ */
+static void test_read_latency_under_bus_load() {
+    pthread_t writer;
+    int writes = 0;
+
+    time_reads("FC02/FC03 reads, idle");
+    stop_writer = false;
+    pthread_create(&writer, NULL, bus_writer, &writes);
+    sleep_ms(BUS_DELAY_US / 1000 / 2);
+    uint64_t p99 = time_reads("FC02/FC03 reads, FC05/FC16 parked");
+    stop_writer = true;
+    pthread_join(writer, NULL);
+    check(writes > 0, "bus writes were made alongside the reads (%d)", writes);
+    check(p99 < BUS_DELAY_US / 2, "reads don't wait for parked bus writes (p99 %llu us)", (unsigned long long)p99);
+}
+
+// ------------------------- RTU over USB ----------------
+
+#define USB_REQUESTS 1000
+// As many requests as are written to USB in one go, as a host that doesn't wait for each answer would.
+#define USB_PIPELINE 8
+
+// The host's ends of the pipes standing in for USB.
+static int usb_to_device, usb_from_device;
+
+// Writes an RTU frame, for unit 1, to USB.  Returns the frame's length.
+static size_t build_rtu(uint8_t *out, const uint8_t *pdu, size_t sz) {
+    uint16_t crc = 0xFFFF;
+
+    out[0] = 1;
+    memcpy(out + 1, pdu, sz);
+    for (size_t i = 0; i < sz + 1; i++) {
+        crc_update(out[i], &crc);
+    }
+    out[sz + 1] = crc;
+    out[sz + 2] = crc >> 8;
+    return sz + 3;
+}
+
+// Reads an RTU response of sz bytes from USB, giving up after 2 s.  True if it came, with a good CRC.
+static bool read_rtu(uint8_t *buf, size_t sz) {
+    struct pollfd pfd = {.fd = usb_from_device, .events = POLLIN};
+    uint16_t crc = 0xFFFF;
+
+    for (size_t got = 0; got < sz;) {
+        if (poll(&pfd, 1, 2000) <= 0) {
+            return false;
+        }
+        ssize_t n = read(usb_from_device, buf + got, sz - got);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    for (size_t i = 0; i < sz; i++) {
+        crc_update(buf[i], &crc);
+    }
+    return crc == 0;
+}
+
+// Sends USB_REQUESTS register reads, pipelined this many at a time, and reports how many are answered a second.
+static void time_usb_reads(const char *name, int pipelined) {
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x10};
+    uint8_t frames[USB_PIPELINE * 16];
+    uint8_t res[5 + 2 * 16];
+    int good = 0;
+    size_t sz = 0;
+
+    for (int i = 0; i < pipelined; i++) {
+        sz += build_rtu(frames + sz, read, sizeof(read));
+    }
+    uint64_t start = time_us_64();
+    for (int i = 0; i < USB_REQUESTS; i += pipelined) {
+        if (write(usb_to_device, frames, sz) != sz) {
+            break;
+        }
+        for (int j = 0; j < pipelined; j++) {
+            good += read_rtu(res, sizeof(res)) && res[1] == MODBUS_CMD_READ_HOLDING_REGISTERS && res[2] == 32;
+        }
+    }
+    uint64_t took = time_us_64() - start;
+    printf("%-40s %8.0f requests/s\n", name, good * 1e6 / took);
+    check(good == USB_REQUESTS, "%s: %d of %d requests answered", name, good, USB_REQUESTS);
+}
+
+static void test_usb_request_rate() {
+    time_usb_reads("FC03 over USB, one at a time", 1);
+    time_usb_reads("FC03 over USB, 8 per write", USB_PIPELINE);
+}
+
+// The start of a frame that arrives along with a whole one, and then never gets finished, is thrown away once it has
+// had as long as any other part of a frame would, so that it doesn't spoil the next request.
+static void test_usb_leftover_partial_frame() {
+    uint8_t read[] = {MODBUS_CMD_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01};
+    uint8_t frames[32];
+    uint8_t res[7];
+
+    size_t sz = build_rtu(frames, read, sizeof(read));
+    sz += build_rtu(frames + sz, read, sizeof(read)) - 5;
+    check(write(usb_to_device, frames, sz) == sz && read_rtu(res, sizeof(res)), "a whole frame is answered");
+    sleep_ms(200);
+    sz = build_rtu(frames, read, sizeof(read));
+    check(write(usb_to_device, frames, sz) == sz && read_rtu(res, sizeof(res)),
+          "the next frame is answered once the part of one that came with the last has timed out");
+}
+
+int main() {
+    pthread_t server, core0;
+
+    regs_init();
+    if (!usb_posix_connect(&usb_to_device, &usb_from_device)) {
+        perror("pipe");
+        return 1;
+    }
+    pthread_create(&core0, NULL, core0_thread, NULL);
+    pthread_create(&server, NULL, (void *(*)(void *))modbus_server_thread, NULL);
+    while (!wiznet_posix_port()) {
+        sleep_ms(1);
+    }
+
+    test_write_then_read_binding();
+    test_pipelined_and_split_requests();
+    test_exceptions();
+    test_bus_write_answered_after_later_read();
+    test_clients_are_kept_apart();
+    test_not_modbus_is_dropped();
+    test_read_latency_under_bus_load();
+    test_usb_request_rate();
+    test_usb_leftover_partial_frame();
+
+    printf("%d failed\n", failures);
+    // The server thread never returns.
+    exit(failures ? 1 : 0);
+}
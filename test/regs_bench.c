@@ -0,0 +1,103 @@
+/**
+ * Contention benchmark for the register store.  One thread stands in for core 0, writing a run of holding registers
+ * as fast as it can, while another stands in for core 1, reading them back the way a Read Holding Registers does.
+ * Reports how fast each side goes on its own and with the other running, and fails if a read ever came back with
+ * half of a write in it.
+ *
+ *   regs_bench [seconds per phase]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "regs.h"
+
+// A bank's worth of registers, written with the same value each time, so a consistent read is all one value.
+#define BENCH_BASE DALI_STATUS_HR(0, 0)
+#define BENCH_REGS MAX_DALI_LIGHTS
+
+typedef struct {
+    volatile bool stop;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t torn;
+} bench_t;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg) {
+    bench_t *b = arg;
+
+    for (unsigned value = 0; !b->stop; value++) {
+        fill_holding_regs(BENCH_BASE, value & 0xFFFF, BENCH_REGS);
+        b->writes++;
+    }
+    return NULL;
+}
+
+static void *reader(void *arg) {
+    bench_t *b = arg;
+    uint8_t regs[BENCH_REGS * 2];
+
+    while (!b->stop) {
+        copy_holding_regs(regs, BENCH_BASE, BENCH_REGS);
+        for (int i = 2; i < sizeof(regs); i += 2) {
+            if (regs[i] != regs[0] || regs[i + 1] != regs[1]) {
+                b->torn++;
+                break;
+            }
+        }
+        // Single register reads take the same path as the buttons' binding lookups.
+        get_holding_reg(BENCH_BASE + BENCH_REGS / 2);
+        b->reads++;
+    }
+    return NULL;
+}
+
+// Runs whichever of the reader and writer are asked for, for secs, and prints their rates.
+static bool run_phase(const char *name, bool read, bool write, double secs) {
+    bench_t b = {0};
+    pthread_t threads[2];
+    int n = 0;
+
+    double start = now_s();
+    if (write) {
+        pthread_create(&threads[n++], NULL, writer, &b);
+    }
+    if (read) {
+        pthread_create(&threads[n++], NULL, reader, &b);
+    }
+    while (now_s() - start < secs) {
+        struct timespec tick = {0, 10 * 1000 * 1000};
+        nanosleep(&tick, NULL);
+    }
+    b.stop = true;
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_s() - start;
+
+    printf("%-22s %12.0f reads/s %12.0f writes/s %8llu torn\n", name, b.reads / elapsed, b.writes / elapsed,
+           (unsigned long long)b.torn);
+    return b.torn == 0;
+}
+
+int main(int argc, char **argv) {
+    double secs = argc > 1 ? atof(argv[1]) : 1.0;
+    bool ok = true;
+
+    regs_init();
+    printf("%d registers per read and write\n", BENCH_REGS);
+    ok &= run_phase("reads alone", true, false, secs);
+    ok &= run_phase("writes alone", false, true, secs);
+    ok &= run_phase("reads against writes", true, true, secs);
+    if (!ok) {
+        printf("FAIL: reads saw partly written registers\n");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef _STUB_HARDWARE_GPIO_H
+#define _STUB_HARDWARE_GPIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GPIO_OUT 1
+#define GPIO_FUNC_SPI 1
+
+static inline void gpio_init(uint32_t gpio) {
+}
+static inline void gpio_set_dir(uint32_t gpio, bool out) {
+}
+static inline void gpio_set_function(uint32_t gpio, int fn) {
+}
+static inline void gpio_put(uint32_t gpio, bool value) {
+}
+
+#endif
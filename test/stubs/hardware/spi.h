@@ -0,0 +1,20 @@
+#ifndef _STUB_HARDWARE_SPI_H
+#define _STUB_HARDWARE_SPI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct spi_inst spi_inst_t;
+#define spi0 ((spi_inst_t *)0)
+
+static inline uint32_t spi_init(spi_inst_t *spi, uint32_t baudrate) {
+    return baudrate;
+}
+static inline int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len) {
+    return len;
+}
+static inline int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len) {
+    return len;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _STUB_HARDWARE_SYNC_H
+#define _STUB_HARDWARE_SYNC_H
+
+// There are no events to wait for on the host, so waiting for one returns straight away.
+#define __dmb() __sync_synchronize()
+#define __sev() do {} while (0)
+#define __wfe() do {} while (0)
+#define tight_loop_contents() do {} while (0)
+
+#endif
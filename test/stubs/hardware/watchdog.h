@@ -0,0 +1,6 @@
+#ifndef _STUB_HARDWARE_WATCHDOG_H
+#define _STUB_HARDWARE_WATCHDOG_H
+
+// Nothing from here is used by the modules that are built for the host.
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _STUB_PICO_CRITICAL_SECTION_H
+#define _STUB_PICO_CRITICAL_SECTION_H
+
+// Host stand-in: a critical section is a spin lock, the nearest thing a thread has to the RP2040's hardware spin lock
+// with interrupts off.
+#include <pthread.h>
+
+typedef struct {
+    pthread_spinlock_t lock;
+} critical_section_t;
+
+static inline void critical_section_init(critical_section_t *crit_sec) {
+    pthread_spin_init(&crit_sec->lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static inline void critical_section_enter_blocking(critical_section_t *crit_sec) {
+    pthread_spin_lock(&crit_sec->lock);
+}
+
+static inline void critical_section_exit(critical_section_t *crit_sec) {
+    pthread_spin_unlock(&crit_sec->lock);
+}
+
+#endif
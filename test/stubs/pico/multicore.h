@@ -0,0 +1,6 @@
+#ifndef _STUB_PICO_MULTICORE_H
+#define _STUB_PICO_MULTICORE_H
+
+// Nothing from here is used by the modules that are built for the host.
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _STUB_PICO_PLATFORM_H
+#define _STUB_PICO_PLATFORM_H
+
+#include <assert.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#endif
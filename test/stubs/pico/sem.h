@@ -0,0 +1,46 @@
+#ifndef _STUB_PICO_SEM_H
+#define _STUB_PICO_SEM_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    int16_t permits;
+    int16_t max_permits;
+} semaphore_t;
+
+static inline void sem_init(semaphore_t *sem, int16_t initial_permits, int16_t max_permits) {
+    pthread_mutex_init(&sem->lock, NULL);
+    sem->permits = initial_permits;
+    sem->max_permits = max_permits;
+}
+
+static inline bool sem_try_acquire(semaphore_t *sem) {
+    pthread_mutex_lock(&sem->lock);
+    bool acquired = sem->permits > 0;
+    if (acquired) {
+        sem->permits--;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return acquired;
+}
+
+static inline bool sem_release(semaphore_t *sem) {
+    pthread_mutex_lock(&sem->lock);
+    bool released = sem->permits < sem->max_permits;
+    if (released) {
+        sem->permits++;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return released;
+}
+
+static inline void sem_reset(semaphore_t *sem, int16_t permits) {
+    pthread_mutex_lock(&sem->lock);
+    sem->permits = permits;
+    pthread_mutex_unlock(&sem->lock);
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _STUB_PICO_STDIO_H
+#define _STUB_PICO_STDIO_H
+
+#include <pico/time.h>
+#include <stdbool.h>
+
+#define PICO_ERROR_TIMEOUT -1
+
+// USB CDC stdio, backed by a pair of pipes in usb_posix/ for targets that link it.  Until a test connects the pipes,
+// nothing ever arrives, and anything sent goes nowhere.
+int stdio_get_until(char *buf, int len, absolute_time_t until);
+void stdio_put_string(const char *s, int len, bool newline, bool cr_translation);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _STUB_PICO_STDLIB_H
+#define _STUB_PICO_STDLIB_H
+
+#include <pico/platform.h>
+#include <pico/stdio.h>
+#include <pico/time.h>
+#include <pico/types.h>
+
+#endif
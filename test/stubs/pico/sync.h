@@ -0,0 +1,8 @@
+#ifndef _STUB_PICO_SYNC_H
+#define _STUB_PICO_SYNC_H
+
+#include <hardware/sync.h>
+#include <pico/critical_section.h>
+#include <pico/platform.h>
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _STUB_PICO_TIME_H
+#define _STUB_PICO_TIME_H
+
+#include <pico/types.h>
+#include <time.h>
+
+// Microseconds since the process started, standing in for the RP2040's timer.
+static inline uint64_t time_us_64() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define at_the_end_of_time ((absolute_time_t)UINT64_MAX)
+
+static inline bool is_at_the_end_of_time(absolute_time_t t) {
+    return t == at_the_end_of_time;
+}
+
+static inline absolute_time_t get_absolute_time() {
+    return time_us_64();
+}
+
+static inline absolute_time_t from_us_since_boot(uint64_t us) {
+    return us;
+}
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) {
+    return t;
+}
+
+static inline absolute_time_t make_timeout_time_us(uint64_t us) {
+    return time_us_64() + us;
+}
+
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return make_timeout_time_us((uint64_t)ms * 1000);
+}
+
+static inline bool time_reached(absolute_time_t t) {
+    return time_us_64() >= t;
+}
+
+static inline absolute_time_t absolute_time_min(absolute_time_t a, absolute_time_t b) {
+    return a < b ? a : b;
+}
+
+static inline void sleep_until(absolute_time_t t) {
+    uint64_t now = time_us_64();
+    if (t > now) {
+        struct timespec ts = {(t - now) / 1000000, ((t - now) % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static inline void sleep_us(uint64_t us) {
+    sleep_until(make_timeout_time_us(us));
+}
+
+static inline void sleep_ms(uint32_t ms) {
+    sleep_us((uint64_t)ms * 1000);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _STUB_PICO_UNIQUE_ID_H
+#define _STUB_PICO_UNIQUE_ID_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t id[8];
+} pico_unique_board_id_t;
+
+static inline void pico_get_unique_board_id(pico_unique_board_id_t *id) {
+    for (int i = 0; i < 8; i++) {
+        id->id[i] = i;
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "pico/stdio.h"
+#include "usb_posix.h"
+
+// The device's ends of the two pipes, or -1 until usb_posix_connect() has been called.
+static volatile int device_in = -1;
+static volatile int device_out = -1;
+
+bool usb_posix_connect(int *to_device, int *from_device) {
+    int in[2], out[2];
+
+    if (pipe(in) < 0) {
+        return false;
+    }
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    *to_device = in[1];
+    *from_device = out[0];
+    device_out = out[1];
+    device_in = in[0];
+    return true;
+}
+
+// Like the pico SDK's, returns as soon as there is anything at all, with as much as has arrived, up to len.
+int stdio_get_until(char *buf, int len, absolute_time_t until) {
+    while (device_in >= 0) {
+        uint64_t now = time_us_64();
+        uint64_t wait = until > now ? until - now : 0;
+        struct pollfd pfd = {.fd = device_in, .events = POLLIN};
+        struct timespec ts = {wait / 1000000, (wait % 1000000) * 1000};
+
+        int ready = ppoll(&pfd, 1, until == at_the_end_of_time ? NULL : &ts, NULL);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return PICO_ERROR_TIMEOUT;
+        }
+        int got = read(device_in, buf, len);
+        return got > 0 ? got : PICO_ERROR_TIMEOUT;
+    }
+    sleep_until(absolute_time_min(until, make_timeout_time_ms(100)));
+    return PICO_ERROR_TIMEOUT;
+}
+
+void stdio_put_string(const char *s, int len, bool newline, bool cr_translation) {
+    while (device_out >= 0 && len > 0) {
+        int sent = write(device_out, s, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+        s += sent;
+        len -= sent;
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef _USB_POSIX_H
+#define _USB_POSIX_H
+
+#include <stdbool.h>
+
+// Connects the host's stand-in for USB CDC stdio to a pair of pipes, returning the host's ends of them: requests
+// written to to_device arrive at the server as they would over USB, and its responses can be read from from_device.
+bool usb_posix_connect(int *to_device, int *from_device);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _WIZNET_POSIX_SOCKET_H
+#define _WIZNET_POSIX_SOCKET_H
+
+// Stand-in for the WIZnet ioLibrary's socket API, backed by Linux sockets, so that modbus_tcp.c can be run on the host
+// against real TCP clients.  Its socket states follow the W5100S's, with each of its sockets taking the next connection
+// to arrive while it is listening.
+//
+// The ioLibrary's names clash with the C library's, so calls to them are renamed here, and modbus_tcp.c makes these
+// without knowing.
+#include <stdint.h>
+
+#define socket(sn, protocol, port, flag) wiz_socket(sn, protocol, port, flag)
+#define listen(sn) wiz_listen(sn)
+#define disconnect(sn) wiz_disconnect(sn)
+#define send(sn, buf, len) wiz_send(sn, buf, len)
+#define recv(sn, buf, len) wiz_recv(sn, buf, len)
+
+#define Sn_MR_TCP 0x01
+
+#define SOCK_CLOSED 0x00
+#define SOCK_INIT 0x13
+#define SOCK_LISTEN 0x14
+#define SOCK_ESTABLISHED 0x17
+#define SOCK_CLOSE_WAIT 0x1C
+
+int8_t wiz_socket(uint8_t sn, uint8_t protocol, uint16_t port, uint8_t flag);
+int8_t wiz_listen(uint8_t sn);
+int8_t wiz_disconnect(uint8_t sn);
+int32_t wiz_send(uint8_t sn, uint8_t *buf, uint16_t len);
+int32_t wiz_recv(uint8_t sn, uint8_t *buf, uint16_t len);
+uint8_t getSn_SR(uint8_t sn);
+uint16_t getSn_RX_RSR(uint8_t sn);
+
+// Ports below 1024 need root, so the stand-in listens on a port of the system's choosing in place of the one asked
+// for.  This says which, or 0 until something is listening.
+uint16_t wiznet_posix_port();
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _WIZNET_POSIX_WIZCHIP_CONF_H
+#define _WIZNET_POSIX_WIZCHIP_CONF_H
+
+// Stand-in for the parts of the WIZnet ioLibrary's wizchip_conf.h that modbus_tcp.c uses.  There is no chip, so the SPI
+// callbacks are never called, and the network settings are only kept.
+#include <stdint.h>
+
+typedef enum {
+    CW_INIT_WIZCHIP,
+} ctlwizchip_type;
+
+typedef enum {
+    NETINFO_STATIC = 1,
+    NETINFO_DHCP,
+} dhcp_mode;
+
+typedef struct {
+    uint8_t mac[6];
+    uint8_t ip[4];
+    uint8_t sn[4];
+    uint8_t gw[4];
+    uint8_t dns[4];
+    dhcp_mode dhcp;
+} wiz_NetInfo;
+
+void reg_wizchip_cs_cbfunc(void (*cs_sel)(void), void (*cs_desel)(void));
+void reg_wizchip_spi_cbfunc(uint8_t (*spi_rb)(void), void (*spi_wb)(uint8_t wb));
+void reg_wizchip_spiburst_cbfunc(void (*spi_rb)(uint8_t *pBuf, uint16_t len), void (*spi_wb)(uint8_t *pBuf, uint16_t len));
+int8_t ctlwizchip(ctlwizchip_type cwtype, void *arg);
+void wizchip_setnetinfo(wiz_NetInfo *pnetinfo);
+
+#endif
@@ -0,0 +1,142 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socket.h"
+#include "wizchip_conf.h"
+
+// In here, the C library's own calls are wanted.
+#undef socket
+#undef listen
+#undef disconnect
+#undef send
+#undef recv
+
+#define NUM_SOCKETS 4
+
+typedef struct {
+    uint8_t status;
+    int fd;  // The connection, once established.
+} wiz_sock_t;
+
+static wiz_sock_t socks[NUM_SOCKETS];
+// All of the chip's listening sockets share the one host socket, which hands each connection to the first of them
+// that is listening.
+static int listen_fd = -1;
+static volatile uint16_t listen_port;
+
+void reg_wizchip_cs_cbfunc(void (*cs_sel)(void), void (*cs_desel)(void)) {
+}
+
+void reg_wizchip_spi_cbfunc(uint8_t (*spi_rb)(void), void (*spi_wb)(uint8_t wb)) {
+}
+
+void reg_wizchip_spiburst_cbfunc(void (*spi_rb)(uint8_t *pBuf, uint16_t len), void (*spi_wb)(uint8_t *pBuf, uint16_t len)) {
+}
+
+int8_t ctlwizchip(ctlwizchip_type cwtype, void *arg) {
+    return 0;
+}
+
+void wizchip_setnetinfo(wiz_NetInfo *pnetinfo) {
+}
+
+uint16_t wiznet_posix_port() {
+    return listen_port;
+}
+
+static int open_listener() {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0};
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, NUM_SOCKETS) < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    listen_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+int8_t wiz_socket(uint8_t sn, uint8_t protocol, uint16_t port, uint8_t flag) {
+    if (sn >= NUM_SOCKETS) {
+        return -1;
+    }
+    if (listen_fd < 0 && (listen_fd = open_listener()) < 0) {
+        return -1;
+    }
+    socks[sn].status = SOCK_INIT;
+    socks[sn].fd = -1;
+    return sn;
+}
+
+int8_t wiz_listen(uint8_t sn) {
+    socks[sn].status = SOCK_LISTEN;
+    return 1;
+}
+
+int8_t wiz_disconnect(uint8_t sn) {
+    if (socks[sn].fd >= 0) {
+        close(socks[sn].fd);
+        socks[sn].fd = -1;
+    }
+    socks[sn].status = SOCK_CLOSED;
+    return 1;
+}
+
+uint8_t getSn_SR(uint8_t sn) {
+    wiz_sock_t *s = &socks[sn];
+
+    if (s->status == SOCK_LISTEN) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            s->fd = fd;
+            s->status = SOCK_ESTABLISHED;
+        }
+    } else if (s->status == SOCK_ESTABLISHED && getSn_RX_RSR(sn) == 0) {
+        // Nothing left to read, so see whether the client has closed its end.
+        uint8_t b;
+        ssize_t got = recv(s->fd, &b, 1, MSG_PEEK);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            s->status = SOCK_CLOSE_WAIT;
+        }
+    }
+    return s->status;
+}
+
+uint16_t getSn_RX_RSR(uint8_t sn) {
+    int avail = 0;
+
+    if (socks[sn].fd < 0 || ioctl(socks[sn].fd, FIONREAD, &avail) < 0) {
+        return 0;
+    }
+    return avail > 0xFFFF ? 0xFFFF : avail;
+}
+
+int32_t wiz_recv(uint8_t sn, uint8_t *buf, uint16_t len) {
+    ssize_t got = recv(socks[sn].fd, buf, len, 0);
+    return got < 0 ? 0 : got;
+}
+
+int32_t wiz_send(uint8_t sn, uint8_t *buf, uint16_t len) {
+    uint16_t sent = 0;
+
+    while (sent < len) {
+        ssize_t n = send(socks[sn].fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    return sent;
+}